@@ -21,7 +21,7 @@ class COemPDEV
 {
 public:
 
-    __stdcall COemPDEV(PWSTR pPrinterName)
+    __stdcall COemPDEV(PWSTR pPrinterName, PCOEMDEV pOemDevmode)
     {
 
         // Note that since our parent has AddRef'd the UNIDRV interface,
@@ -30,7 +30,7 @@ public:
         //
 
         VERBOSE("In COemPDEV constructor...");
-        _commandHandler = new CUlpCommandHandler(pPrinterName);
+        _commandHandler = new CUlpCommandHandler(pPrinterName, pOemDevmode);
     }
 
     __stdcall ~COemPDEV(void)
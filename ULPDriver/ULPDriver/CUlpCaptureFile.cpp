@@ -0,0 +1,386 @@
+#include <Windows.h>
+#include <algorithm>
+#include "CUlpCaptureFile.h"
+
+// Compression API (CreateCompressor, Compress)
+#pragma comment(lib, "Cabinet.lib")
+
+
+namespace
+{
+    // Rings of running jobs which DumpLive writes (a ring unregisters itself before it is deleted)
+    std::mutex g_LiveRingsMutex;
+    std::vector<CUlpCaptureRing*> g_LiveRings;
+}
+
+
+    CUlpCaptureFile::CUlpCaptureFile(const char* fileName, DWORD queueDepth, DWORD compressAlgorithm)
+    {
+        m_Pool = NULL;
+        m_CompressAlgorithm = 0;
+        m_Compressor = NULL;
+        m_StreamBytes = 0;
+        m_Current = NULL;
+        m_CurrentLength = 0;
+        m_bClosing = false;
+        m_LastError = 0;
+        m_BytesWritten = 0;
+        m_AllocatedBytes = 0;
+        m_Stalls = 0;
+
+        if (queueDepth < CAPTUREQUEUEDEPTH_MIN) queueDepth = CAPTUREQUEUEDEPTH_MIN;
+
+        m_File = CreateFileA(fileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (m_File == INVALID_HANDLE_VALUE) return;
+
+        // Without a compressor the postscript is written as it is
+        if (compressAlgorithm != 0 && CreateCompressor(compressAlgorithm, NULL, &m_Compressor))
+        {
+            m_CompressAlgorithm = compressAlgorithm;
+            if (!WriteBytes(CAPTUREFILESIGNATURE, sizeof(CAPTUREFILESIGNATURE)) ||
+                !WriteBytes((const char*)&m_CompressAlgorithm, sizeof(m_CompressAlgorithm)))
+            {
+                m_LastError = GetLastError();
+            }
+        }
+
+        m_Pool = (char*)VirtualAlloc(NULL, (SIZE_T)queueDepth * CAPTUREBUFFERSIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (m_Pool != NULL)
+        {
+            try
+            {
+                for (DWORD i = 0; i < queueDepth; i++)
+                {
+                    m_Free.push_back(m_Pool + (SIZE_T)i * CAPTUREBUFFERSIZE);
+                }
+                if (m_Compressor != NULL)
+                {
+                    // Compressed frames longer than a buffer are not used anyway
+                    m_Compressed.resize(CAPTUREBUFFERSIZE);
+                }
+                m_Writer = std::thread(&CUlpCaptureFile::WriterLoop, this);
+                return;
+            }
+            catch (...) {}
+        }
+
+        // No capture without the pool and the writer
+        m_LastError = GetLastError();
+        CloseHandle(m_File);
+        m_File = INVALID_HANDLE_VALUE;
+    }
+
+    CUlpCaptureFile::~CUlpCaptureFile(void)
+    {
+        Close();
+        if (m_Pool != NULL)
+        {
+            VirtualFree(m_Pool, 0, MEM_RELEASE);
+            m_Pool = NULL;
+        }
+        if (m_Compressor != NULL)
+        {
+            CloseCompressor(m_Compressor);
+            m_Compressor = NULL;
+        }
+    }
+
+    void CUlpCaptureFile::Write(const char* bytes, DWORD count)
+    {
+        if (m_File == INVALID_HANDLE_VALUE || bytes == NULL) return;
+
+        m_StreamBytes += count;
+        while (count > 0)
+        {
+            if (m_Current == NULL)
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                if (m_Free.empty())
+                {
+                    // All buffers are queued: the disk is slower than the job, wait instead of growing
+                    m_Stalls++;
+                    m_Changed.wait(lock, [this] { return !m_Free.empty(); });
+                }
+                m_Current = m_Free.back();
+                m_Free.pop_back();
+                m_CurrentLength = 0;
+            }
+
+            DWORD part = min(count, CAPTUREBUFFERSIZE - m_CurrentLength);
+            memcpy(m_Current + m_CurrentLength, bytes, part);
+            m_CurrentLength += part;
+            bytes += part;
+            count -= part;
+
+            if (m_CurrentLength == CAPTUREBUFFERSIZE)
+            {
+                QueueCurrent();
+            }
+        }
+    }
+
+    void CUlpCaptureFile::QueueCurrent()
+    {
+        if (m_Current == NULL) return;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Queued.push_back(Chunk{ m_Current, m_CurrentLength });
+        }
+        m_Changed.notify_all();
+        m_Current = NULL;
+        m_CurrentLength = 0;
+    }
+
+    void CUlpCaptureFile::Close()
+    {
+        if (m_File == INVALID_HANDLE_VALUE) return;
+
+        if (m_CurrentLength > 0)
+        {
+            QueueCurrent();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_bClosing = true;
+        }
+        m_Changed.notify_all();
+        if (m_Writer.joinable())
+        {
+            m_Writer.join();
+        }
+
+        // The part of the preallocated extent beyond the end of file is released by the file system on close
+        CloseHandle(m_File);
+        m_File = INVALID_HANDLE_VALUE;
+    }
+
+    void CUlpCaptureFile::WriterLoop()
+    {
+        for (;;)
+        {
+            Chunk chunk;
+            bool bFailed;
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_Changed.wait(lock, [this] { return !m_Queued.empty() || m_bClosing; });
+                if (m_Queued.empty()) return;   // closing and everything written
+                chunk = m_Queued.front();
+                m_Queued.pop_front();
+                bFailed = m_LastError != 0;
+            }
+
+            DWORD lastError = 0;
+            if (!bFailed && !WriteChunk(chunk))
+            {
+                lastError = GetLastError();
+                if (lastError == 0) lastError = ERROR_WRITE_FAULT;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                if (lastError != 0) m_LastError = lastError;
+                m_Free.push_back(chunk.data);
+            }
+            m_Changed.notify_all();
+        }
+    }
+
+    bool CUlpCaptureFile::WriteChunk(const Chunk& chunk)
+    {
+        if (m_Compressor == NULL)
+        {
+            return WriteBytes(chunk.data, chunk.length);
+        }
+
+        // Incompressible buffers (or a failing compressor) are stored as they are
+        const char* frame = chunk.data;
+        SIZE_T frameLength = chunk.length;
+        SIZE_T compressedLength = 0;
+        if (Compress(m_Compressor, chunk.data, chunk.length, m_Compressed.data(), m_Compressed.size(), &compressedLength) &&
+            compressedLength < chunk.length)
+        {
+            frame = m_Compressed.data();
+            frameLength = compressedLength;
+        }
+
+        DWORD frameHeader[2] = { chunk.length, (DWORD)frameLength };
+        return WriteBytes((const char*)frameHeader, sizeof(frameHeader)) && WriteBytes(frame, (DWORD)frameLength);
+    }
+
+    bool CUlpCaptureFile::WriteBytes(const char* data, DWORD count)
+    {
+        // Reserve disk space ahead, so that the file's allocation does not grow on every write
+        if (m_BytesWritten + count > m_AllocatedBytes)
+        {
+            FILE_ALLOCATION_INFO allocationInfo;
+            allocationInfo.AllocationSize.QuadPart = (LONGLONG)(m_AllocatedBytes + CAPTUREPREALLOCATEBYTES);
+            if (SetFileInformationByHandle(m_File, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo)))
+            {
+                m_AllocatedBytes += CAPTUREPREALLOCATEBYTES;
+            }
+            else
+            {
+                // Don't try again for this file
+                m_AllocatedBytes = MAXULONGLONG;
+            }
+        }
+
+        while (count > 0)
+        {
+            DWORD bytesWritten = 0;
+            if (!WriteFile(m_File, data, count, &bytesWritten, NULL) || bytesWritten == 0)
+            {
+                return false;
+            }
+            data += bytesWritten;
+            count -= bytesWritten;
+            m_BytesWritten += bytesWritten;
+        }
+        return true;
+    }
+
+
+
+    CUlpCaptureRing::CUlpCaptureRing(size_t ringBytes)
+    {
+        m_RingSize = ringBytes > 0 ? ringBytes : 1;
+        m_CommittedSize = 0;
+        m_Next = 0;
+        m_StreamBytes = 0;
+        m_Ring = (char*)VirtualAlloc(NULL, m_RingSize, MEM_RESERVE, PAGE_READWRITE);
+    }
+
+    CUlpCaptureRing::~CUlpCaptureRing(void)
+    {
+        if (!m_LiveDumpFileName.empty())
+        {
+            std::lock_guard<std::mutex> lock(g_LiveRingsMutex);
+            g_LiveRings.erase(std::remove(g_LiveRings.begin(), g_LiveRings.end(), this), g_LiveRings.end());
+        }
+        if (m_Ring != NULL)
+        {
+            VirtualFree(m_Ring, 0, MEM_RELEASE);
+            m_Ring = NULL;
+        }
+    }
+
+    // Commits the reserved ring up to bytesNeeded (in steps of CAPTUREBUFFERSIZE)
+    bool CUlpCaptureRing::Commit(size_t bytesNeeded)
+    {
+        if (bytesNeeded <= m_CommittedSize) return true;
+
+        size_t newSize = min(m_RingSize, max(bytesNeeded, m_CommittedSize + CAPTUREBUFFERSIZE));
+        if (VirtualAlloc(m_Ring + m_CommittedSize, newSize - m_CommittedSize, MEM_COMMIT, PAGE_READWRITE) == NULL)
+        {
+            return false;
+        }
+        m_CommittedSize = newSize;
+        return true;
+    }
+
+    void CUlpCaptureRing::Write(const char* bytes, DWORD count)
+    {
+        if (m_Ring == NULL || bytes == NULL || count == 0) return;
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (count > m_RingSize)
+        {
+            // Only the last m_RingSize bytes survive
+            m_StreamBytes += count - m_RingSize;
+            bytes += count - m_RingSize;
+            count = (DWORD)m_RingSize;
+        }
+
+        while (count > 0)
+        {
+            size_t part = min((size_t)count, m_RingSize - m_Next);
+            if (!Commit(m_Next + part))
+            {
+                // Out of memory before the ring has been filled once: the ring ends at what has been committed
+                if (m_CommittedSize == 0) return;
+                m_RingSize = m_CommittedSize;
+                if (m_Next == m_RingSize) m_Next = 0;
+                continue;
+            }
+            memcpy(m_Ring + m_Next, bytes, part);
+            m_Next = (m_Next + part) % m_RingSize;
+            m_StreamBytes += part;
+            bytes += part;
+            count -= (DWORD)part;
+        }
+    }
+
+    void CUlpCaptureRing::EnableLiveDump(const char* fileName)
+    {
+        if (fileName == NULL || fileName[0] == '\0' || !m_LiveDumpFileName.empty()) return;
+
+        std::lock_guard<std::mutex> lock(g_LiveRingsMutex);
+        m_LiveDumpFileName = fileName;
+        g_LiveRings.push_back(this);
+    }
+
+    void CUlpCaptureRing::DumpLive(const char* reason)
+    {
+        std::lock_guard<std::mutex> lock(g_LiveRingsMutex);
+        for (CUlpCaptureRing* ring : g_LiveRings)
+        {
+            ring->WriteTo(ring->m_LiveDumpFileName.c_str(), reason);
+        }
+    }
+
+    DWORD CUlpCaptureRing::WriteTo(const char* fileName, const char* reason)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return WriteToLocked(fileName, reason);
+    }
+
+    DWORD CUlpCaptureRing::WriteToLocked(const char* fileName, const char* reason)
+    {
+        if (m_Ring == NULL) return ERROR_NOT_ENOUGH_MEMORY;
+
+        HANDLE file = CreateFileA(fileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                                  FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) return GetLastError();
+
+        char header[400];
+        int headerLength = sprintf_s(header, sizeof(header),
+                                     "%%ULPDriver PostScript tail capture: %s\r\n"
+                                     "%%StreamBytes: %llu\r\n"
+                                     "%%FirstRetainedOffset: %llu\r\n"
+                                     "%%RetainedBytes: %llu\r\n",
+                                     reason != NULL ? reason : "???", m_StreamBytes,
+                                     FirstRetainedOffset(), (unsigned __int64)RetainedBytes());
+
+        // Oldest byte first: behind m_Next once the ring has been filled
+        typedef struct Part
+        {
+            const char* data;
+            size_t length;
+        } Part;
+        Part parts[3] = { { header, headerLength > 0 ? (size_t)headerLength : 0 }, { NULL, 0 }, { m_Ring, m_Next } };
+        if (m_StreamBytes >= m_RingSize)
+        {
+            parts[1] = Part{ m_Ring + m_Next, m_RingSize - m_Next };
+        }
+
+        DWORD lastError = 0;
+        for (const Part& part : parts)
+        {
+            const char* data = part.data;
+            size_t bytesToWrite = part.length;
+            while (bytesToWrite > 0 && lastError == 0)
+            {
+                DWORD bytesWritten = 0;
+                if (!WriteFile(file, data, (DWORD)min(bytesToWrite, (size_t)CAPTUREBUFFERSIZE), &bytesWritten, NULL) || bytesWritten == 0)
+                {
+                    lastError = GetLastError();
+                    if (lastError == 0) lastError = ERROR_WRITE_FAULT;
+                }
+                data += bytesWritten;
+                bytesToWrite -= bytesWritten;
+            }
+        }
+        CloseHandle(file);
+        return lastError;
+    }
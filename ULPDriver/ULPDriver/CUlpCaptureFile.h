@@ -0,0 +1,156 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpCaptureFile.h
+//
+//  PURPOSE:   Header for the PostScript capture file (HKLM-LogoPrint2-Key LPDriverPSDebugFile): postscript is
+//             copied into a bounded pool of large buffers and written (optionally compressed) by a background
+//             thread, and for the tail capture keeping only the last bytes of the stream in memory
+//
+
+#pragma once
+#include <windows.h>
+#include <compressapi.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+const DWORD CAPTUREBUFFERSIZE = 1024 * 1024;        // bytes written to the file at once
+const DWORD CAPTUREQUEUEDEPTH_DEFAULT = 4;          // default number of buffers (memory used is CAPTUREBUFFERSIZE each)
+const DWORD CAPTUREQUEUEDEPTH_MIN = 2;              // one buffer filled while another one is written
+const DWORD CAPTUREPREALLOCATEBYTES = 16 * CAPTUREBUFFERSIZE;   // extent reserved ahead of the end of file
+const DWORD CAPTURETAILMB_MAX = 1024;               // maximum size of the tail capture (see HKLM-LogoPrint2-Key PSDebugTailMB)
+
+// A compressed capture starts with CAPTUREFILESIGNATURE and the COMPRESS_ALGORITHM_* (DWORD), followed by one frame per
+// buffer: uncompressed length (DWORD), frame length (DWORD), frame. Frames as long as their uncompressed length are stored
+// as they are, all others are compressed in buffer mode (Decompress each frame on its own).
+const char CAPTUREFILESIGNATURE[8] = { 'U', 'L', 'P', 'C', 'A', 'P', '1', '\0' };
+
+
+class CUlpCaptureFile
+{
+
+private:
+    typedef struct Chunk
+    {
+        char* data;
+        DWORD length;
+    } Chunk;
+
+    HANDLE m_File;  // To be freed
+
+    // All buffers in one page-aligned allocation (VirtualAlloc), to be freed
+    char* m_Pool;
+
+    // Buffer filled by Write (NULL if none taken from m_Free yet)
+    char* m_Current;
+    DWORD m_CurrentLength;
+
+    // Shared with the writer thread, guarded by m_Mutex
+    std::mutex m_Mutex;
+    std::condition_variable m_Changed;
+    std::vector<char*> m_Free;
+    std::deque<Chunk> m_Queued;
+    bool m_bClosing;
+    DWORD m_LastError;
+
+    std::thread m_Writer;
+
+    // COMPRESS_ALGORITHM_* the buffers are compressed with, 0 if not compressed
+    DWORD m_CompressAlgorithm;
+    COMPRESSOR_HANDLE m_Compressor;  // To be freed
+
+    // Only used by the writer thread until it has been joined
+    unsigned __int64 m_BytesWritten;
+    unsigned __int64 m_AllocatedBytes;
+    std::vector<char> m_Compressed;
+
+    // Only used by Write
+    unsigned __int64 m_StreamBytes;
+
+    DWORD m_Stalls;
+
+    void WriterLoop();
+    bool WriteChunk(const Chunk& chunk);
+    bool WriteBytes(const char* data, DWORD count);
+    void QueueCurrent();
+
+public:
+
+    // Creates fileName and starts the writer, queueDepth buffers of CAPTUREBUFFERSIZE are used at most.
+    // compressAlgorithm: COMPRESS_ALGORITHM_* (e.g. XPRESS for speed), 0 to write the postscript as it is
+    CUlpCaptureFile(const char* fileName, DWORD queueDepth, DWORD compressAlgorithm);
+    ~CUlpCaptureFile(void);
+
+    bool IsOpen() { return m_File != INVALID_HANDLE_VALUE; }
+
+    // Copies bytes into the current buffer (waits for the writer only if all buffers are queued)
+    void Write(const char* bytes, DWORD count);
+
+    // Queues the current buffer, waits until everything has been written and closes the file
+    void Close();
+
+    // Statistics, complete after Close
+    unsigned __int64 StreamBytes() { return m_StreamBytes; }    // bytes passed to Write
+    unsigned __int64 BytesWritten() { return m_BytesWritten; }  // bytes written to the file (after compression)
+    DWORD Stalls() { return m_Stalls; }      // number of times Write waited for a free buffer
+    DWORD LastError() { return m_LastError; }  // error of the first failed WriteFile (later bytes are dropped), 0 if none
+    DWORD CompressAlgorithm() { return m_CompressAlgorithm; }  // 0 if the compressor could not be created
+
+};
+
+
+// Keeps the last bytes of the stream in a fixed-size ring (nothing is written to disk until WriteTo is called).
+// The ring is reserved at once and committed as the stream grows, so small jobs cost little memory.
+// Rings with a live dump file can be written by another thread while their job runs (see DumpLive).
+class CUlpCaptureRing
+{
+
+private:
+    // Reserved with VirtualAlloc, to be freed
+    char* m_Ring;
+    size_t m_RingSize;
+    size_t m_CommittedSize;
+
+    size_t m_Next;                      // position in m_Ring the next byte is written to
+    unsigned __int64 m_StreamBytes;     // bytes appended since the start of the stream
+
+    // Guards the ring against DumpLive (uncontended unless a dump is running)
+    std::mutex m_Mutex;
+
+    // File DumpLive writes to, empty if not registered
+    std::string m_LiveDumpFileName;
+
+    DWORD WriteToLocked(const char* fileName, const char* reason);
+
+    bool Commit(size_t bytesNeeded);
+
+public:
+
+    CUlpCaptureRing(size_t ringBytes);
+    ~CUlpCaptureRing(void);
+
+    bool IsOpen() { return m_Ring != NULL; }
+
+    void Write(const char* bytes, DWORD count);
+
+    unsigned __int64 StreamBytes() { return m_StreamBytes; }
+
+    // Absolute stream offset of the oldest byte still in the ring
+    unsigned __int64 FirstRetainedOffset() { return m_StreamBytes - RetainedBytes(); }
+    size_t RetainedBytes() { return m_StreamBytes < m_RingSize ? (size_t)m_StreamBytes : m_RingSize; }
+
+    // Writes a header (reason, stream size, offset of the first retained byte) and the ring's content
+    // (oldest byte first) to fileName. Returns the error of CreateFile/WriteFile, 0 on success.
+    DWORD WriteTo(const char* fileName, const char* reason);
+
+    // Registers the ring for DumpLive until it is deleted
+    void EnableLiveDump(const char* fileName);
+
+    // Writes every registered ring to its live dump file (on demand, for running or hung jobs)
+    static void DumpLive(const char* reason);
+
+};
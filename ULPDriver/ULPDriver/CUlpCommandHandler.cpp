@@ -18,6 +18,7 @@
 #include "winspool.h"
 #include <syncstream>
 #include <future>
+#include <atomic>
 #include <cstdio>
 #include <ctime>
 #include <cstdlib>
@@ -26,6 +27,7 @@
 #include <windows.h>
 #include <tchar.h>
 #include <psapi.h>
+#include <bcrypt.h>
 
 #include "CUlpLog.h"
 #include "CUlpCommandHandler.h"
@@ -35,152 +37,398 @@
 
 #define sync_cout std::osyncstream(std::cout)
 
+// BCryptGenRandom
+#pragma comment(lib, "bcrypt.lib")
+
 // This indicates to Prefast that this is a usermode driver file.
 _Analysis_mode_(_Analysis_code_type_user_driver_);
 
 
+namespace
+{
+    // Driver-job-ids of this process are a random start (once per process) plus a counter:
+    // unique within the process, no shared rand() state and no lock
+    std::atomic<unsigned long> g_DriverJobIdCounter(0);
+
+    unsigned long DriverJobIdStart()
+    {
+        unsigned long start = 0;
+        if (!BCRYPT_SUCCESS(BCryptGenRandom(NULL, (PUCHAR)&start, sizeof(start), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+        {
+            start = (unsigned long)GetTickCount64() ^ (GetCurrentProcessId() << 12);
+        }
+        return start;
+    }
+
+    // Jobs of this process which matched the PostScript capture policy (one in HKLM PSDebugSampleEvery of them is captured)
+    std::atomic<DWORD> g_PSCaptureCandidates(0);
+
+    // Returns true if text matches one of the comma or semicolon separated entries of list:
+    // starts with it (prefix) or contains it ignoring case
+    bool MatchesListEntry(const std::string& text, const char* list, bool prefix)
+    {
+        std::string lowerText(text);
+        for (char& c : lowerText) c = (char)tolower((unsigned char)c);
+
+        const char* entryStart = list;
+        while (*entryStart != '\0')
+        {
+            const char* entryEnd = entryStart;
+            while (*entryEnd != '\0' && *entryEnd != ',' && *entryEnd != ';') entryEnd++;
+
+            std::string entry(entryStart, entryEnd);
+            size_t first = entry.find_first_not_of(' ');
+            size_t last = entry.find_last_not_of(' ');
+            if (first != std::string::npos)
+            {
+                entry = entry.substr(first, last - first + 1);
+                if (prefix)
+                {
+                    if (text.compare(0, entry.size(), entry) == 0) return true;
+                }
+                else
+                {
+                    for (char& c : entry) c = (char)tolower((unsigned char)c);
+                    if (lowerText.find(entry) != std::string::npos) return true;
+                }
+            }
+            entryStart = *entryEnd != '\0' ? entryEnd + 1 : entryEnd;
+        }
+        return false;
+    }
+}
+
+
 // Fills char-buffer cbCurrentPageNumber with current page number
 void CUlpCommandHandler::SetCurrentPageNumber(int n)
 {
-    _iCurrentPageNumber = n;
-    ZeroMemory(_cbCurrentPageNumber, sizeof(_cbCurrentPageNumber));
-    StringCbPrintfA(_cbCurrentPageNumber, sizeof(_cbCurrentPageNumber), "%d", n);
-    _Log->LogVarUL("Current Page Number", n);
-    _Log->LogFlush();
+    _State.iCurrentPageNumber = n;
+    _State.dwCurrentPageNumberLength = (DWORD)CUlpDSCTemplate::FormatDecimal(_State.cbCurrentPageNumber, sizeof(_State.cbCurrentPageNumber), n);
+    if (_State.bLogCurrentInjection)
+    {
+        _Log->LogVarUL("Current Page Number", n);
+        _Log->LogFlush();
+    }
 }
 
 // Creates driver-job-id lDriverJobId and fills char-buffer cbDriverJobId 
 void CUlpCommandHandler::CreateDriverJobId()
 {
-    ZeroMemory(_cbDriverJobId, sizeof(_cbDriverJobId));
+    ZeroMemory(_State.cbDriverJobId, sizeof(_State.cbDriverJobId));
     long lowerBoundDriverJobId = 10000000;
     long upperBoundDriverJobId = 99999999;
-    srand((time(NULL) - 1538123990) & 0x8FFFFFFF);
-    _lDriverJobId = ((rand() * RAND_MAX + rand()) % (upperBoundDriverJobId - lowerBoundDriverJobId)) + lowerBoundDriverJobId;
-    StringCbPrintfA(_cbDriverJobId, sizeof(_cbDriverJobId), "%d", _lDriverJobId);
+    static const unsigned long driverJobIdStart = DriverJobIdStart();   // initialized once, thread-safe
+    unsigned long next = driverJobIdStart + g_DriverJobIdCounter.fetch_add(1, std::memory_order_relaxed);
+    _State.lDriverJobId = (long)(next % (unsigned long)(upperBoundDriverJobId - lowerBoundDriverJobId)) + lowerBoundDriverJobId;
+    StringCbPrintfA(_State.cbDriverJobId, sizeof(_State.cbDriverJobId), "%d", _State.lDriverJobId);
 }
 
 void CUlpCommandHandler::InitCommandHandler()
 {
 
-    _Log = new CUlpLog(_T("LogoPrint_LPDriver"));
+    // Settings are taken from the process-wide snapshot: no registry access per job
+    _Config = CUlpConfig::Get();
+
+    _Log = new CUlpLog(_T("LogoPrint_LPDriver"), _Config, GetLogSettings());
     _Log->EnterSection("Initializing ULPCommandHandler (V1.20)");
+    _Log->LogVarUL("Config generation", _Config->Generation());
+    _Log->LogVar("Config source", _Config->SourceName());
+
+    // Per-printer tuning (private DEVMODE) wins over the registry
+    _State.dwWriteCoalesceBytes = _OemDevmode.dwWriteCoalesceBytes != 0
+                          ? _OemDevmode.dwWriteCoalesceBytes
+                          : __min(_Config->GetInt(HKEY_LOCAL_MACHINE, _T("WriteCoalesceBytes"), 0), (DWORD)OEMWRITECOALESCE_MAX);
+    _pipeWriteBuffer.reserve(_State.dwWriteCoalesceBytes);
+    _Log->LogVarUL("DEVMODE TransportMode", _OemDevmode.dwTransportMode);
+    _Log->LogVarUL("DEVMODE LogLevel", _OemDevmode.dwLogLevel);
+    _Log->LogVarUL("DEVMODE RingKB", _OemDevmode.dwRingKB);
+    _Log->LogVarUL("DEVMODE QueueDepth", _OemDevmode.dwQueueDepth);
+    _Log->LogVarUL("DEVMODE CompressionLevel", _OemDevmode.dwCompressionLevel);
+    _Log->LogVarUL("WriteCoalesceBytes", _State.dwWriteCoalesceBytes);
+
+    // Pattern (truncated to DSCCOMMANDMAXSIZE) followed by CRLF
+    _DSCCommandPattern.assign(_Config->DSCCommandPattern(), strnlen_s(_Config->DSCCommandPattern(), DSCCOMMANDMAXSIZE - 3));
+    _DSCCommandPattern.append("\r\n");
+    _Log->LogVar("LOGOPRINT_DSCCOMMAND", _DSCCommandPattern.c_str());
+
+    ZeroMemory(SETPARAMIDCOMMANDNAME, sizeof(SETPARAMIDCOMMANDNAME));
+    strcpy_s(SETPARAMIDCOMMANDNAME, sizeof(SETPARAMIDCOMMANDNAME), _Config->SetParamIdCommandName());
+    _Log->LogVar("SETPARAMIDCOMMANDNAME", SETPARAMIDCOMMANDNAME);
+
+    // How the propietary DSC comment for SetParamId-command starts (is used to identify a SetParamId-command)
+    char setParamIdCommandPrefix[PLACEHOLDERMAXSIZE];
+    sprintf_s(setParamIdCommandPrefix, sizeof(setParamIdCommandPrefix), "\r\n%s%s", _Config->DSCPrefix(), _Config->SetParamIdCommandName());
+    _Log->LogVar("SETPARAMIDCOMMANDPREFIX", setParamIdCommandPrefix);
 
-    InitCommandNames();
-    InitIsInjectCommand();
+    // Initialize page number
+    _Log->LogLine("Setting page number to 0 ...");
+    SetCurrentPageNumber(0);
+
+    //_bStreaming = true;
+
+    // Create driver-job-id lDriverJobId and fill char-buffer cbDriverJobId 
+    _Log->LogLine("Creating driverJobId ...");
+    CreateDriverJobId();
+    _Log->LogVar("cbDriverJobId", _State.cbDriverJobId);
+    CompileDSCTemplates();
 
-    ZeroMemory(LOGOPRINT_DSCCOMMAND, sizeof(LOGOPRINT_DSCCOMMAND));
-    auto read_reg_str_future = std::async(&ulpHelper::ReadLogoPrintRegStr, HKEY_LOCAL_MACHINE, _T("DSCCommandCStylePattern"));
-    ulpHelper::CharBuffer* pattern = read_reg_str_future.get();
-    //ulpHelper::CharBuffer* pattern = ulpHelper::ReadLogoPrintRegStr(HKEY_LOCAL_MACHINE, _T("DSCCommandCStylePattern"));    // something like  %%UCSLogoPrint %s(%s) [%d]
-    if (pattern != NULL) {
-        strcpy_s(LOGOPRINT_DSCCOMMAND, sizeof(LOGOPRINT_DSCCOMMAND), pattern->GetBufferAnsi());
+    if (_Config->GetInt(HKEY_LOCAL_MACHINE, _T("PageFingerprint"), 0) != 0)
+    {
+        // The plugin's own marks are recognized by the literal start of the pattern (none if printf is used)
+        _PageFingerprint = std::make_unique<CUlpPageFingerprint>(_DSCMarkPrefix);
+        _Log->LogVar("PageFingerprint skips lines starting with", _DSCMarkPrefix.c_str());
     }
-    else {
-        // Default if DSCCommandCStylePattern is not found
-        strcpy_s(LOGOPRINT_DSCCOMMAND, sizeof(LOGOPRINT_DSCCOMMAND), "%%UCSLogoPrint %s(%s) [%s]");
+
+    if (_Config->GetInt(HKEY_LOCAL_MACHINE, _T("PageManifest"), 0) != 0)
+    {
+        _PageManifest = std::make_unique<CUlpPageManifest>();
+        _Log->LogLine("Page manifest will be sent at the end of the job.");
     }
 
-    size_t textLength = strnlen_s(LOGOPRINT_DSCCOMMAND, sizeof(LOGOPRINT_DSCCOMMAND));
-    if (textLength < 0) textLength = 0;
-    if (textLength <= sizeof(LOGOPRINT_DSCCOMMAND) - 3)
+    // Test hooks are allocated only if configured
+    DWORD padCommentCharCount = _Config->GetInt(HKEY_CURRENT_USER, _T("PadCommentCharCount"), 0);
+    if (padCommentCharCount >= MAXPADCHARS) padCommentCharCount = 0;
+    if (_Config->PSInjectToFail() > 0 || padCommentCharCount > 0)
     {
-        LOGOPRINT_DSCCOMMAND[textLength] = '\r';
-        LOGOPRINT_DSCCOMMAND[textLength + 1] = '\n';
-        LOGOPRINT_DSCCOMMAND[textLength + 2] = '\0';
+        _TestHooks = std::make_unique<TestHooks>();
+        _TestHooks->dwPSInjectToFail = _Config->PSInjectToFail();
+        _TestHooks->dwPSInjectToFailErrorCode = _Config->PSInjectToFailErrorCode();
     }
-    else {
-        LOGOPRINT_DSCCOMMAND[sizeof(LOGOPRINT_DSCCOMMAND) - 3] = '\r';
-        LOGOPRINT_DSCCOMMAND[sizeof(LOGOPRINT_DSCCOMMAND) - 2] = '\n';
-        LOGOPRINT_DSCCOMMAND[sizeof(LOGOPRINT_DSCCOMMAND) - 1] = '\0';
+
+    _Payloads = CUlpPayloads::Get(_Config);
+    _Log->LogVarUL("Payloads", _Payloads->Count());
+    if (_Payloads->Rejected() > 0)
+    {
+        _Log->LogVarUL("!!! Payloads ignored (PScript5's postscript must not be replaced)", _Payloads->Rejected());
     }
-    if (pattern)
+
+    _injectionBuffer.reserve(PLACEHOLDERMAXSIZE * 2);
+    if (padCommentCharCount > 0)
     {
-        pattern->free();
+        _Log->LogLine("Preparing pad comment for testing buffer overlap ...");
+        const char* padCharPattern = "%%UCSLogoPrint PAD\r\n";
+        size_t patternLength = strlen(padCharPattern);
+        for (size_t numPatterns = padCommentCharCount / patternLength; numPatterns > 0; numPatterns--)
+        {
+            _TestHooks->padChars.append(padCharPattern, patternLength);
+        }
+        _injectionBuffer.reserve(PLACEHOLDERMAXSIZE * 2 + _TestHooks->padChars.size());
+        _Log->LogVarUL("PadCommentCharCount", _TestHooks->padChars.size());
     }
-    _Log->LogVar("LOGOPRINT_DSCCOMMAND", LOGOPRINT_DSCCOMMAND);
 
-    ZeroMemory(SETPARAMIDCOMMANDNAME, sizeof(SETPARAMIDCOMMANDNAME));
-    read_reg_str_future = std::async(&ulpHelper::ReadLogoPrintRegStr, HKEY_LOCAL_MACHINE, _T("DSCCommandSetParamId"));
-    ulpHelper::CharBuffer* setParamIdDSCCommandName = read_reg_str_future.get();
-    //ulpHelper::CharBuffer* setParamIdDSCCommandName = ulpHelper::ReadLogoPrintRegStr(HKEY_LOCAL_MACHINE, _T("DSCCommandSetParamId"));
-    strcpy_s(SETPARAMIDCOMMANDNAME, sizeof(SETPARAMIDCOMMANDNAME), setParamIdDSCCommandName->GetBufferAnsi());
-    _Log->LogVar("SETPARAMIDCOMMANDNAME", SETPARAMIDCOMMANDNAME);
+    _Log->LogLine("Creating driver debug file (if requested by reg) ...");
+    CreateDriverPSDebugFile();
 
-    ZeroMemory(SETPARAMIDCOMMANDPREFIX, sizeof(SETPARAMIDCOMMANDPREFIX));
-    read_reg_str_future = std::async(&ulpHelper::ReadLogoPrintRegStr, HKEY_LOCAL_MACHINE, _T("DSCCommandSetParamId"));
-    ulpHelper::CharBuffer* DSC_Prefix = read_reg_str_future.get();
-    //ulpHelper::CharBuffer* DSC_Prefix = ulpHelper::ReadLogoPrintRegStr(HKEY_LOCAL_MACHINE, _T("DSCPrefix"));
-    sprintf_s(SETPARAMIDCOMMANDPREFIX, sizeof(SETPARAMIDCOMMANDPREFIX), "\r\n%s%s", DSC_Prefix->GetBufferAnsi(), setParamIdDSCCommandName->GetBufferAnsi());
-    if (DSC_Prefix)
+    _Log->LogLine("Creating driver trace file (if requested by reg) ...");
+    CreateDriverTraceFile();
+
+    if (_Config->LatencyCsvFile()[0] != '\0')
     {
-        DSC_Prefix->free();
+        _Log->LogVar("LatencyCsvFile", _Config->LatencyCsvFile());
     }
-    if (setParamIdDSCCommandName)
+
+    _Log->LogLine("Starting LPSpooler and pipe ...");
+    _UlpSpooler = new CUlpSpoolerPipe(_State.lDriverJobId, _Log, _Config.get());
+    SetMarkerInterest(_UlpSpooler->MarkerInterest());
+
+    DWORD prologDedupMaxKB = _Config->GetInt(HKEY_LOCAL_MACHINE, _T("PrologDedupMaxKB"), PROLOGDEDUPMAXKB_DEFAULT);
+    if (_UlpSpooler->SupportsPrologDedup() && prologDedupMaxKB > 0)
     {
-        setParamIdDSCCommandName->free();
+        // The plugin's marks within the prolog carry the driver-job-id, they are not part of the hashed prolog
+        _PrologDedup = std::make_unique<CUlpPrologDedup>(_UlpSpooler->KnownPrologs(), prologDedupMaxKB * 1024, _DSCMarkPrefix);
+        _Log->LogVarUL("PrologDedupMaxKB", prologDedupMaxKB);
     }
-    _Log->LogVar("SETPARAMIDCOMMANDPREFIX", SETPARAMIDCOMMANDPREFIX);
 
-    // Initialize page number
-    _Log->LogLine("Setting page number to 0 ...");
-    SetCurrentPageNumber(0);
+    _Log->LogVarUL("sizeof(CUlpCommandHandler)", sizeof(CUlpCommandHandler));
+    _Log->LogVarUL("sizeof(JobState)", sizeof(JobState));
 
-    //_bStreaming = true;
+    _Log->EnterSection("Start streaming postscript (V1.20)");
+    _State.bIsInitalized = true;
+}
 
-    // Create driver-job-id lDriverJobId and fill char-buffer cbDriverJobId 
-    _Log->LogLine("Creating driverJobId ...");
-    CreateDriverJobId();
-    _Log->LogVar("cbDriverJobId", _cbDriverJobId);
-    bool success = false;
-    auto ReadLogoPrintRegInt = static_cast<DWORD(*)(HKEY, LPCTSTR, DWORD)>(ulpHelper::ReadLogoPrintRegInt);
-    auto read_reg_int_future = std::async(ReadLogoPrintRegInt, HKEY_CURRENT_USER, _T("PSInjectToFail"),0);
 
-    DWORD dwPSInjectToFail = read_reg_int_future.get();
 
-    //DWORD dwPSInjectToFail = ulpHelper::ReadLogoPrintRegInt(HKEY_CURRENT_USER, _T("PSInjectToFail"), 0);
+// Parses _DSCCommandPattern once and binds driver-job-id and command names into one template per injection point
+void CUlpCommandHandler::CompileDSCTemplates()
+{
+    _DSCCommandTemplates.clear();
+    _DSCSetParamIdTemplate = CUlpDSCTemplate();
+    _DSCMarkPrefix.clear();
 
-    if (dwPSInjectToFail > 0)
+    CUlpDSCTemplate pattern;
+    if (!pattern.Compile(_DSCCommandPattern.c_str()))
     {
-        _dwPSInjectToFail = dwPSInjectToFail;
-        read_reg_int_future = std::async( ReadLogoPrintRegInt, HKEY_CURRENT_USER, _T("PSInjectToFailErrorCode"), ERROR_BAD_PIPE);
-        _dwPSInjectToFailErrorCode = read_reg_int_future.get();
-        //_dwPSInjectToFailErrorCode = ulpHelper::ReadLogoPrintRegInt(HKEY_CURRENT_USER, _T("PSInjectToFailErrorCode"), ERROR_BAD_PIPE); // default ERROR_BAD_PIPE
+        _Log->LogLine("!!! LOGOPRINT_DSCCOMMAND uses unsupported conversions -> marks are formatted by printf");
+        return;
     }
+    _DSCMarkPrefix = pattern.LiteralPrefix();
 
-    _Log->LogLine("Creating driver debug file (if requested by reg) ...");
-    CreateDriverPSDebugFile();
+    CUlpDSCTemplate jobPattern = pattern.Bind(DSCSLOT_JOBID, _State.cbDriverJobId, strnlen_s(_State.cbDriverJobId, sizeof(_State.cbDriverJobId)));
+    _DSCCommandTemplates.resize(MAXCOMMAND + 1);
+    for (int i = 0; i <= MAXCOMMAND; i++)
+    {
+        const ulpInjectionPoints::InjectionPoint& injectionPoint = ulpInjectionPoints::INJECTIONPOINTS[i];
+        if (injectionPoint.name != NULL)
+        {
+            _DSCCommandTemplates[i] = jobPattern.Bind(DSCSLOT_NAME, injectionPoint.name, injectionPoint.nameLength);
+        }
+    }
+    _DSCSetParamIdTemplate = jobPattern.Bind(DSCSLOT_NAME, SETPARAMIDCOMMANDNAME, strnlen_s(SETPARAMIDCOMMANDNAME, sizeof(SETPARAMIDCOMMANDNAME)));
+    _Log->LogLine("Precompiled LOGOPRINT_DSCCOMMAND for all injection points.");
+}
 
-    _Log->LogLine("Starting LPSpooler and pipe ...");
-    _UlpSpooler = new CUlpSpoolerPipe(_lDriverJobId, _Log);
+void CUlpCommandHandler::SetMarkerInterest(const std::string& markerInterest)
+{
+    _markerInterest.reset();
+    _State.bHasMarkerInterest = false;
+    if (markerInterest.empty()) return;
 
-    _Log->EnterSection("Start streaming postscript (V1.20)");
-    _bIsInitalized = true;
+    // Names (with or without PSINJECT_) or numbers, separated by commas or spaces
+    size_t pos = 0;
+    while (pos < markerInterest.size())
+    {
+        size_t end = markerInterest.find_first_of(", ", pos);
+        if (end == std::string::npos) end = markerInterest.size();
+        std::string token = markerInterest.substr(pos, end - pos);
+        pos = end + 1;
+        if (token.empty()) continue;
+
+        if (token.find_first_not_of("0123456789") == std::string::npos)
+        {
+            unsigned long index = strtoul(token.c_str(), NULL, 10);
+            if (index <= (unsigned long)MAXCOMMAND) _markerInterest.set(index);
+            continue;
+        }
+
+        if (_strnicmp(token.c_str(), "PSINJECT_", 9) != 0) token.insert(0, "PSINJECT_");
+        for (int i = 0; i <= MAXCOMMAND; i++)
+        {
+            const ulpInjectionPoints::InjectionPoint& injectionPoint = ulpInjectionPoints::INJECTIONPOINTS[i];
+            if (injectionPoint.name != NULL && _stricmp(injectionPoint.name, token.c_str()) == 0)
+            {
+                _markerInterest.set(i);
+                break;
+            }
+        }
+    }
+    _State.bHasMarkerInterest = true;
+    _Log->LogVarUL("Marks declared by the spooler", _markerInterest.count());
 }
 
+bool CUlpCommandHandler::AppendPayload(DWORD dwIndex)
+{
+    const CUlpDSCTemplate* payload = _Payloads ? _Payloads->Find(dwIndex) : NULL;
+    if (payload == NULL) return true;
+
+    // ULPSpooler still finds the mark in front of the payload
+    if (_injectionBuffer.empty() && !AppendPSInjectCommand(dwIndex)) return false;
+
+    const char* values[DSCSLOTCOUNT] = { _State.cbDriverJobId, _State.cbCurrentPageNumber, _ParameterId.c_str() };
+    const size_t lengths[DSCSLOTCOUNT] = { strnlen_s(_State.cbDriverJobId, sizeof(_State.cbDriverJobId)), _State.dwCurrentPageNumberLength,
+                                           _ParameterId.size() };
+    size_t length = payload->EmitLength(values, lengths);
+    if (length == 0) return true;
+    if (_injectionBuffer.size() + length > MAXINJECTIONSIZE)
+    {
+        _Log->LogVarUL("!!! Payload too large, dropped bytes", length);
+        return false;
+    }
+
+    size_t offset = _injectionBuffer.size();
+    _injectionBuffer.resize(offset + length + 1);
+    payload->Emit(_injectionBuffer.data() + offset, length + 1, values, lengths);
+    _injectionBuffer.resize(offset + length);
+    if (_State.bLogCurrentInjection) _Log->LogVarUL("Payload bytes", length);
+    return true;
+}
+
+// Jobs matching HKLM-LogoPrint2-Key PSDebugPrinterMatch or PSDebugParamIdMatch (all jobs if neither is set) are candidates,
+// one in PSDebugSampleEvery candidates (of this process) is captured
+bool CUlpCommandHandler::SelectJobForPSCapture()
+{
+    const char* printerMatch = _Config->PSDebugPrinterMatch();
+    const char* paramIdMatch = _Config->PSDebugParamIdMatch();
+    if (printerMatch[0] != '\0' || paramIdMatch[0] != '\0')
+    {
+        bool matches = (printerMatch[0] != '\0' && MatchesListEntry(_PrinterName, printerMatch, false)) ||
+                       (paramIdMatch[0] != '\0' && _State.bParameterIdHasValue && MatchesListEntry(_ParameterId, paramIdMatch, true));
+        if (!matches)
+        {
+            _Log->LogLine("No output of PostScript to a debug-file: job does not match PSDebugPrinterMatch/PSDebugParamIdMatch.");
+            return false;
+        }
+    }
 
+    DWORD sampleEvery = _Config->GetInt(HKEY_LOCAL_MACHINE, _T("PSDebugSampleEvery"), 1);
+    DWORD candidate = g_PSCaptureCandidates.fetch_add(1);
+    if (sampleEvery > 1 && candidate % sampleEvery != 0)
+    {
+        _Log->LogVarUL("No output of PostScript to a debug-file: sampled out, PSDebugSampleEvery", sampleEvery);
+        return false;
+    }
+    return true;
+}
 
-// Opens a PostScript file to stream to, provided that a filename is specified in HKCU-LogoPrint2-Key DriverPSDebugFile
+// Opens a PostScript file to stream to, provided that a filename is specified in HKLM-LogoPrint2-Key LPDriverPSDebugFile
+// and the job is selected by the capture policy
 void CUlpCommandHandler::CreateDriverPSDebugFile()
 {
-    auto read_reg_str_future = std::async(&ulpHelper::ReadLogoPrintRegStr, HKEY_LOCAL_MACHINE, _T("LPDriverPSDebugFile"));
-    ulpHelper::CharBuffer* driverPSFileName = read_reg_str_future.get();
-    //ulpHelper::CharBuffer* driverPSFileName = ulpHelper::ReadLogoPrintRegStr(HKEY_CURRENT_USER, _T("LPDriverPSDebugFile"));
-    if (driverPSFileName != NULL && driverPSFileName->Size() > 0)
+    const char* filename = _Config->PSDebugFile();
+    if (filename[0] != '\0' && !SelectJobForPSCapture()) return;
+
+    DWORD tailMB = __min(_Config->GetInt(HKEY_LOCAL_MACHINE, _T("PSDebugTailMB"), 0), CAPTURETAILMB_MAX);
+    if (filename[0] != '\0' && tailMB > 0)
     {
-        char* filename = driverPSFileName->GetBufferAnsi();
+        // Tail mode: kept in memory, written only when needed (see CloseDriverPSTailCapture)
+        char fullname[MAX_PATH + 15];
+        ZeroMemory(fullname, sizeof(fullname));
+        sprintf_s(fullname, sizeof(fullname), "%s_%s_tail.txt", filename, _State.cbDriverJobId);
+        try
+        {
+            _Log->LogVarUL("PSDebugTailMB", tailMB);
+            _PSTailFileName = fullname;
+            _PSTailCapture = std::make_unique<CUlpCaptureRing>((size_t)tailMB * 1024 * 1024);
+            _State.bWriteToPSDebugFile = _PSTailCapture->IsOpen();
+            if (_State.bWriteToPSDebugFile) _PSTailCapture->EnableLiveDump(_PSTailFileName.c_str());
+            if (!_State.bWriteToPSDebugFile) _Log->LogLine("!!! Could not reserve memory for the PostScript tail capture");
+        }
+        catch (const std::exception & e)
+        {
+            _Log->LogError("Error creating ps tail capture", e);
+            _State.bWriteToPSDebugFile = false;
+        }
+        _Log->LogLineParts(const_cast<char*>("Will keep the tail of the PostScript for '"), fullname, "' for debugging", NULL);
+    }
+    else if (filename[0] != '\0')
+    {
+        // Compression (done by the background writer) and buffers queued for it: per-printer DEVMODE wins over the registry
+        DWORD compressionLevel = _OemDevmode.dwCompressionLevel != 0
+                               ? _OemDevmode.dwCompressionLevel
+                               : __min(_Config->GetInt(HKEY_LOCAL_MACHINE, _T("PSDebugCompression"), OEMCOMPRESSION_OFF), (DWORD)OEMCOMPRESSION_MAX);
+        DWORD compressAlgorithm = compressionLevel == OEMCOMPRESSION_FAST ? COMPRESS_ALGORITHM_XPRESS
+                                : compressionLevel == OEMCOMPRESSION_BEST ? COMPRESS_ALGORITHM_XPRESS_HUFF
+                                : 0;
+        DWORD queueDepth = _OemDevmode.dwQueueDepth != 0
+                         ? _OemDevmode.dwQueueDepth
+                         : __min(_Config->GetInt(HKEY_LOCAL_MACHINE, _T("PSDebugQueueDepth"), CAPTUREQUEUEDEPTH_DEFAULT), (DWORD)OEMQUEUEDEPTH_MAX);
+
         char fullname[MAX_PATH + 10];
         ZeroMemory(fullname, sizeof(fullname));
-        sprintf_s(fullname, sizeof(fullname), "%s_%s.txt", filename, _cbDriverJobId);
+        sprintf_s(fullname, sizeof(fullname), compressAlgorithm != 0 ? "%s_%s.ulpcap" : "%s_%s.txt", filename, _State.cbDriverJobId);
         try
         {
-            _streamPSDebugFile.open(fullname, std::ios::binary);
-            _bWriteToPSDebugFile = _streamPSDebugFile.is_open();
+            _Log->LogVarUL("PSDebugCompression", compressionLevel);
+            _Log->LogVarUL("PSDebugQueueDepth", queueDepth);
+            _PSDebugFile = std::make_unique<CUlpCaptureFile>(fullname, queueDepth, compressAlgorithm);
+            _State.bWriteToPSDebugFile = _PSDebugFile->IsOpen();
+            if (!_State.bWriteToPSDebugFile) _Log->LogVarUL("!!! Could not open ps debug file, error", _PSDebugFile->LastError());
+            else if (_PSDebugFile->CompressAlgorithm() != compressAlgorithm) _Log->LogLine("!!! Could not create compressor, PostScript is written uncompressed");
         }
         catch (const std::exception & e)
         {
             _Log->LogError("Error opening ps debug file", e);
-            _bWriteToPSDebugFile = false;
+            _Log->DumpFlightRecorder("Exception opening ps debug file");
+            _State.bWriteToPSDebugFile = false;
         }
         _Log->LogLineParts(const_cast<char*>("Will write PostScript to '"), filename, "' for debugging", NULL);
     }
@@ -188,19 +436,163 @@ void CUlpCommandHandler::CreateDriverPSDebugFile()
     {
         _Log->LogLineParts(const_cast<char*>("No output of PostScript to a debug-file."), NULL);
     }
+}
+
+// Writes the tail capture, provided that the job ended abnormally (aborted, cancelled by ULPSpooler.exe, pipe error)
+// or HKLM-LogoPrint2-Key PSDebugTailDump is set in the current config (administrators set it to get the tail of every job,
+// running jobs are dumped by the config watcher when it is set, see CUlpCaptureRing::DumpLive)
+void CUlpCommandHandler::CloseDriverPSTailCapture()
+{
+    const char* reason = NULL;
+    if (_State.bIsInitalized && !_State.bHaveSeenEOF) reason = "Job ended before PSINJECT_EOF";
+    else if (_State.bCancel) reason = "Job cancelled by ULPSpooler.exe";
+    else if (_State.bErrorWritingPipe) reason = "Error writing to the pipe";
+    else if (CUlpConfig::Get()->GetInt(HKEY_LOCAL_MACHINE, _T("PSDebugTailDump"), 0) != 0) reason = "Requested by PSDebugTailDump";
+
+    if (reason == NULL)
+    {
+        if (_Log != NULL) _Log->LogVarUL("PostScript tail capture not written, stream bytes", _PSTailCapture->StreamBytes());
+    }
+    else
+    {
+        DWORD lastError = _PSTailCapture->WriteTo(_PSTailFileName.c_str(), reason);
+        if (_Log != NULL)
+        {
+            _Log->LogLineParts(const_cast<char*>("PostScript tail capture written to '"), _PSTailFileName.c_str(), "' (", reason, ")", NULL);
+            _Log->LogVarUL("PostScript tail first retained offset", _PSTailCapture->FirstRetainedOffset());
+            if (lastError != 0) _Log->LogVarUL("!!! PostScript tail capture write error", lastError);
+        }
+    }
+    _PSTailCapture.reset();
+}
+
+HRESULT CUlpCommandHandler::WriteWithPrologDedup(const char* cBuffer, DWORD cbBuffer)
+{
+    HRESULT hr = WritePrologSegments(_PrologDedup->Append(cBuffer, cbBuffer));
+    if (_PrologDedup->IsDone() && _PrologDedup->IsAbandoned())
+    {
+        _Log->LogVarUL("Prolog exceeds PrologDedupMaxKB or could not be hashed, streamed as it is, bytes", (DWORD)_PrologDedup->PrologBytes());
+    }
+    return hr;
+}
+
+HRESULT CUlpCommandHandler::WritePrologSegments(const std::vector<PrologSegment>& segments)
+{
+    HRESULT hr = S_OK;
+    for (const PrologSegment& segment : segments)
+    {
+        if (FAILED(hr)) break;
+        if (segment.kind == PROLOGSEGMENT_BYTES)
+        {
+            hr = WriteToSpoolerPipeCoalesced(segment.data, segment.length);
+            continue;
+        }
+
+        bool isKnown = segment.kind == PROLOGSEGMENT_REF;
+        if (isKnown)
+        {
+            _Log->LogVar("Prolog held by the spooler, sending reference", _PrologDedup->HashHex());
+            _Log->LogVarUL("Prolog bytes not sent", (DWORD)_PrologDedup->PrologBytes());
+        }
+        else
+        {
+            _Log->LogVar("Prolog not held by the spooler, sent with its hash", _PrologDedup->HashHex());
+        }
+        char* command = MakeLogoPrintDSCCommand(NULL, isKnown ? PROLOGREFCOMMANDNAME : PROLOGHASHCOMMANDNAME, _PrologDedup->HashHex(), PROLOGHASHHEXSIZE - 1);
+        if (command != NULL)
+        {
+            hr = WriteToSpoolerPipeCoalesced(command, _State.dwPSToInjectLength);
+        }
+    }
+    return hr;
+}
+
+HRESULT CUlpCommandHandler::WritePostScript(const char* cBuffer, DWORD cbBuffer)
+{
+    if (_PrologDedup && !_PrologDedup->IsDone())
+    {
+        return WriteWithPrologDedup(cBuffer, cbBuffer);
+    }
+    return WriteToSpoolerPipeCoalesced(cBuffer, cbBuffer);
+}
+
+HRESULT CUlpCommandHandler::WritePageSegments(const std::vector<PageSegment>& segments)
+{
+    HRESULT hr = S_OK;
+    for (const PageSegment& segment : segments)
+    {
+        if (FAILED(hr)) break;
+        if (!segment.bPageHash)
+        {
+            hr = WritePostScript(segment.data, segment.length);
+            continue;
+        }
+
+        char* command = MakeLogoPrintDSCCommand(NULL, PAGEHASHCOMMANDNAME, _PageFingerprint->Text(), _PageFingerprint->TextLength());
+        if (command != NULL)
+        {
+            hr = WriteToSpoolerPipeCoalesced(command, _State.dwPSToInjectLength);
+        }
+        if (_State.bLogCurrentInjection) _Log->LogVar("PageHash", _PageFingerprint->Text());
+    }
+    return hr;
+}
 
-    if (driverPSFileName != NULL)
+HRESULT CUlpCommandHandler::WritePageManifest()
+{
+    // Offsets are those of the bytes written to the pipe (after prolog deduplication and PageHash commands),
+    // the manifest is formatted before its own bytes are written
+    std::string manifest = _PageManifest->Format();
+    char pageCount[24];
+    size_t pageCountLength = CUlpDSCTemplate::FormatDecimal(pageCount, sizeof(pageCount), (long)_PageManifest->PageCount());
+    _Log->LogVarUL("Page manifest pages", _PageManifest->PageCount());
+    _Log->LogVarUL("Page manifest stream bytes", _PageManifest->StreamBytes());
+
+    char* command = MakeLogoPrintDSCCommand(NULL, PAGEMANIFESTCOMMANDNAME, pageCount, pageCountLength);
+    if (command == NULL) return E_FAIL;
+    HRESULT hr = WriteToSpoolerPipeCoalesced(command, _State.dwPSToInjectLength);
+    if (SUCCEEDED(hr))
     {
-        driverPSFileName->free();
+        hr = WriteToSpoolerPipeCoalesced(manifest.data(), (DWORD)manifest.size());
+    }
+    return hr;
+}
+
+// Opens a trace-file (Chrome trace-event JSON), provided that a filename is specified in HKLM-LogoPrint2-Key LPDriverTraceFile
+void CUlpCommandHandler::CreateDriverTraceFile()
+{
+    const char* filename = _Config->TraceFile();
+    if (filename[0] != '\0')
+    {
+        char fullname[MAX_PATH + 10];
+        ZeroMemory(fullname, sizeof(fullname));
+        sprintf_s(fullname, sizeof(fullname), "%s_%s.json", filename, _State.cbDriverJobId);
+        _Trace = new CUlpTrace(fullname);
+        if (_Trace->IsOpen())
+        {
+            _Log->SetTrace(_Trace);
+            _Log->LogLineParts(const_cast<char*>("Will write trace events to '"), fullname, "'", NULL);
+        }
+        else
+        {
+            _Log->LogLineParts(const_cast<char*>("!!! Could not open trace file '"), fullname, "'", NULL);
+            delete _Trace;
+            _Trace = NULL;
+        }
+    }
+    else
+    {
+        _Log->LogLineParts(const_cast<char*>("No output of trace events to a trace-file."), NULL);
     }
 }
 
 // Writes cBuffer to debug-file, if debug-file has been opened
 void CUlpCommandHandler::WriteDriverDebugFile(const char* cBuffer, DWORD cbBuffer)
 {
-    if (_bWriteToPSDebugFile)
+    if (_State.bWriteToPSDebugFile)
     {
-        _streamPSDebugFile.write(cBuffer, cbBuffer);
+        // The tail capture is written in WriteToSpoolerPipe
+        if (_PSDebugFile) _PSDebugFile->Write(cBuffer, cbBuffer);
     }
 }
 
@@ -208,24 +600,32 @@ void CUlpCommandHandler::WriteDriverDebugFile(const char* cBuffer, DWORD cbBuffe
 HRESULT CUlpCommandHandler::WriteToSpoolerPipe(const char* cBuffer, DWORD cbBuffer)
 {
     HRESULT hr = S_OK;
-    if (_dwWritePipeLastError == 0)
+    if (_State.dwWritePipeLastError == 0)
     {
+        CUlpTraceSpan span(_Trace, "WriteToSpoolerPipe", "pipe", cbBuffer);
+        if (_PSTailCapture) _PSTailCapture->Write(cBuffer, cbBuffer);
+        if (_Log->IsSampled(LOGCAT_PIPEWRITE))
+        {
+            _Log->LogVarUL("WriteToSpoolerPipe bytes", cbBuffer);
+        }
         auto read_reg_str_future = std::async([this, cBuffer, cbBuffer]() {
-            return _UlpSpooler->WriteToSpoolerPipe(cBuffer, cbBuffer, &_dwWritePipeLastError);
+            return _UlpSpooler->WriteToSpoolerPipe(cBuffer, cbBuffer, &_State.dwWritePipeLastError);
             });
         DWORD bytesWritten = read_reg_str_future.get();
-        //DWORD bytesWritten = _UlpSpooler->WriteToSpoolerPipe(cBuffer, cbBuffer, &(_dwWritePipeLastError));
-        if (_dwWritePipeLastError != 0)
+        //DWORD bytesWritten = _UlpSpooler->WriteToSpoolerPipe(cBuffer, cbBuffer, &(_State.dwWritePipeLastError));
+        if (_State.dwWritePipeLastError != 0)
         {
-            if (_dwWritePipeLastError == 232)
+            if (_State.dwWritePipeLastError == 232)
             {
                 _Log->LogLineFlush("Pipe has been closed by ULPSpooler -> Print is to be aborted!");
-                _bCancel = true;
+                _State.bCancel = true;
+                _Log->DumpFlightRecorder("Pipe has been closed by ULPSpooler");
             }
             else
             {
                 _Log->LogLineFlush("An error occured writing to the pipe -> Print is to be aborted!");
-                _bErrorWritingPipe = true;
+                _State.bErrorWritingPipe = true;
+                _Log->DumpFlightRecorder("Error writing to the pipe");
             }
             hr = ERROR_WRITE_FAULT;
         }
@@ -246,7 +646,69 @@ HRESULT CUlpCommandHandler::WriteToSpoolerPipe(const char* cBuffer, DWORD cbBuff
     return hr;
 }
 
+HRESULT CUlpCommandHandler::WriteToSpoolerPipeCoalesced(const char* cBuffer, DWORD cbBuffer)
+{
+    // Every byte for the pipe passes here in order: the manifest counts what the spooler receives
+    if (_PageManifest)
+    {
+        _PageManifest->Append(cBuffer, cbBuffer);
+    }
+
+    if (_State.dwWriteCoalesceBytes == 0)
+    {
+        return WriteToSpoolerPipe(cBuffer, cbBuffer);
+    }
+
+    HRESULT hr = S_OK;
+    if (!_pipeWriteBuffer.empty() && _pipeWriteBuffer.size() + cbBuffer > _State.dwWriteCoalesceBytes)
+    {
+        hr = FlushPipeWriteBuffer();
+    }
+
+    if (cbBuffer >= _State.dwWriteCoalesceBytes)
+    {
+        // Large enough on its own: no copy
+        HRESULT hrWrite = WriteToSpoolerPipe(cBuffer, cbBuffer);
+        return hr != S_OK ? hr : hrWrite;
+    }
 
+    _pipeWriteBuffer.insert(_pipeWriteBuffer.end(), cBuffer, cBuffer + cbBuffer);
+    return hr;
+}
+
+HRESULT CUlpCommandHandler::FlushPipeWriteBuffer()
+{
+    if (_pipeWriteBuffer.empty()) return S_OK;
+    HRESULT hr = WriteToSpoolerPipe(_pipeWriteBuffer.data(), (DWORD)_pipeWriteBuffer.size());
+    _pipeWriteBuffer.clear();
+    return hr;
+}
+
+LogSettings CUlpCommandHandler::GetLogSettings()
+{
+    LogSettings settings = CUlpLog::GetConfigSettings(_Config.get());
+    if (_OemDevmode.dwRingKB != 0)
+    {
+        settings.ringKB = _OemDevmode.dwRingKB;
+    }
+    switch (_OemDevmode.dwLogLevel)
+    {
+    case OEMLOGLEVEL_SAMPLED:
+        // A shared log stays shared (it is a file as well)
+        if (settings.mode != LOGMODE_SHARED) settings.mode = LOGMODE_FILE;
+        break;
+    case OEMLOGLEVEL_VERBOSE:
+        if (settings.mode != LOGMODE_SHARED) settings.mode = LOGMODE_FILE;
+        settings.bSampling = false;
+        break;
+    case OEMLOGLEVEL_FLIGHTRECORDER:
+        settings.mode = LOGMODE_FLIGHTRECORDER;
+        break;
+    default:
+        break;
+    }
+    return settings;
+}
 
    
 // Redirects postscript received from system-spooler to ULPSpooler via pipe. 
@@ -255,31 +717,44 @@ HRESULT CUlpCommandHandler::ULPWritePrinter(PDEVOBJ pdevobj, PVOID pBuf, DWORD c
 {
     HRESULT hr;
     const char* cBuffer = static_cast<const char*>(pBuf);
+    CUlpTraceSpan span(_Trace, "WritePrinter", "io", cbBuffer);
 
     if (cBuffer != NULL && cbBuffer != 0)
     {
+        if (_Log->IsSampled(LOGCAT_WRITEPRINTER))
+        {
+            _Log->LogVarUL("WritePrinter BufferSize", cbBuffer);
+        }
+
         //if (_bCheckWriteMapIdFile)
         //{
         //    CheckWriteMapIdFile(pdevobj, cBuffer);
         //}
 
-        if (_bFirstWrite && !_bParameterIdHasValue) {
+        if (_State.bFirstWrite && !_State.bParameterIdHasValue) {
             DWORD cbWritten = 0;
-            DWORD jobIdLen = (DWORD)strnlen_s(_cbDriverJobId, MAXSIZEDRIVERJOBID);
+            DWORD jobIdLen = (DWORD)strnlen_s(_State.cbDriverJobId, MAXSIZEDRIVERJOBID);
             if (jobIdLen > MAXSIZEDRIVERJOBID) jobIdLen = MAXSIZEDRIVERJOBID; // Fix wrong warning C6385
             if (jobIdLen > 0) {
-                WritePrinter(pdevobj->hPrinter, _cbDriverJobId, jobIdLen, &cbWritten);
+                WritePrinter(pdevobj->hPrinter, _State.cbDriverJobId, jobIdLen, &cbWritten);
                 WritePrinter(pdevobj->hPrinter, "\r\n", 2, &cbWritten);
                 _Log->LogLineFlush("Wrote DriverJobId to LParam_*MapId.txt.");
             }
-            _bFirstWrite = false; // Write driverJobId only once to MapId-file
+            _State.bFirstWrite = false; // Write driverJobId only once to MapId-file
         }
 
         DWORD cbBytesToStream = cbBuffer;
 
         WriteDriverDebugFile(cBuffer, cbBytesToStream);
 
-        hr = WriteToSpoolerPipe(cBuffer, cbBytesToStream);
+        if (_PageFingerprint)
+        {
+            hr = WritePageSegments(_PageFingerprint->Append(cBuffer, cbBytesToStream));
+        }
+        else
+        {
+            hr = WritePostScript(cBuffer, cbBytesToStream);
+        }
 
         *pcbWritten = cbBuffer;     // Make system-spooler believe that alle bytes are written 
                                     // (which they are, but to the pipe and not to the system-spooler)
@@ -293,24 +768,24 @@ HRESULT CUlpCommandHandler::ULPWritePrinter(PDEVOBJ pdevobj, PVOID pBuf, DWORD c
     return hr;
 }
 
-HRESULT CUlpCommandHandler::WriteToSysSpoolBuf(PDEVOBJ pdevobj, DWORD dwIndex, IPrintOemDriverPS* pOEMHelp, PDWORD pdwReturn, PSTR pProcedure)
+HRESULT CUlpCommandHandler::WriteToSysSpoolBuf(PDEVOBJ pdevobj, DWORD dwIndex, IPrintOemDriverPS* pOEMHelp, PDWORD pdwReturn)
 {
     HRESULT hResult = E_FAIL;
     DWORD   dwLen = 0;
     DWORD   dwSize = 0;
 
-    if (_bCancel || _bErrorWritingPipe)
+    if (_State.bCancel || _State.bErrorWritingPipe)
     {
         _Log->LogLineFlush("Print is aborted!");
         // Flags indicate to not inject postscripts any more
-        *pdwReturn = _dwWritePipeLastError;
+        *pdwReturn = _State.dwWritePipeLastError;
         return E_FAIL;
     }
 
     // UniLogoPrint does not support replacement of postscript created by the core driver
-    bool isReplaceOfPScript5DriversPostscript = !_cIsInjectCommand[dwIndex]; // Prevent PScript5-driver's postscript to be replaced by this plugin
+    bool isReplaceOfPScript5DriversPostscript = !ulpInjectionPoints::Get(dwIndex).bIsInject; // Prevent PScript5-driver's postscript to be replaced by this plugin
     if (isReplaceOfPScript5DriversPostscript) {
-        if (NULL != pProcedure)
+        if (!_injectionBuffer.empty())
         {
             _Log->LogLineFlush("!!! Plugin-postscript has not been written to system-spooler's buffer because PScript5-driver's postscript must not be replaced!");
         }
@@ -318,12 +793,11 @@ HRESULT CUlpCommandHandler::WriteToSysSpoolBuf(PDEVOBJ pdevobj, DWORD dwIndex, I
         return  E_NOTIMPL;
     }
 
-    if (pProcedure == NULL)
+    if (_injectionBuffer.empty())
     {
         // No special postscript-to-inject for this injection point has been defined 
         // -> inject proprietary default DSC comment to mark injection point for ULPSpooler
-        pProcedure = MakeLogoPrintPSInjectCommand(dwIndex);
-        if (pProcedure == NULL)
+        if (!AppendPSInjectCommand(dwIndex))
         {
             // SHould not happen
             *pdwReturn = ERROR_NOT_SUPPORTED;
@@ -331,12 +805,13 @@ HRESULT CUlpCommandHandler::WriteToSysSpoolBuf(PDEVOBJ pdevobj, DWORD dwIndex, I
         }
     }
 
-    // A DSC comment (=pProcedure) is to be injected -> write content of pProcedure to spool buffer
-    dwLen = (DWORD)strnlen(pProcedure, MAXPADCHARS);
-    if (dwLen > 0 && dwLen < MAXPADCHARS)
+    // The gathered postscript is injected at once: its length is known, no strnlen
+    dwLen = (DWORD)_injectionBuffer.size();
+    if (dwLen > 0)
     {
         SetLastError(S_OK);
-        hResult = pOEMHelp->DrvWriteSpoolBuf(pdevobj, pProcedure, dwLen, &dwSize);
+        CUlpTraceSpan span(_Trace, "DrvWriteSpoolBuf", "io", dwLen);
+        hResult = pOEMHelp->DrvWriteSpoolBuf(pdevobj, _injectionBuffer.data(), dwLen, &dwSize);
         if (dwLen != dwSize)
         {
             _Log->LogVarUL("Bytes to send", dwLen);
@@ -346,7 +821,6 @@ HRESULT CUlpCommandHandler::WriteToSysSpoolBuf(PDEVOBJ pdevobj, DWORD dwIndex, I
     }
     else
     {
-        dwLen = 0;
         _Log->LogLineFlush("No bytes to write to system-spooler's buffer!");
     }
 
@@ -377,6 +851,7 @@ HRESULT CUlpCommandHandler::WriteToSysSpoolBuf(PDEVOBJ pdevobj, DWORD dwIndex, I
         _Log->LogVarL("ErrorCode returned", *pdwReturn);
         _Log->LogVarL("hResult returned", hResult);
         _Log->LogLineFlush("Did not succeed to write system-spooler's buffer!");
+        _Log->DumpFlightRecorder("DrvWriteSpoolBuf failed");
     }
 
     // dwLen should always equal dwSize.
@@ -389,10 +864,9 @@ HRESULT CUlpCommandHandler::WriteToSysSpoolBuf(PDEVOBJ pdevobj, DWORD dwIndex, I
 HRESULT CUlpCommandHandler::ULPCommandInject(PDEVOBJ pdevobj, DWORD dwIndex, PVOID pData, DWORD cbSize,
                                                 IPrintOemDriverPS* pOEMHelp, PDWORD pdwReturn)
 {
-    PSTR    pProcedure = NULL;
     HRESULT hResult = E_FAIL;
     // UniLogoPrint does not support injection of postscript before PSINJECT_PSADOBE or after PSINJECT_EOF
-    bool bAllowInjectPostscript = _bHaveSeenPSAdobe && !_bHaveSeenEOF; // Inject PostScript after(!) PSINJECT_PSADOBE and not after PSINJECT_EOF
+    bool bAllowInjectPostscript = _State.bHaveSeenPSAdobe && !_State.bHaveSeenEOF; // Inject PostScript after(!) PSINJECT_PSADOBE and not after PSINJECT_EOF
 
 
     VERBOSE(DLLTEXT("Entering OEMCommand...\r\n"));
@@ -400,52 +874,68 @@ HRESULT CUlpCommandHandler::ULPCommandInject(PDEVOBJ pdevobj, DWORD dwIndex, PVO
     UNREFERENCED_PARAMETER(pData);
     UNREFERENCED_PARAMETER(cbSize);
 
-    if (!_bIsInitalized) {
+    if (!_State.bIsInitalized) {
         InitCommandHandler();
     }
 
+    _injectionBuffer.clear();
+
     int level = -1;
+    const ulpInjectionPoints::InjectionPoint& injectionPoint = ulpInjectionPoints::Get(dwIndex);
+
+    // Page level injection points are logged for sampled pages only
+    if (dwIndex == PSINJECT_BEGINPAGESETUP) {
+        _State.bLogCurrentPage = _Log->IsSampled(LOGCAT_PAGE);
+    }
+    _State.bLogCurrentInjection = !injectionPoint.bIsPageLevel || _State.bLogCurrentPage;
 
-    if (dwIndex > 0 && dwIndex <= MAXCOMMAND && _cCommandName[dwIndex] != NULL) {
-        level = _Log->EnterSection(_cCommandName[dwIndex]);
+    if (injectionPoint.name != NULL) {
+        level = _Log->EnterSection(injectionPoint.name, _State.bLogCurrentInjection);
     }
 
     switch (dwIndex)
     {
         case PSINJECT_BEGINPAGESETUP:
-            _Log->LogLineFlush("-> will increment current page number ...");
-            SetCurrentPageNumber(_iCurrentPageNumber + 1);
+            if (_State.bLogCurrentInjection) _Log->LogLineFlush("-> will increment current page number ...");
+            SetCurrentPageNumber(_State.iCurrentPageNumber + 1);
             break;
 
         case PSINJECT_BEGINSTREAM:
             break;
 
         case PSINJECT_PSADOBE:
-            _bHaveSeenPSAdobe = true;
+            _State.bHaveSeenPSAdobe = true;
             break;
 
         case PSINJECT_COMMENTS:
-            if (_bParameterIdHasValue) {
+            if (_State.bParameterIdHasValue) {
                 _Log->LogLineFlush("Creating SetParameterId command ...");
-                pProcedure = MakeLogoPrintDSCCommand(SETPARAMIDCOMMANDNAME, _cParameterId); // PostScript to inject something like:  %UCSLogoPrint SetParameterId(1252400638494244396315693) [81906903]
-                _Log->LogVar("SetParameterId command", pProcedure);
+                char* command = MakeLogoPrintDSCCommand(&_DSCSetParamIdTemplate, SETPARAMIDCOMMANDNAME, _ParameterId.c_str(), _ParameterId.size()); // PostScript to inject something like:  %UCSLogoPrint SetParameterId(1252400638494244396315693) [81906903]
+                _Log->LogVar("SetParameterId command", command);
+                if (command != NULL) AppendToInjection(command, _State.dwPSToInjectLength);
+            }
+            if (_TestHooks && !_TestHooks->padChars.empty()) {
+                // Mark and pad comments go to the system-spooler's buffer together
+                if (_injectionBuffer.empty()) AppendPSInjectCommand(dwIndex);
+                AppendToInjection(_TestHooks->padChars.data(), (DWORD)_TestHooks->padChars.size());
+                _Log->LogLineFlush("Will add some pad-chars to test overlappping DSC comments!");
             }
             break;
         case PSINJECT_ENDSTREAM:
             break;
         case PSINJECT_EOF: 
-            _bHaveSeenEOF = true;
+            _State.bHaveSeenEOF = true;
             break;
         default:
             VERBOSE(DLLTEXT("PSCommand Default...\r\n"));
             break;
     }
 
-    if (_dwPSInjectToFail == dwIndex)
+    if (_TestHooks && _TestHooks->dwPSInjectToFail == dwIndex)
     {
         // Send hResult = E_FAIL for testing 
         hResult = E_FAIL;
-        *pdwReturn = _dwPSInjectToFailErrorCode;
+        *pdwReturn = _TestHooks->dwPSInjectToFailErrorCode;
         _Log->LogVarL("ErrorCode returned (testing)", *pdwReturn);
         _Log->LogVarL("hResult returned (testing)", hResult);
         _Log->LogLine("Will send hResult=E_Fail for testing!");
@@ -454,7 +944,17 @@ HRESULT CUlpCommandHandler::ULPCommandInject(PDEVOBJ pdevobj, DWORD dwIndex, PVO
     {
         if (bAllowInjectPostscript)
         {
-            hResult = WriteToSysSpoolBuf(pdevobj, dwIndex, pOEMHelp, pdwReturn, pProcedure);
+            AppendPayload(dwIndex);
+            if (_injectionBuffer.empty() && injectionPoint.bIsInject && !IsMarkerWanted(dwIndex) && !_State.bCancel && !_State.bErrorWritingPipe)
+            {
+                // The spooler does not need this mark: no DrvWriteSpoolBuf, no bytes for it to scan
+                *pdwReturn = ERROR_SUCCESS;
+                hResult = S_OK;
+            }
+            else
+            {
+                hResult = WriteToSysSpoolBuf(pdevobj, dwIndex, pOEMHelp, pdwReturn);
+            }
         }
         else
         {
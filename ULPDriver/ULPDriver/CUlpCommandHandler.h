@@ -16,9 +16,21 @@
 #pragma once
 
 #include "intrface.h"
+#include "ulpDriver.h"
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <bitset>
 #include "CUlpLog.h"
+#include "CUlpTrace.h"
+#include "CUlpCaptureFile.h"
+#include "CUlpPrologDedup.h"
+#include "CUlpPageFingerprint.h"
+#include "CUlpPageManifest.h"
+#include "CUlpConfig.h"
+#include "CUlpDSCTemplate.h"
+#include "ulpInjectionPoints.h"
+#include "CUlpPayloads.h"
 #include "ulpHelperUsingLog.h"
 #include "CUlpSpoolerPipe.h"
 
@@ -26,11 +38,91 @@ const DWORD MAXSIZEDRIVERJOBID = 20;  //buffer size large enough for driver's jo
 const DWORD MAXSIZEPAGENUMBER = 10;   //buffer size large enough for pagenumber
 const DWORD PLACEHOLDERMAXSIZE = 255; //buffer size large enough to hold any used placeholder
 const DWORD MAXPADCHARS = 8192;       //maximum number of padding chars to test overlapping LOGOPRINT_EOF_DSCCOMMENT
-const int MAXCOMMAND = 201;
+const DWORD MAXINJECTIONSIZE = 65536; //maximum number of bytes injected at one injection point (marker, padding and payload)
 const DWORD DSCCOMMANDMAXSIZE = 150;   //buffer size large enough to hold command-pattern
 const DWORD SETPARAMIDCOMMANDNAMESIZE = 30;   //buffer size large enough to SetParamId-command
 
 
+// State of a job used on every WritePrinter call and at every injection point, kept within JOBSTATEMAXSIZE
+// (a few cache lines); everything else of CUlpCommandHandler is used at init or for diagnostics only
+typedef struct JobState
+{
+    // Flag indicating whether this class is initialized 
+    bool bIsInitalized;
+
+    // Flag indicating if ULPSpooler.exe closed pipe to abort spooling
+    bool bCancel;
+
+    // Flag indicating if there has been an error writeing to the pipe 
+    bool bErrorWritingPipe;
+
+    // Flag indicating if postscript injection point PSINJECT_PSADOBE has been reached
+    // Used to not inject Postscript before this injection point!
+    bool bHaveSeenPSAdobe;
+
+    // Flag indicating if postscript injection point PSINJECT_EOF has been reached
+    // Used to not inject Postscript after this injection point!
+    bool bHaveSeenEOF;
+
+    // Flag indicating if it's the first time that WritePrinter is called
+    bool bFirstWrite;
+
+    // Flag indicating if the sections and marks of the current page are logged (pages are logged sampled, see LOGCAT_PAGE)
+    bool bLogCurrentPage;
+
+    // Flag indicating if the current injection point is logged (always for document level injection points)
+    bool bLogCurrentInjection;
+
+    // Flag indicating if postscript sent by system-spooler has to be logged to the PostScript debug file
+    bool bWriteToPSDebugFile;
+
+    // Flag indicating if a parameter-id has been found in the printer name
+    bool bParameterIdHasValue;
+
+    // Flag indicating if the spooler declared the marks it needs
+    bool bHasMarkerInterest;
+
+    // LastError when writing to pipe 
+    DWORD dwWritePipeLastError;
+
+    // Postscript is collected up to this number of bytes before it is written to the pipe (0 = write through)
+    DWORD dwWriteCoalesceBytes;
+
+    // Length of the DSC comment in _bufferPSToInject
+    DWORD dwPSToInjectLength;
+
+    // DriverJob-Id used:
+    // + in injected postscript as marker
+    // + will be written to output (MapId-file), when printing application does not send a SetParamId-command
+    //   and allows to identify the parameter-file to be used by LPSpooler.exe
+    // + will be passed to LPSpooler.exe to identify the parameter-file when SetParamId-command is not sent 
+    //   by printing application
+    long lDriverJobId;
+    CHAR cbDriverJobId[MAXSIZEDRIVERJOBID];
+
+    // Current page number (used as parameter in injected postscript)
+    int  iCurrentPageNumber;
+    DWORD dwCurrentPageNumberLength;
+    CHAR cbCurrentPageNumber[MAXSIZEPAGENUMBER];
+} JobState;
+
+const size_t JOBSTATEMAXSIZE = 128;
+static_assert(sizeof(JobState) <= JOBSTATEMAXSIZE, "JobState has to stay within two cache lines");
+
+// Test hooks (see HKCU-LogoPrint2-Keys PSInjectToFail, PSInjectToFailErrorCode, PadCommentCharCount)
+typedef struct TestHooks
+{
+    //PSInjectCommand that has to fail and send hResult=E_FAIL
+    DWORD dwPSInjectToFail;
+
+    //Error number returned to system when PSInjectCommand fails
+    DWORD dwPSInjectToFailErrorCode;
+
+    // Pad comments appended to the mark at PSINJECT_COMMENTS to test overlapping DSC comments
+    std::string padChars;
+} TestHooks;
+
+
 class CUlpCommandHandler
 {
 
@@ -43,43 +135,134 @@ private:
     void CreateDriverJobId();
 
     // Returns pointer to char-buffer containing proprietary DSC comment for injection point with name cName
-    char* MakeLogoPrintDSCCommand(const char* cName, char* paramValue)
+    // (copied from the precompiled dscTemplate, printf with _DSCCommandPattern if there is none)
+    char* MakeLogoPrintDSCCommand(const CUlpDSCTemplate* dscTemplate, const char* cName, const char* paramValue, size_t paramLength)
     {
         char* result = NULL;
         if (cName != NULL)
         {
-            _Log->LogLineParts(const_cast<char*>("Inserting mark for '"), cName, "' (page# ", _cbCurrentPageNumber, ")", NULL);
-            ZeroMemory(_bufferPSToInject, sizeof(_bufferPSToInject));
-            if (SUCCEEDED(StringCbPrintfA(_bufferPSToInject, sizeof(_bufferPSToInject), LOGOPRINT_DSCCOMMAND, cName, paramValue, _cbDriverJobId)))
+            if (_State.bLogCurrentInjection)
             {
-                result = _bufferPSToInject;
+                _Log->LogLineParts(const_cast<char*>("Inserting mark for '"), cName, "' (page# ", _State.cbCurrentPageNumber, ")", NULL);
+            }
+            if (dscTemplate != NULL && dscTemplate->IsCompiled())
+            {
+                const char* values[DSCSLOTCOUNT] = { cName, paramValue, _State.cbDriverJobId };
+                const size_t lengths[DSCSLOTCOUNT] = { 0, paramLength, 0 };   // name and job id are bound
+                _State.dwPSToInjectLength = (DWORD)dscTemplate->Emit(_bufferPSToInject, sizeof(_bufferPSToInject), values, lengths);
+                if (_State.dwPSToInjectLength > 0)
+                {
+                    result = _bufferPSToInject;
+                }
+            }
+            else
+            {
+                ZeroMemory(_bufferPSToInject, sizeof(_bufferPSToInject));
+                if (SUCCEEDED(StringCbPrintfA(_bufferPSToInject, sizeof(_bufferPSToInject), _DSCCommandPattern.c_str(), cName, paramValue, _State.cbDriverJobId)))
+                {
+                    _State.dwPSToInjectLength = (DWORD)strnlen_s(_bufferPSToInject, sizeof(_bufferPSToInject));
+                    result = _bufferPSToInject;
+                }
             }
         }
         return result;
     }
 
-    // Returns pointer to char-buffer containing proprietary DSC comment for injection point with cCommandName specified by dwIndex
+    // Returns pointer to char-buffer containing proprietary DSC comment for the injection point specified by dwIndex
     char* MakeLogoPrintPSInjectCommand(DWORD dwIndex)
     {
         char* result = NULL;
 
-        if (dwIndex > 0 && dwIndex <= MAXCOMMAND && _cCommandName[dwIndex] != NULL)
+        const ulpInjectionPoints::InjectionPoint& injectionPoint = ulpInjectionPoints::Get(dwIndex);
+        if (injectionPoint.name != NULL)
         {
-            result = MakeLogoPrintDSCCommand(_cCommandName[dwIndex], _cbCurrentPageNumber);
+            const CUlpDSCTemplate* dscTemplate = dwIndex < _DSCCommandTemplates.size() ? &_DSCCommandTemplates[dwIndex] : NULL;
+            result = MakeLogoPrintDSCCommand(dscTemplate, injectionPoint.name, _State.cbCurrentPageNumber, _State.dwCurrentPageNumberLength);
         }
         return result;
     }
 
+    // Adds cBuffer to the postscript gathered for the current injection point (false if MAXINJECTIONSIZE would be exceeded)
+    bool AppendToInjection(const char* cBuffer, DWORD cbBuffer)
+    {
+        if (cBuffer == NULL || cbBuffer == 0) return true;
+        if (_injectionBuffer.size() + cbBuffer > MAXINJECTIONSIZE)
+        {
+            _Log->LogVarUL("!!! Injection too large, dropped bytes", cbBuffer);
+            return false;
+        }
+        _injectionBuffer.insert(_injectionBuffer.end(), cBuffer, cBuffer + cbBuffer);
+        return true;
+    }
+
+    // Adds the proprietary DSC comment for the injection point specified by dwIndex to the gathered postscript
+    bool AppendPSInjectCommand(DWORD dwIndex)
+    {
+        char* command = MakeLogoPrintPSInjectCommand(dwIndex);
+        return command != NULL && AppendToInjection(command, _State.dwPSToInjectLength);
+    }
+
+    // Adds the payload configured for injection point dwIndex (after the proprietary DSC comment) to the gathered postscript
+    bool AppendPayload(DWORD dwIndex);
+
+    // Takes the injection points the spooler declared it needs marks for (all if it declared none)
+    void SetMarkerInterest(const std::string& markerInterest);
+
+    // Returns true if the spooler needs the mark of injection point dwIndex
+    bool IsMarkerWanted(DWORD dwIndex)
+    {
+        return !_State.bHasMarkerInterest || (dwIndex <= (DWORD)MAXCOMMAND && _markerInterest.test(dwIndex));
+    }
+
+    // Parses _DSCCommandPattern once and binds driver-job-id and command names into one template per injection point
+    void CompileDSCTemplates();
+
     // Opens a debug-file to log to, provided that a filename is specified in HKCU-LogoPrint2-Key DriverPSDebugFile
     void CreateDriverPSDebugFile();
 
+    // Returns true if the job is to be captured (see HKLM-LogoPrint2-Keys PSDebugPrinterMatch, PSDebugParamIdMatch, PSDebugSampleEvery)
+    bool SelectJobForPSCapture();
+
+    // Writes the tail capture if the job ended abnormally or an administrator asked for it
+    void CloseDriverPSTailCapture();
+
+    // Streams cBuffer through _PrologDedup: the prolog is held back and replaced by a reference if the spooler holds it
+    HRESULT WriteWithPrologDedup(const char* cBuffer, DWORD cbBuffer);
+
+    // Writes what _PrologDedup returned, the PrologRef and PrologHash commands where the prolog ends in the stream
+    HRESULT WritePrologSegments(const std::vector<PrologSegment>& segments);
+
+    // Writes bytes of the job to the pipe, through _PrologDedup as long as it looks for the prolog
+    HRESULT WritePostScript(const char* cBuffer, DWORD cbBuffer);
+
+    // Writes what _PageFingerprint returned, the PageHash command right before the %%PageTrailer line
+    HRESULT WritePageSegments(const std::vector<PageSegment>& segments);
+
+    // Sends the PageManifest command and the manifest behind the last byte of the job
+    HRESULT WritePageManifest();
+
+    // Opens a trace-file (Chrome trace-event JSON), provided that a filename is specified in HKLM-LogoPrint2-Key LPDriverTraceFile
+    void CreateDriverTraceFile();
+
     // Writes cBuffer to debug-file, if debug-file has been opened
     void WriteDriverDebugFile(const char* cBuffer, DWORD cbBuffer);
 
     // Writes cBuffer to ULPSpooler using the established pipe
     HRESULT WriteToSpoolerPipe(const char* cBuffer, DWORD cbBuffer);
 
-    HRESULT WriteToSysSpoolBuf(PDEVOBJ pdevobj, DWORD dwIndex, IPrintOemDriverPS* pOEMHelp, PDWORD pdwReturn, PSTR pProcedure);
+    // Collects cBuffer until _State.dwWriteCoalesceBytes are reached, then writes them to the pipe at once
+    // (writes through if coalescing is off or cBuffer alone reaches the threshold)
+    HRESULT WriteToSpoolerPipeCoalesced(const char* cBuffer, DWORD cbBuffer);
+
+    // Writes the postscript collected by WriteToSpoolerPipeCoalesced to the pipe
+    HRESULT FlushPipeWriteBuffer();
+
+    // Log settings of the config with the per-printer tuning of the private DEVMODE applied
+    LogSettings GetLogSettings();
+
+    // Writes the postscript gathered for injection point dwIndex (the proprietary DSC comment if nothing has been gathered)
+    // to the system-spooler's buffer by one DrvWriteSpoolBuf call
+    HRESULT WriteToSysSpoolBuf(PDEVOBJ pdevobj, DWORD dwIndex, IPrintOemDriverPS* pOEMHelp, PDWORD pdwReturn);
 
     void InitCommandHandler();
 
@@ -88,25 +271,26 @@ private:
 
 public:
 
-    __stdcall CUlpCommandHandler(PWSTR pPrinterName)
+    __stdcall CUlpCommandHandler(PWSTR pPrinterName, PCOEMDEV pOemDevmode)
     {
         VERBOSE("In CUlpCommandHandler constructor...");
-        _bIsInitalized = false;
-        _bCancel = false;
-        _bErrorWritingPipe = false;
-        _dwWritePipeLastError = 0;
-        _bWriteToPSDebugFile = false;
-        _bHaveSeenPSAdobe = false;
-        _bHaveSeenEOF = false;
-        _bFirstWrite = true;
-        _bParameterIdHasValue = false;
-        _bWriteToPSDebugFile = false;
-        _lDriverJobId = 0;
-        _iCurrentPageNumber = 0;
-        _dwPSInjectToFail = 0;
-        _dwPSInjectToFailErrorCode = 0;
-        
-        ZeroMemory(_cParameterId, sizeof(_cParameterId));
+
+        // Copy of the private DEVMODE (a DEVMODE of an older version or of another plugin results in defaults)
+        ZeroMemory(&_OemDevmode, sizeof(_OemDevmode));
+        _OemDevmode.dmOEMExtra.dwSize = sizeof(OEMDEV);
+        _OemDevmode.dmOEMExtra.dwSignature = OEM_SIGNATURE;
+        _OemDevmode.dmOEMExtra.dwVersion = OEM_VERSION;
+        if (pOemDevmode != NULL)
+        {
+            ConvertOEMDevmode(pOemDevmode, &_OemDevmode);
+        }
+        MakeOEMDevmodeValid(&_OemDevmode);
+
+        ZeroMemory(&_State, sizeof(_State));
+        _State.bFirstWrite = true;
+        _State.bLogCurrentPage = true;
+        _State.bLogCurrentInjection = true;
+
         char printerNameAnsi[MAX_PATH + 10];
         ZeroMemory(printerNameAnsi, sizeof(printerNameAnsi));
         size_t printerNameLength = wcsnlen(pPrinterName, MAX_PATH + 10);
@@ -115,27 +299,25 @@ public:
             // printerName can be 'UniLogoPrint 2' or a MapId-file which ends in '.txt, Port'
             size_t charsConverted;
             wcstombs_s(&charsConverted, printerNameAnsi, MAX_PATH + 10, pPrinterName, printerNameLength);
+            _PrinterName.assign(printerNameAnsi);
             int i = (int)printerNameLength - 4;
             while (i >= 0 && (printerNameAnsi[i] < '0' || printerNameAnsi[i] > '9')) i--; // find the end of the parameter-id in pn
             int afterEndOfParameterId = i + 1;  // the character after(!) the last digit of parameter-id
             while (i >= 0 && printerNameAnsi[i]>='0' && printerNameAnsi[i]<='9') i--;   // find the start of the parameter-id in pn
             int startPosOfParameterId = i + 1; // Last index where character 0-9 was found
             int lenOfParameterId = afterEndOfParameterId - startPosOfParameterId;
-            if (startPosOfParameterId >= 0 && lenOfParameterId > 10 && lenOfParameterId < sizeof(_cParameterId))
+            if (startPosOfParameterId >= 0 && lenOfParameterId > 10 && lenOfParameterId < MAX_PATH + 10)
             {
-                // Parameter-id (at least of length 2) was found -> store in _cParameterId
-                for (i = 0; i < lenOfParameterId; i++) {
-                    _cParameterId[i] = printerNameAnsi[startPosOfParameterId + i];
-                }
-                _bParameterIdHasValue = true;
+                // Parameter-id (at least of length 2) was found -> store in _ParameterId
+                _ParameterId.assign(printerNameAnsi + startPosOfParameterId, lenOfParameterId);
+                _State.bParameterIdHasValue = true;
             }
         }
 
         _Log = NULL;
+        _Trace = NULL;
         _UlpSpooler = NULL;
 
-        ZeroMemory(_cbDriverJobId, sizeof(_cbDriverJobId));
-        ZeroMemory(_cbCurrentPageNumber, sizeof(_cbCurrentPageNumber));
         ZeroMemory(_bufferPSToInject, sizeof(_bufferPSToInject));
 
     }
@@ -145,21 +327,52 @@ public:
         VERBOSE("In CUlpCommandHandler destructor ...");
 
         if (_Log != NULL) _Log->LogLine("CUlpCommandHandler destructor ...");
+
+        // A job ending without PSINJECT_EOF has been aborted -> keep the flight recorder's records
+        if (_Log != NULL && _State.bIsInitalized && !_State.bHaveSeenEOF) _Log->DumpFlightRecorder("Job ended before PSINJECT_EOF");
         
-        if (_bWriteToPSDebugFile)
+        if (_State.bWriteToPSDebugFile)
         {
-            if (_Log != NULL) _Log->LogLine("Flushing and closing PostScript debug file ...");
-            _bWriteToPSDebugFile = false;
-            _streamPSDebugFile.flush();
-            _streamPSDebugFile.close();
+            _State.bWriteToPSDebugFile = false;
+            if (_PSDebugFile)
+            {
+                if (_Log != NULL) _Log->LogLine("Flushing and closing PostScript debug file ...");
+                _PSDebugFile->Close();
+                if (_Log != NULL)
+                {
+                    _Log->LogVarUL("PostScript debug file stream bytes", _PSDebugFile->StreamBytes());
+                    _Log->LogVarUL("PostScript debug file bytes", _PSDebugFile->BytesWritten());
+                    _Log->LogVarUL("PostScript debug file stalls", _PSDebugFile->Stalls());
+                    if (_PSDebugFile->LastError() != 0) _Log->LogVarUL("!!! PostScript debug file write error", _PSDebugFile->LastError());
+                }
+            }
         }
 
+        if (_UlpSpooler != NULL && _PageFingerprint)
+        {
+            WritePageSegments(_PageFingerprint->Flush());
+        }
+        if (_UlpSpooler != NULL && _PrologDedup && !_PrologDedup->IsDone())
+        {
+            // Job ended before the end of the prolog: what has been held back is sent as it is
+            WritePrologSegments(_PrologDedup->Flush());
+        }
+        if (_UlpSpooler != NULL && _PageManifest && !_State.bCancel && !_State.bErrorWritingPipe) WritePageManifest();
+        if (_UlpSpooler != NULL) FlushPipeWriteBuffer();
+
+        // After the last write: a pipe error or cancel of the final flush is a reason to dump, its bytes are in the tail
+        if (_PSTailCapture) CloseDriverPSTailCapture();
+
         if (_Log != NULL) _Log->LogLine("Closing LPSpooler and pipe ...");
         delete _UlpSpooler;
 
         if (_Log != NULL) _Log->ExitSection(0);
+        if (_Log != NULL) _Log->LogLatencySummary(_Config ? _Config->LatencyCsvFile() : "", _State.cbDriverJobId);
+        if (_Log != NULL) _Log->LogSamplingSummary();
         delete _Log;
 
+        delete _Trace;
+
     }
 
 
@@ -167,157 +380,91 @@ public:
 
     HRESULT ULPWritePrinter(PDEVOBJ, PVOID, DWORD, PDWORD);
 
-
-private:
-
-    void InitCommandNames()
+    // Logs an exception which escaped a driver entry point and keeps the flight recorder's records
+    void OnUnhandledException(const char* entryPoint, const std::exception& e)
     {
-        _Log->LogLine("Initializing command names ...");
-
-        // Init command names
-        ZeroMemory(_cCommandName, sizeof(_cCommandName));
-        _cCommandName[PSINJECT_BEGINSTREAM] = "PSINJECT_BEGINSTREAM";
-        _cCommandName[PSINJECT_PSADOBE] = "PSINJECT_PSADOBE";
-        _cCommandName[PSINJECT_PAGESATEND] = "PSINJECT_PAGESATEND";
-        _cCommandName[PSINJECT_PAGES] = "PSINJECT_PAGES";
-        _cCommandName[PSINJECT_DOCNEEDEDRES] = "PSINJECT_DOCNEEDEDRES";
-        _cCommandName[PSINJECT_DOCSUPPLIEDRES] = "PSINJECT_DOCSUPPLIEDRES";
-        _cCommandName[PSINJECT_PAGEORDER] = "PSINJECT_PAGEORDER";
-        _cCommandName[PSINJECT_ORIENTATION] = "PSINJECT_ORIENTATION";
-        _cCommandName[PSINJECT_BOUNDINGBOX] = "PSINJECT_BOUNDINGBOX";
-        _cCommandName[PSINJECT_DOCUMENTPROCESSCOLORS] = "PSINJECT_DOCUMENTPROCESSCOLORS";
-        _cCommandName[PSINJECT_COMMENTS] = "PSINJECT_COMMENTS";
-        _cCommandName[PSINJECT_BEGINDEFAULTS] = "PSINJECT_BEGINDEFAULTS";
-        _cCommandName[PSINJECT_ENDDEFAULTS] = "PSINJECT_ENDDEFAULTS";
-        _cCommandName[PSINJECT_BEGINPROLOG] = "PSINJECT_BEGINPROLOG";
-        _cCommandName[PSINJECT_ENDPROLOG] = "PSINJECT_ENDPROLOG";
-        _cCommandName[PSINJECT_BEGINSETUP] = "PSINJECT_BEGINSETUP";
-        _cCommandName[PSINJECT_ENDSETUP] = "PSINJECT_ENDSETUP";
-        _cCommandName[PSINJECT_TRAILER] = "PSINJECT_TRAILER";
-        _cCommandName[PSINJECT_EOF] = "PSINJECT_EOF";
-        _cCommandName[PSINJECT_ENDSTREAM] = "PSINJECT_ENDSTREAM";
-        _cCommandName[PSINJECT_DOCUMENTPROCESSCOLORSATEND] = "PSINJECT_DOCUMENTPROCESSCOLORSATEND";
-        _cCommandName[PSINJECT_PAGENUMBER] = "PSINJECT_PAGENUMBER";
-        _cCommandName[PSINJECT_BEGINPAGESETUP] = "PSINJECT_BEGINPAGESETUP";
-        _cCommandName[PSINJECT_ENDPAGESETUP] = "PSINJECT_ENDPAGESETUP";
-        _cCommandName[PSINJECT_PAGETRAILER] = "PSINJECT_PAGETRAILER";
-        _cCommandName[PSINJECT_PLATECOLOR] = "PSINJECT_PLATECOLOR";
-        _cCommandName[PSINJECT_SHOWPAGE] = "PSINJECT_SHOWPAGE";
-        _cCommandName[PSINJECT_PAGEBBOX] = "PSINJECT_PAGEBBOX";
-        _cCommandName[PSINJECT_ENDPAGECOMMENTS] = "PSINJECT_ENDPAGECOMMENTS";
-        _cCommandName[PSINJECT_VMSAVE] = "PSINJECT_VMSAVE";
-        _cCommandName[PSINJECT_VMRESTORE] = "PSINJECT_VMRESTORE";
+        if (_Log == NULL) return;
+        char reason[150];
+        sprintf_s(reason, sizeof(reason), "Unhandled exception in %s", entryPoint);
+        _Log->LogError(reason, e);
+        _Log->DumpFlightRecorder(reason);
     }
 
-    void InitIsInjectCommand()
-    {
-        _Log->LogLine("Initializing IsInjectCommand array ...");
-
-        _cIsInjectCommand[PSINJECT_BEGINSTREAM] = true;
-        _cIsInjectCommand[PSINJECT_PSADOBE] = true;
-        _cIsInjectCommand[PSINJECT_PAGESATEND] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_PAGES] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_DOCNEEDEDRES] = true;
-        _cIsInjectCommand[PSINJECT_DOCSUPPLIEDRES] = true;
-        _cIsInjectCommand[PSINJECT_PAGEORDER] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_ORIENTATION] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_BOUNDINGBOX] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_DOCUMENTPROCESSCOLORS] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_COMMENTS] = true;
-        _cIsInjectCommand[PSINJECT_BEGINDEFAULTS] = true;
-        _cIsInjectCommand[PSINJECT_ENDDEFAULTS] = true;
-        _cIsInjectCommand[PSINJECT_BEGINPROLOG] = true;
-        _cIsInjectCommand[PSINJECT_ENDPROLOG] = true;
-        _cIsInjectCommand[PSINJECT_BEGINSETUP] = true;
-        _cIsInjectCommand[PSINJECT_ENDSETUP] = true;
-        _cIsInjectCommand[PSINJECT_TRAILER] = true;
-        _cIsInjectCommand[PSINJECT_EOF] = true;
-        _cIsInjectCommand[PSINJECT_ENDSTREAM] = true;
-        _cIsInjectCommand[PSINJECT_DOCUMENTPROCESSCOLORSATEND] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_PAGENUMBER] = false; // Will not inject but replace! 
-        _cIsInjectCommand[PSINJECT_BEGINPAGESETUP] = true;
-        _cIsInjectCommand[PSINJECT_ENDPAGESETUP] = true;
-        _cIsInjectCommand[PSINJECT_PAGETRAILER] = true;
-        _cIsInjectCommand[PSINJECT_PLATECOLOR] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_SHOWPAGE] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_PAGEBBOX] = false; // Will not inject but replace!
-        _cIsInjectCommand[PSINJECT_ENDPAGECOMMENTS] = true;
-        _cIsInjectCommand[PSINJECT_VMSAVE] = true;
-        _cIsInjectCommand[PSINJECT_VMRESTORE] = true;
-    }
+
+private:
+
+    // State used on every WritePrinter call and at every injection point
+    JobState _State;
 
     CUlpSpoolerPipe* _UlpSpooler;
 
     // Logger
     CUlpLog* _Log;
 
-    bool _bParameterIdHasValue;
-    // Parameter-id (derived from the MapId-file in case of print-to-file print-job, typically in MS Word)
-    char _cParameterId[MAX_PATH + 10];
+    // Settings snapshot the job has started with (shared by all jobs of the process)
+    std::shared_ptr<const CUlpConfig> _Config;
 
-    // Array of propietary DSC comments used to mark injection points for evaluation by ULPSpooler
-    const char* _cCommandName[MAXCOMMAND + 1];
-    bool _cIsInjectCommand[MAXCOMMAND + 1];
+    // PostScript payloads of the snapshot (see HKLM-LogoPrint2-Key Payload_PSINJECT_*)
+    std::shared_ptr<const CUlpPayloads> _Payloads;
 
-    // Propietary DSC pattern used for poastscript injections (see HKLM-LogoPrint2-Key LogoPrintDSCCommandCStylePattern)
-    CHAR LOGOPRINT_DSCCOMMAND[DSCCOMMANDMAXSIZE];
+    // Optional trace sink for sections, pipe writes and WritePrinter calls (see HKLM-LogoPrint2-Key LPDriverTraceFile)
+    CUlpTrace* _Trace;
+
+    // Parameter-id (derived from the MapId-file in case of print-to-file print-job, typically in MS Word)
+    std::string _ParameterId;
 
-    // How the propietary DSC comment for SetParamId-command starts (is used to identify a SetParamId-command)
-    CHAR SETPARAMIDCOMMANDPREFIX[PLACEHOLDERMAXSIZE];
+    // Printer name the job has been started for (used by the PostScript capture policy)
+    std::string _PrinterName;
+
+    // Propietary DSC pattern used for poastscript injections, with CRLF (see HKLM-LogoPrint2-Key DSCCommandCStylePattern)
+    std::string _DSCCommandPattern;
 
     // Propietary DSC comment for SetParamId-command 
     CHAR SETPARAMIDCOMMANDNAME[SETPARAMIDCOMMANDNAMESIZE];
 
-    // Flag indicating whether this class is initialized 
-    bool  _bIsInitalized;
+    // _DSCCommandPattern with driver-job-id and command name bound, indexed like ulpInjectionPoints::INJECTIONPOINTS
+    // (empty if the pattern uses conversions other than %s, %d and %%)
+    std::vector<CUlpDSCTemplate> _DSCCommandTemplates;
+    CUlpDSCTemplate _DSCSetParamIdTemplate;
 
-    // Flag indicating if ULPSpooler.exe closed pipe to abort spooling
-    bool  _bCancel;
+    // Literal text all marks of the plugin start with (empty if marks are formatted by printf)
+    std::string _DSCMarkPrefix;
 
-    // Flag indicating if there has been an error writeing to the pipe 
-    bool  _bErrorWritingPipe;
+    // Received postscript sent by system-spooler will be written/logged to this file in the background (created only if configured)
+    std::unique_ptr<CUlpCaptureFile> _PSDebugFile;
 
-    // LastError when writing to pipe 
-    DWORD _dwWritePipeLastError;
-
-    // Flag indicating if postscript injection point PSINJECT_PSADOBE has been reached
-    // Used to not inject Postscript before this injection point!
-    bool _bHaveSeenPSAdobe;
+    // Instead of _PSDebugFile: the last part of the stream sent to ULPSpooler, written to _PSTailFileName when the job ends
+    // abnormally or HKLM-LogoPrint2-Key PSDebugTailDump is set, at once for running jobs (see HKLM-LogoPrint2-Key PSDebugTailMB)
+    std::unique_ptr<CUlpCaptureRing> _PSTailCapture;
+    std::string _PSTailFileName;
 
-    // Flag indicating if postscript injection point PSINJECT_EOF has been reached
-    // Used to not inject Postscript after this injection point!
-    bool _bHaveSeenEOF;
+    // Prolog deduplication, created only if the spooler takes prolog references (see HKLM-LogoPrint2-Key PrologDedupMaxKB)
+    std::unique_ptr<CUlpPrologDedup> _PrologDedup;
 
-    // Flag indicating if it's the first time that WritePrinter is called
-    bool _bFirstWrite;
+    // Fingerprint of the current page, created only if requested (see HKLM-LogoPrint2-Key PageFingerprint)
+    std::unique_ptr<CUlpPageFingerprint> _PageFingerprint;
 
-    // Received postscript sent by system-spooler will be written/logged to this ofstream
-    std::ofstream _streamPSDebugFile;
+    // Pages found in the DSC comments of the stream written to the pipe, created only if requested (see HKLM-LogoPrint2-Key PageManifest)
+    std::unique_ptr<CUlpPageManifest> _PageManifest;
 
-    // Flag indicating if postscript sent by system-spooler has to be logged to streamPSDebugFile
-    bool _bWriteToPSDebugFile;
+    // Buffer for Propietary DSC postscript to inject
+    CHAR _bufferPSToInject[PLACEHOLDERMAXSIZE];
 
-    // DriverJob-Id used:
-    // + in injected postscript as marker
-    // + will be written to output (MapId-file), when printing application does not send a SetParamId-command
-    //   and allows to identify the parameter-file to be used by LPSpooler.exe
-    // + will be passed to LPSpooler.exe to identify the parameter-file when SetParamId-command is not sent 
-    //   by printing application
-    long _lDriverJobId;
-    CHAR _cbDriverJobId[MAXSIZEDRIVERJOBID];
+    // Everything injected at the current injection point (marker, padding, payload), written by one DrvWriteSpoolBuf call
+    std::vector<char> _injectionBuffer;
 
-    // Current page number (used as parameter in injected postscript)
-    int  _iCurrentPageNumber;
-    CHAR _cbCurrentPageNumber[MAXSIZEPAGENUMBER];
+    // Injection points the spooler needs marks for (see CUlpSpoolerPipe::MarkerInterest), all if !_State.bHasMarkerInterest
+    std::bitset<MAXCOMMAND + 1> _markerInterest;
 
-    // Buffer for Propietary DSC postscript to inject
-    CHAR _bufferPSToInject[PLACEHOLDERMAXSIZE];
+    // Test hooks, created only if one of them is configured
+    std::unique_ptr<TestHooks> _TestHooks;
 
-    //PSInjectCommand that has to fail and send hResult=E_FAIL (for testing)
-    DWORD _dwPSInjectToFail;
+    // Per-printer tuning from the private DEVMODE the PDEV has been enabled with (0 = registry setting applies)
+    OEMDEV _OemDevmode;
 
-    //Error number returned to system when PSInjectCommand fails (for testing)
-    DWORD _dwPSInjectToFailErrorCode;
+    // Postscript collected up to _State.dwWriteCoalesceBytes before it is written to the pipe
+    // (see OEMDEV dwWriteCoalesceBytes and HKLM-LogoPrint2-Key WriteCoalesceBytes)
+    std::vector<char> _pipeWriteBuffer;
 
 };
 typedef CUlpCommandHandler* PULPCOMMANDHANDLER;
\ No newline at end of file
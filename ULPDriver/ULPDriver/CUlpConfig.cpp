@@ -0,0 +1,245 @@
+#include <Windows.h>
+#include <tchar.h>
+#include <mutex>
+#include <atomic>
+#include "CUlpConfig.h"
+#include "CUlpCaptureFile.h"
+#include "ulpHelper.h"
+#include "ulpCharBuffer.h"
+
+
+namespace
+{
+    // Current snapshot: replaced as a whole by the watcher, jobs holding the old one keep it alive
+    std::atomic<std::shared_ptr<const CUlpConfig>> g_Config;
+
+    std::mutex g_WatcherMutex;
+    std::atomic<bool> g_bWatcherRunning = false;
+    std::atomic<ULONGLONG> g_LastGetTicks = 0;
+    std::atomic<DWORD> g_Generation = 0;
+}
+
+
+    CUlpConfig::CUlpConfig()
+    {
+        m_PSInjectToFail = 0;
+        m_PSInjectToFailErrorCode = ERROR_BAD_PIPE;
+        m_ConnectTimeout = CONNECTTIMEOUT_DEFAULT;
+        m_ConnectTimeoutSource = "default from code";
+        m_ShowConsoleWindows = false;
+        m_Generation = 0;
+    }
+
+    std::shared_ptr<const CUlpConfig> CUlpConfig::Get()
+    {
+        g_LastGetTicks = GetTickCount64();
+        if (g_bWatcherRunning)
+        {
+            std::shared_ptr<const CUlpConfig> config = g_Config.load();
+            if (config) return config;
+        }
+
+        // No watcher: the snapshot may be outdated -> reload it and watch for changes from now on
+        std::lock_guard<std::mutex> lock(g_WatcherMutex);
+        if (!g_bWatcherRunning || !g_Config.load())
+        {
+            g_Config.store(Load());
+            StartWatcher();
+        }
+        return g_Config.load();
+    }
+
+    std::shared_ptr<const CUlpConfig> CUlpConfig::Load()
+    {
+        std::shared_ptr<CUlpConfig> loaded(new CUlpConfig());
+        try
+        {
+            CUlpConfigSource* source = CUlpConfigSource::Get();
+            loaded->m_SourceName = source->Name();
+            source->Load(loaded->m_Values);
+            loaded->DeriveSettings();
+        }
+        catch (...) {}
+        loaded->m_Generation = ++g_Generation;
+        return loaded;
+    }
+
+    // Called with g_WatcherMutex held
+    void CUlpConfig::StartWatcher()
+    {
+        // The watcher pins the DLL (released by FreeLibraryAndExitThread when it stops)
+        HMODULE module = NULL;
+        if (!GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCTSTR)&CUlpConfig::WatchSource, &module))
+        {
+            return;
+        }
+
+        // HKCU is to be watched and reread for the user the first job has been started for
+        HANDLE threadToken = NULL;
+        OpenThreadToken(GetCurrentThread(), TOKEN_IMPERSONATE | TOKEN_QUERY, TRUE, &threadToken);
+
+        HANDLE thread = CreateThread(NULL, 0, &CUlpConfig::WatchSource, threadToken, 0, NULL);
+        if (thread == NULL)
+        {
+            if (threadToken != NULL) CloseHandle(threadToken);
+            FreeLibrary(module);
+            return;
+        }
+        CloseHandle(thread);
+        g_bWatcherRunning = true;
+    }
+
+    DWORD WINAPI CUlpConfig::WatchSource(LPVOID threadToken)
+    {
+        CUlpConfigSource* source = CUlpConfigSource::Get();
+        HANDLE events[CONFIGHIVECOUNT] = { NULL, NULL };
+        DWORD eventCount = 0;
+
+        if (threadToken != NULL)
+        {
+            SetThreadToken(NULL, (HANDLE)threadToken);
+        }
+
+        try
+        {
+            eventCount = source->StartWatching(events);
+
+            for (;;)
+            {
+                DWORD waitResult = WAIT_TIMEOUT;
+                if (eventCount > 0)
+                {
+                    waitResult = WaitForMultipleObjects(eventCount, events, FALSE, CONFIGWATCHERIDLESEC * 1000);
+                }
+                else
+                {
+                    Sleep(CONFIGWATCHERIDLESEC * 1000);
+                }
+
+                if (waitResult >= WAIT_OBJECT_0 && waitResult < WAIT_OBJECT_0 + eventCount)
+                {
+                    // Values are usually written in bursts (installer, group policy, editor saves) -> wait for the burst to end
+                    Sleep(CONFIGRELOADDELAYMS);
+                    for (DWORD i = 0; i < eventCount; i++)
+                    {
+                        WaitForSingleObject(events[i], 0);
+                        source->Rearm(i);
+                    }
+                    std::shared_ptr<const CUlpConfig> previous = g_Config.load();
+                    std::shared_ptr<const CUlpConfig> reloaded = Load();
+                    g_Config.store(reloaded);
+
+                    // PSDebugTailDump just set: running (possibly hung) jobs are dumped now, not only when they end
+                    if (reloaded->GetInt(HKEY_LOCAL_MACHINE, _T("PSDebugTailDump"), 0) != 0 &&
+                        (!previous || previous->GetInt(HKEY_LOCAL_MACHINE, _T("PSDebugTailDump"), 0) == 0))
+                    {
+                        CUlpCaptureRing::DumpLive("Requested by PSDebugTailDump (job running)");
+                    }
+                }
+                else if (waitResult == WAIT_TIMEOUT)
+                {
+                    std::lock_guard<std::mutex> lock(g_WatcherMutex);
+                    if (GetTickCount64() - g_LastGetTicks >= CONFIGWATCHERIDLESEC * 1000ULL)
+                    {
+                        // Idle: stop watching, the next job reloads the snapshot and restarts the watcher.
+                        // The watch handles are closed before the flag is cleared: a new watcher reuses the source
+                        source->StopWatching();
+                        g_bWatcherRunning = false;
+                        break;
+                    }
+                }
+                else
+                {
+                    std::lock_guard<std::mutex> lock(g_WatcherMutex);
+                    source->StopWatching();
+                    g_bWatcherRunning = false;
+                    break;
+                }
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(g_WatcherMutex);
+            try
+            {
+                source->StopWatching();
+            }
+            catch (...) {}
+            g_bWatcherRunning = false;
+        }
+
+        if (threadToken != NULL)
+        {
+            SetThreadToken(NULL, NULL);
+            CloseHandle((HANDLE)threadToken);
+        }
+
+        HMODULE module = NULL;
+        GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                          (LPCTSTR)&CUlpConfig::WatchSource, &module);
+        FreeLibraryAndExitThread(module, 0);
+        return 0;
+    }
+
+    void CUlpConfig::DeriveSettings()
+    {
+        const TCHAR* pattern = GetStr(HKEY_LOCAL_MACHINE, _T("DSCCommandCStylePattern"));    // something like  %%UCSLogoPrint %s(%s) [%d]
+        m_DSCCommandPattern = pattern != NULL ? ToAnsi(pattern) : "%%UCSLogoPrint %s(%s) [%s]";
+
+        m_SetParamIdCommandName = ToAnsi(GetStr(HKEY_LOCAL_MACHINE, _T("DSCCommandSetParamId")));
+        m_DSCPrefix = ToAnsi(GetStr(HKEY_LOCAL_MACHINE, _T("DSCPrefix")));
+
+        m_PSDebugFile = ToAnsi(GetStr(HKEY_LOCAL_MACHINE, _T("LPDriverPSDebugFile")));
+        m_TraceFile = ToAnsi(GetStr(HKEY_LOCAL_MACHINE, _T("LPDriverTraceFile")));
+        m_LatencyCsvFile = ToAnsi(GetStr(HKEY_LOCAL_MACHINE, _T("LatencyCsvFile")));
+        m_PSDebugPrinterMatch = ToAnsi(GetStr(HKEY_LOCAL_MACHINE, _T("PSDebugPrinterMatch")));
+        m_PSDebugParamIdMatch = ToAnsi(GetStr(HKEY_LOCAL_MACHINE, _T("PSDebugParamIdMatch")));
+
+        m_PSInjectToFail = GetInt(HKEY_CURRENT_USER, _T("PSInjectToFail"), 0);
+        m_PSInjectToFailErrorCode = GetInt(HKEY_CURRENT_USER, _T("PSInjectToFailErrorCode"), ERROR_BAD_PIPE);
+
+        // HKCU wins over HKLM, 0 means not set
+        DWORD timeout = 0;
+        if (HasInt(HKEY_CURRENT_USER, _T("ConnectTimeout"), &timeout) && timeout > 0)
+        {
+            m_ConnectTimeout = timeout;
+            m_ConnectTimeoutSource = "from HKCU";
+        }
+        else if (HasInt(HKEY_LOCAL_MACHINE, _T("ConnectTimeout"), &timeout) && timeout > 0)
+        {
+            m_ConnectTimeout = timeout;
+            m_ConnectTimeoutSource = "from HKLM";
+        }
+
+        m_ShowConsoleWindows = GetInt(HKEY_CURRENT_USER, ulpHelper::REGVALUE_ShowConsoleWindows, 0) != 0;
+    }
+
+    std::string CUlpConfig::ToAnsi(const TCHAR* text)
+    {
+        if (text == NULL) return std::string();
+        size_t length = _tcslen(text);
+        ulpHelper::CharBuffer buffer(text, (DWORD)length + 1);
+        return std::string(buffer.GetBufferAnsi());
+    }
+
+    bool CUlpConfig::HasInt(HKEY hKey, LPCTSTR valueName, DWORD* value) const
+    {
+        auto& ints = m_Values.ints[HiveIndex(hKey)];
+        auto entry = ints.find(valueName);
+        if (entry == ints.end()) return false;
+        *value = entry->second;
+        return true;
+    }
+
+    DWORD CUlpConfig::GetInt(HKEY hKey, LPCTSTR valueName, DWORD defaultValue) const
+    {
+        DWORD value = defaultValue;
+        return HasInt(hKey, valueName, &value) ? value : defaultValue;
+    }
+
+    const TCHAR* CUlpConfig::GetStr(HKEY hKey, LPCTSTR valueName) const
+    {
+        auto& strs = m_Values.strs[HiveIndex(hKey)];
+        auto entry = strs.find(valueName);
+        return entry != strs.end() ? entry->second.c_str() : NULL;
+    }
@@ -0,0 +1,110 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpConfig.h
+//
+//  PURPOSE:   Header for the immutable snapshot of the LogoPrint2 settings
+//             (HKLM and HKCU SOFTWARE\IPGM\UniLogoPrint2, or the file named by ULPDRIVER_CONFIG)
+//             shared by all jobs of the process and kept current by a watcher
+//
+
+#pragma once
+#include <windows.h>
+#include <tchar.h>
+#include <string>
+#include <map>
+#include <memory>
+#include "CUlpConfigSource.h"
+
+
+const DWORD CONNECTTIMEOUT_DEFAULT = 30;   // Default timeout (in seconds) for connecting to LPSpooler
+const DWORD CONFIGRELOADDELAYMS = 500;    // changes arriving within this delay are reloaded at once
+const DWORD CONFIGWATCHERIDLESEC = 600;   // the watcher stops (and unpins the DLL) when no job started for this long
+
+
+class CUlpConfig
+{
+
+private:
+    // All DWORD and string values of the configuration source, index 0 = HKLM, 1 = HKCU
+    ConfigValues m_Values;
+    // Where the values came from (registry or file)
+    std::string m_SourceName;
+
+    // Settings derived from the values above (with defaults applied)
+    std::string m_DSCCommandPattern;
+    std::string m_SetParamIdCommandName;
+    std::string m_DSCPrefix;
+    std::string m_PSDebugFile;
+    std::string m_TraceFile;
+    std::string m_LatencyCsvFile;
+    std::string m_PSDebugPrinterMatch;
+    std::string m_PSDebugParamIdMatch;
+    DWORD m_PSInjectToFail;
+    DWORD m_PSInjectToFailErrorCode;
+    DWORD m_ConnectTimeout;
+    const char* m_ConnectTimeoutSource;
+    bool m_ShowConsoleWindows;
+
+    // Counts the snapshots loaded by this process (1 = first)
+    DWORD m_Generation;
+
+    CUlpConfig();
+
+    // Builds a new snapshot from the configuration source
+    static std::shared_ptr<const CUlpConfig> Load();
+
+    // Starts the thread reloading the snapshot whenever the configuration source changes
+    static void StartWatcher();
+    static DWORD WINAPI WatchSource(LPVOID threadToken);
+
+    void DeriveSettings();
+
+    static int HiveIndex(HKEY hKey) { return hKey == HKEY_CURRENT_USER ? CONFIGHIVE_HKCU : CONFIGHIVE_HKLM; }
+    static std::string ToAnsi(const TCHAR* text);
+
+public:
+
+    // Returns the current snapshot of this process (an atomic load while the watcher is running, else it is
+    // reloaded and the watcher is started). A job keeps the snapshot it got for its whole lifetime.
+    static std::shared_ptr<const CUlpConfig> Get();
+
+    DWORD Generation() const { return m_Generation; }
+    const char* SourceName() const { return m_SourceName.c_str(); }
+
+    // Raw values of hKey (HKEY_LOCAL_MACHINE or HKEY_CURRENT_USER, [HKLM] or [HKCU] in a file): no registry access
+    bool HasInt(HKEY hKey, LPCTSTR valueName, DWORD* value) const;
+    DWORD GetInt(HKEY hKey, LPCTSTR valueName, DWORD defaultValue) const;
+    const TCHAR* GetStr(HKEY hKey, LPCTSTR valueName) const;    // NULL if the value does not exist
+
+    // Propietary DSC pattern used for postscript injections (HKLM DSCCommandCStylePattern, without CRLF)
+    const char* DSCCommandPattern() const { return m_DSCCommandPattern.c_str(); }
+    // Name of the SetParamId-command (HKLM DSCCommandSetParamId)
+    const char* SetParamIdCommandName() const { return m_SetParamIdCommandName.c_str(); }
+    // Prefix of DSC comments (HKLM DSCPrefix)
+    const char* DSCPrefix() const { return m_DSCPrefix.c_str(); }
+
+    // Files for debugging, empty if not configured (HKLM LPDriverPSDebugFile, LPDriverTraceFile, LatencyCsvFile)
+    const char* PSDebugFile() const { return m_PSDebugFile.c_str(); }
+    const char* TraceFile() const { return m_TraceFile.c_str(); }
+    const char* LatencyCsvFile() const { return m_LatencyCsvFile.c_str(); }
+    // Jobs captured to LPDriverPSDebugFile: printer names containing / parameter ids starting with one of the comma or
+    // semicolon separated entries (HKLM PSDebugPrinterMatch, PSDebugParamIdMatch), empty if not configured
+    const char* PSDebugPrinterMatch() const { return m_PSDebugPrinterMatch.c_str(); }
+    const char* PSDebugParamIdMatch() const { return m_PSDebugParamIdMatch.c_str(); }
+
+    // PSInjectCommand that has to fail and the error returned (HKCU PSInjectToFail, PSInjectToFailErrorCode; for testing)
+    DWORD PSInjectToFail() const { return m_PSInjectToFail; }
+    DWORD PSInjectToFailErrorCode() const { return m_PSInjectToFailErrorCode; }
+
+    // LPSpooler.exe (HKLM LPSpoolerPath), NULL if not configured
+    const TCHAR* SpoolerPath() const { return GetStr(HKEY_LOCAL_MACHINE, _T("LPSpoolerPath")); }
+    // Timeout in seconds for connecting to LPSpooler (HKCU or HKLM ConnectTimeout) and where it came from
+    DWORD ConnectTimeout() const { return m_ConnectTimeout; }
+    const char* ConnectTimeoutSource() const { return m_ConnectTimeoutSource; }
+    // HKCU ShowConsoleWindows
+    bool ShowConsoleWindows() const { return m_ShowConsoleWindows; }
+
+    // Log folder configured in hKey (LogFolder), NULL if not configured
+    const TCHAR* LogFolder(HKEY hKey) const { return GetStr(hKey, _T("LogFolder")); }
+
+};
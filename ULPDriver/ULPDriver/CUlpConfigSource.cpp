@@ -0,0 +1,351 @@
+#include <Windows.h>
+#include <tchar.h>
+#include <cctype>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+#include "CUlpConfigSource.h"
+#include "ulpHelper.h"
+#include "ulpCharBuffer.h"
+
+
+
+    CUlpConfigSource* CUlpConfigSource::Get()
+    {
+        static std::once_flag createFlag;
+        static std::unique_ptr<CUlpConfigSource> source;
+
+        std::call_once(createFlag, []() {
+            TCHAR fileName[MAX_PATH + 1];
+            ZeroMemory(fileName, sizeof(fileName));
+            DWORD length = GetEnvironmentVariable(CONFIGFILE_ENVIRONMENTVARIABLE, fileName, _countof(fileName));
+            if (length > 0 && length < _countof(fileName))
+            {
+                source = std::make_unique<CUlpFileConfigSource>(fileName);
+            }
+            else
+            {
+                source = std::make_unique<CUlpRegistryConfigSource>();
+            }
+        });
+        return source.get();
+    }
+
+
+
+    CUlpRegistryConfigSource::CUlpRegistryConfigSource()
+    {
+        m_WatchCount = 0;
+        for (int i = 0; i < CONFIGHIVECOUNT; i++)
+        {
+            m_WatchedKeys[i] = NULL;
+            m_Events[i] = NULL;
+        }
+    }
+
+    CUlpRegistryConfigSource::~CUlpRegistryConfigSource(void)
+    {
+        StopWatching();
+    }
+
+    void CUlpRegistryConfigSource::Load(ConfigValues& values)
+    {
+        LoadKey(HKEY_LOCAL_MACHINE, CONFIGHIVE_HKLM, values);
+        LoadKey(HKEY_CURRENT_USER, CONFIGHIVE_HKCU, values);
+    }
+
+    // Reads all values of the LogoPrint2-Key in hKey (one RegOpenKeyEx, then RegEnumValue)
+    void CUlpRegistryConfigSource::LoadKey(HKEY hKey, int hive, ConfigValues& values)
+    {
+        HKEY regHandle = NULL;
+        REGSAM samDesired = KEY_QUERY_VALUE;
+        if (hKey == HKEY_LOCAL_MACHINE)
+        {
+            samDesired |= KEY_WOW64_64KEY;
+        }
+        if (RegOpenKeyEx(hKey, ulpHelper::REGKEY_LogPrint2, 0, samDesired, &regHandle) != ERROR_SUCCESS)
+        {
+            return;
+        }
+
+        DWORD maxNameLength = 0;
+        DWORD maxDataLength = 0;
+        if (RegQueryInfoKey(regHandle, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &maxNameLength, &maxDataLength, NULL, NULL) == ERROR_SUCCESS)
+        {
+            std::vector<TCHAR> name(maxNameLength + 1);
+            std::vector<BYTE> data(maxDataLength + sizeof(TCHAR));
+
+            for (DWORD index = 0; ; index++)
+            {
+                DWORD nameLength = (DWORD)name.size();
+                DWORD dataLength = maxDataLength;
+                DWORD dwType = 0;
+                LSTATUS rc = RegEnumValue(regHandle, index, name.data(), &nameLength, NULL, &dwType, data.data(), &dataLength);
+                if (rc == ERROR_NO_MORE_ITEMS) break;
+                if (rc != ERROR_SUCCESS) continue;
+
+                if (dwType == REG_DWORD && dataLength == sizeof(DWORD))
+                {
+                    values.ints[hive][tstring(name.data(), nameLength)] = *(DWORD*)data.data();
+                }
+                else if (dwType == REG_SZ || dwType == REG_EXPAND_SZ)
+                {
+                    // Stored strings are not necessarily null-terminated
+                    size_t length = dataLength / sizeof(TCHAR);
+                    const TCHAR* text = (const TCHAR*)data.data();
+                    while (length > 0 && text[length - 1] == _T('\0')) length--;
+                    values.strs[hive][tstring(name.data(), nameLength)] = tstring(text, length);
+                }
+                else if (dwType == REG_MULTI_SZ)
+                {
+                    // Lines (e.g. of a PostScript payload) are joined by CRLF
+                    size_t length = dataLength / sizeof(TCHAR);
+                    const TCHAR* text = (const TCHAR*)data.data();
+                    while (length > 0 && text[length - 1] == _T('\0')) length--;
+                    tstring joined;
+                    for (size_t i = 0; i < length; i++)
+                    {
+                        if (text[i] == _T('\0')) joined.append(_T("\r\n"));
+                        else joined.push_back(text[i]);
+                    }
+                    values.strs[hive][tstring(name.data(), nameLength)] = joined;
+                }
+            }
+        }
+        RegCloseKey(regHandle);
+    }
+
+    DWORD CUlpRegistryConfigSource::StartWatching(HANDLE handles[])
+    {
+        const HKEY roots[CONFIGHIVECOUNT] = { HKEY_LOCAL_MACHINE, HKEY_CURRENT_USER };
+
+        StopWatching();
+        for (int i = 0; i < CONFIGHIVECOUNT; i++)
+        {
+            REGSAM samDesired = KEY_NOTIFY;
+            if (roots[i] == HKEY_LOCAL_MACHINE)
+            {
+                samDesired |= KEY_WOW64_64KEY;
+            }
+            // A key which does not exist (yet) is not watched
+            HKEY key = NULL;
+            if (RegOpenKeyEx(roots[i], ulpHelper::REGKEY_LogPrint2, 0, samDesired, &key) != ERROR_SUCCESS)
+            {
+                continue;
+            }
+            HANDLE event = CreateEvent(NULL, FALSE, FALSE, NULL);
+            if (event == NULL || RegNotifyChangeKeyValue(key, FALSE, REG_NOTIFY_CHANGE_LAST_SET, event, TRUE) != ERROR_SUCCESS)
+            {
+                if (event != NULL) CloseHandle(event);
+                RegCloseKey(key);
+                continue;
+            }
+            m_WatchedKeys[m_WatchCount] = key;
+            m_Events[m_WatchCount] = event;
+            handles[m_WatchCount] = event;
+            m_WatchCount++;
+        }
+        return m_WatchCount;
+    }
+
+    void CUlpRegistryConfigSource::Rearm(DWORD index)
+    {
+        if (index >= m_WatchCount) return;
+        RegNotifyChangeKeyValue(m_WatchedKeys[index], FALSE, REG_NOTIFY_CHANGE_LAST_SET, m_Events[index], TRUE);
+    }
+
+    void CUlpRegistryConfigSource::StopWatching()
+    {
+        for (DWORD i = 0; i < m_WatchCount; i++)
+        {
+            CloseHandle(m_Events[i]);
+            RegCloseKey(m_WatchedKeys[i]);
+            m_Events[i] = NULL;
+            m_WatchedKeys[i] = NULL;
+        }
+        m_WatchCount = 0;
+    }
+
+
+
+    CUlpFileConfigSource::CUlpFileConfigSource(const TCHAR* fileName)
+    {
+        m_FileName = fileName;
+        m_Notification = INVALID_HANDLE_VALUE;
+
+        ulpHelper::CharBuffer buffer(fileName, MAX_PATH + 1);
+        m_Name = std::string("file '") + buffer.GetBufferAnsi() + "'";
+    }
+
+    CUlpFileConfigSource::~CUlpFileConfigSource(void)
+    {
+        StopWatching();
+    }
+
+    void CUlpFileConfigSource::Load(ConfigValues& values)
+    {
+        HANDLE file = CreateFile(m_FileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) return;
+
+        LARGE_INTEGER fileSize;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && fileSize.QuadPart < 16 * 1024 * 1024)
+        {
+            HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping != NULL)
+            {
+                const char* view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                if (view != NULL)
+                {
+                    Parse(view, (size_t)fileSize.QuadPart, values);
+                    UnmapViewOfFile(view);
+                }
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+    }
+
+    void CUlpFileConfigSource::Parse(const char* text, size_t length, ConfigValues& values)
+    {
+        const char* end = text + length;
+        const char* pos = text;
+        int hive = -1;  // values before the first section are ignored
+
+        // UTF-8 byte order mark
+        if (length >= 3 && (unsigned char)pos[0] == 0xEF && (unsigned char)pos[1] == 0xBB && (unsigned char)pos[2] == 0xBF)
+        {
+            pos += 3;
+        }
+
+        while (pos < end)
+        {
+            const char* lineEnd = pos;
+            while (lineEnd < end && *lineEnd != '\n') lineEnd++;
+            const char* next = lineEnd < end ? lineEnd + 1 : end;
+
+            // Trim
+            while (pos < lineEnd && (*pos == ' ' || *pos == '\t')) pos++;
+            while (lineEnd > pos && (lineEnd[-1] == ' ' || lineEnd[-1] == '\t' || lineEnd[-1] == '\r')) lineEnd--;
+
+            if (pos < lineEnd && *pos != ';' && *pos != '#')
+            {
+                if (*pos == '[')
+                {
+                    std::string section(pos + 1, lineEnd);
+                    if (!section.empty() && section.back() == ']') section.pop_back();
+                    if (_stricmp(section.c_str(), "HKLM") == 0 || _stricmp(section.c_str(), "HKEY_LOCAL_MACHINE") == 0)
+                    {
+                        hive = CONFIGHIVE_HKLM;
+                    }
+                    else if (_stricmp(section.c_str(), "HKCU") == 0 || _stricmp(section.c_str(), "HKEY_CURRENT_USER") == 0)
+                    {
+                        hive = CONFIGHIVE_HKCU;
+                    }
+                    else
+                    {
+                        hive = -1;
+                    }
+                }
+                else if (hive >= 0)
+                {
+                    const char* equals = pos;
+                    while (equals < lineEnd && *equals != '=') equals++;
+                    if (equals < lineEnd)
+                    {
+                        const char* nameEnd = equals;
+                        while (nameEnd > pos && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t')) nameEnd--;
+                        const char* value = equals + 1;
+                        while (value < lineEnd && (*value == ' ' || *value == '\t')) value++;
+
+                        // Comment after an unquoted value
+                        const char* valueEnd = lineEnd;
+                        if (value < lineEnd && *value != '"')
+                        {
+                            const char* comment = value;
+                            while (comment < lineEnd && *comment != ';') comment++;
+                            valueEnd = comment;
+                            while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) valueEnd--;
+                        }
+
+                        tstring name = ToTString(pos, nameEnd - pos);
+                        std::string valueText(value, valueEnd);
+                        // Decimal or 0x-hex (no octal: "010" is 10)
+                        char* numberEnd = NULL;
+                        unsigned long number = 0;
+                        if (valueText.size() > 2 && valueText[0] == '0' && (valueText[1] == 'x' || valueText[1] == 'X'))
+                        {
+                            if (isxdigit((unsigned char)valueText[2])) number = strtoul(valueText.c_str() + 2, &numberEnd, 16);
+                        }
+                        else if (!valueText.empty() && isdigit((unsigned char)valueText[0]))
+                        {
+                            number = strtoul(valueText.c_str(), &numberEnd, 10);
+                        }
+
+                        if (!name.empty() && !valueText.empty() && numberEnd != NULL && *numberEnd == '\0' && valueText[0] != '-')
+                        {
+                            values.ints[hive][name] = (DWORD)number;
+                        }
+                        else if (!name.empty())
+                        {
+                            if (valueText.size() >= 2 && valueText.front() == '"')
+                            {
+                                size_t closingQuote = valueText.find('"', 1);
+                                valueText = valueText.substr(1, closingQuote == std::string::npos ? std::string::npos : closingQuote - 1);
+                            }
+                            values.strs[hive][name] = ToTString(valueText.c_str(), valueText.size());
+                        }
+                    }
+                }
+            }
+            pos = next;
+        }
+    }
+
+    tstring CUlpFileConfigSource::ToTString(const char* text, size_t length)
+    {
+#ifdef UNICODE
+        if (length == 0) return tstring();
+        int wideLength = MultiByteToWideChar(CP_UTF8, 0, text, (int)length, NULL, 0);
+        if (wideLength <= 0) return tstring();
+        tstring result((size_t)wideLength, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, text, (int)length, &result[0], wideLength);
+        return result;
+#else
+        return tstring(text, length);
+#endif // !UNICODE
+    }
+
+    DWORD CUlpFileConfigSource::StartWatching(HANDLE handles[])
+    {
+        StopWatching();
+
+        // Watch the folder of the file (editors replace files rather than writing them in place)
+        TCHAR folder[MAX_PATH + 1];
+        _tcsncpy_s(folder, _countof(folder), m_FileName.c_str(), _TRUNCATE);
+        TCHAR* lastSeparator = _tcsrchr(folder, _T('\\'));
+        if (lastSeparator == NULL) return 0;
+        *lastSeparator = _T('\0');
+
+        m_Notification = FindFirstChangeNotification(folder, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+        if (m_Notification == INVALID_HANDLE_VALUE) return 0;
+        handles[0] = m_Notification;
+        return 1;
+    }
+
+    void CUlpFileConfigSource::Rearm(DWORD index)
+    {
+        if (index == 0 && m_Notification != INVALID_HANDLE_VALUE)
+        {
+            FindNextChangeNotification(m_Notification);
+        }
+    }
+
+    void CUlpFileConfigSource::StopWatching()
+    {
+        if (m_Notification != INVALID_HANDLE_VALUE)
+        {
+            FindCloseChangeNotification(m_Notification);
+            m_Notification = INVALID_HANDLE_VALUE;
+        }
+    }
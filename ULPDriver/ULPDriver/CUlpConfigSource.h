@@ -0,0 +1,123 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpConfigSource.h
+//
+//  PURPOSE:   Header for the sources the LogoPrint2 settings are loaded from:
+//             the registry (default) or a flat INI file (environment variable ULPDRIVER_CONFIG)
+//
+
+#pragma once
+#include <windows.h>
+#include <tchar.h>
+#include <string>
+#include <map>
+#include <memory>
+
+
+typedef std::basic_string<TCHAR> tstring;
+
+// Value names are case insensitive (as in the registry)
+typedef struct ConfigNameLess
+{
+    bool operator()(const tstring& a, const tstring& b) const { return _tcsicmp(a.c_str(), b.c_str()) < 0; }
+} ConfigNameLess;
+
+// All DWORD and string values of a source, index 0 = HKLM, 1 = HKCU
+typedef struct ConfigValues
+{
+    std::map<tstring, DWORD, ConfigNameLess> ints[2];
+    std::map<tstring, tstring, ConfigNameLess> strs[2];
+} ConfigValues;
+
+const int CONFIGHIVE_HKLM = 0;
+const int CONFIGHIVE_HKCU = 1;
+const int CONFIGHIVECOUNT = 2;
+
+// Environment variable naming an INI file to be used instead of the registry
+const LPCTSTR CONFIGFILE_ENVIRONMENTVARIABLE = _T("ULPDRIVER_CONFIG");
+
+
+class CUlpConfigSource
+{
+
+public:
+
+    virtual ~CUlpConfigSource(void) {}
+
+    // Reads all values
+    virtual void Load(ConfigValues& values) = 0;
+
+    // Starts watching the source for changes: fills handles (at most CONFIGHIVECOUNT) that are
+    // signaled on a change and returns their number (0 = the source cannot be watched)
+    virtual DWORD StartWatching(HANDLE handles[]) = 0;
+
+    // Re-arms handle index after it has been signaled
+    virtual void Rearm(DWORD index) = 0;
+
+    virtual void StopWatching() = 0;
+
+    // For the log
+    virtual const char* Name() = 0;
+
+    // Returns the source of this process: the INI file named by ULPDRIVER_CONFIG if set, else the registry
+    static CUlpConfigSource* Get();
+
+};
+
+
+// HKLM and HKCU SOFTWARE\IPGM\UniLogoPrint2
+class CUlpRegistryConfigSource : public CUlpConfigSource
+{
+
+private:
+    HKEY m_WatchedKeys[CONFIGHIVECOUNT];
+    HANDLE m_Events[CONFIGHIVECOUNT];
+    DWORD m_WatchCount;
+
+    void LoadKey(HKEY hKey, int hive, ConfigValues& values);
+
+public:
+
+    CUlpRegistryConfigSource();
+    ~CUlpRegistryConfigSource(void);
+
+    void Load(ConfigValues& values) override;
+    DWORD StartWatching(HANDLE handles[]) override;
+    void Rearm(DWORD index) override;
+    void StopWatching() override;
+    const char* Name() override { return "registry"; }
+
+};
+
+
+// INI file (ANSI or UTF-8), mapped into memory and parsed at once:
+//
+//     [HKLM]                       ; or [HKEY_LOCAL_MACHINE]
+//     LPSpoolerPath = "C:\Program Files\UniLogoPrint2\LPSpooler.exe"
+//     ConnectTimeout = 30          ; unquoted numbers (decimal or 0x-hex) are DWORD values
+//     [HKCU]                       ; or [HKEY_CURRENT_USER]
+//     LogFolder = C:\Temp          ; everything else is a string value
+//
+class CUlpFileConfigSource : public CUlpConfigSource
+{
+
+private:
+    tstring m_FileName;
+    HANDLE m_Notification;
+    std::string m_Name;
+
+    void Parse(const char* text, size_t length, ConfigValues& values);
+    static tstring ToTString(const char* text, size_t length);
+
+public:
+
+    CUlpFileConfigSource(const TCHAR* fileName);
+    ~CUlpFileConfigSource(void);
+
+    void Load(ConfigValues& values) override;
+    DWORD StartWatching(HANDLE handles[]) override;
+    void Rearm(DWORD index) override;
+    void StopWatching() override;
+    const char* Name() override { return m_Name.c_str(); }
+
+};
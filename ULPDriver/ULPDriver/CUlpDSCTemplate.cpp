@@ -0,0 +1,219 @@
+#include <Windows.h>
+#include <cstring>
+#include "CUlpDSCTemplate.h"
+
+
+
+    CUlpDSCTemplate::CUlpDSCTemplate()
+    {
+        m_bCompiled = false;
+    }
+
+    void CUlpDSCTemplate::AddLiteral(const char* text, size_t length)
+    {
+        if (length == 0) return;
+        if (!m_Segments.empty() && m_Segments.back().slot < 0 && m_Segments.back().offset + m_Segments.back().length == m_Literals.size())
+        {
+            m_Segments.back().length += length;
+        }
+        else
+        {
+            m_Segments.push_back(Segment{ -1, m_Literals.size(), length });
+        }
+        m_Literals.append(text, length);
+    }
+
+    bool CUlpDSCTemplate::Compile(const char* pattern)
+    {
+        m_Literals.clear();
+        m_Segments.clear();
+        m_bCompiled = false;
+        if (pattern == NULL) return false;
+
+        int nextSlot = 0;
+        const char* literalStart = pattern;
+        const char* pos = pattern;
+        while (*pos != '\0')
+        {
+            if (*pos != '%')
+            {
+                pos++;
+                continue;
+            }
+
+            AddLiteral(literalStart, pos - literalStart);
+            if (pos[1] == '%')
+            {
+                AddLiteral("%", 1);
+            }
+            else if ((pos[1] == 's' || pos[1] == 'd') && nextSlot < DSCSLOTCOUNT)
+            {
+                m_Segments.push_back(Segment{ nextSlot++, 0, 0 });
+            }
+            else
+            {
+                // Flags, widths or other conversions: leave them to printf
+                m_Literals.clear();
+                m_Segments.clear();
+                return false;
+            }
+            pos += 2;
+            literalStart = pos;
+        }
+        AddLiteral(literalStart, pos - literalStart);
+
+        m_bCompiled = true;
+        return true;
+    }
+
+    bool CUlpDSCTemplate::CompilePlaceholders(const char* text, const char* const names[], int nameCount)
+    {
+        m_Literals.clear();
+        m_Segments.clear();
+        m_bCompiled = false;
+        if (text == NULL || nameCount > DSCSLOTCOUNT) return false;
+
+        const char* literalStart = text;
+        const char* pos = text;
+        while (*pos != '\0')
+        {
+            if (pos[0] != '$' || pos[1] != '(')
+            {
+                pos++;
+                continue;
+            }
+
+            const char* nameStart = pos + 2;
+            const char* nameEnd = strchr(nameStart, ')');
+            int slot = -1;
+            for (int i = 0; nameEnd != NULL && i < nameCount; i++)
+            {
+                if (strlen(names[i]) == (size_t)(nameEnd - nameStart) && _strnicmp(names[i], nameStart, nameEnd - nameStart) == 0)
+                {
+                    slot = i;
+                    break;
+                }
+            }
+            if (slot < 0)
+            {
+                pos++;
+                continue;
+            }
+
+            AddLiteral(literalStart, pos - literalStart);
+            m_Segments.push_back(Segment{ slot, 0, 0 });
+            pos = nameEnd + 1;
+            literalStart = pos;
+        }
+        AddLiteral(literalStart, pos - literalStart);
+
+        m_bCompiled = true;
+        return true;
+    }
+
+    CUlpDSCTemplate CUlpDSCTemplate::Bind(int slot, const char* value, size_t valueLength) const
+    {
+        CUlpDSCTemplate bound;
+        if (!m_bCompiled) return bound;
+
+        for (const Segment& segment : m_Segments)
+        {
+            if (segment.slot < 0)
+            {
+                bound.AddLiteral(m_Literals.data() + segment.offset, segment.length);
+            }
+            else if (segment.slot == slot)
+            {
+                bound.AddLiteral(value != NULL ? value : "", value != NULL ? valueLength : 0);
+            }
+            else
+            {
+                bound.m_Segments.push_back(segment);
+            }
+        }
+        bound.m_bCompiled = true;
+        return bound;
+    }
+
+    size_t CUlpDSCTemplate::Emit(char* buffer, size_t bufferSize, const char* const values[DSCSLOTCOUNT], const size_t lengths[DSCSLOTCOUNT]) const
+    {
+        if (!m_bCompiled || buffer == NULL || bufferSize == 0) return 0;
+
+        size_t length = 0;
+        for (const Segment& segment : m_Segments)
+        {
+            const char* text;
+            size_t textLength;
+            if (segment.slot < 0)
+            {
+                text = m_Literals.data() + segment.offset;
+                textLength = segment.length;
+            }
+            else
+            {
+                text = values[segment.slot];
+                textLength = text != NULL ? lengths[segment.slot] : 0;
+            }
+
+            // As StringCbPrintfA: a command which does not fit is not injected at all
+            if (length + textLength >= bufferSize)
+            {
+                buffer[0] = '\0';
+                return 0;
+            }
+            memcpy(buffer + length, text, textLength);
+            length += textLength;
+        }
+        buffer[length] = '\0';
+        return length;
+    }
+
+    std::string CUlpDSCTemplate::LiteralPrefix() const
+    {
+        if (!m_bCompiled || m_Segments.empty() || m_Segments.front().slot >= 0) return std::string();
+        return m_Literals.substr(m_Segments.front().offset, m_Segments.front().length);
+    }
+
+    size_t CUlpDSCTemplate::EmitLength(const char* const values[DSCSLOTCOUNT], const size_t lengths[DSCSLOTCOUNT]) const
+    {
+        if (!m_bCompiled) return 0;
+
+        size_t length = 0;
+        for (const Segment& segment : m_Segments)
+        {
+            if (segment.slot < 0)
+            {
+                length += segment.length;
+            }
+            else if (values[segment.slot] != NULL)
+            {
+                length += lengths[segment.slot];
+            }
+        }
+        return length;
+    }
+
+    size_t CUlpDSCTemplate::FormatDecimal(char* buffer, size_t bufferSize, long value)
+    {
+        char digits[24];
+        size_t count = 0;
+        unsigned long magnitude = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+        do
+        {
+            digits[count++] = (char)('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+
+        size_t length = count + (value < 0 ? 1 : 0);
+        if (buffer == NULL || length >= bufferSize)
+        {
+            if (buffer != NULL && bufferSize > 0) buffer[0] = '\0';
+            return 0;
+        }
+
+        char* out = buffer;
+        if (value < 0) *out++ = '-';
+        while (count > 0) *out++ = digits[--count];
+        *out = '\0';
+        return length;
+    }
@@ -0,0 +1,71 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpDSCTemplate.h
+//
+//  PURPOSE:   Header for the proprietary DSC command pattern (and PostScript payloads) compiled into
+//             literal and slot segments
+//
+
+#pragma once
+#include <windows.h>
+#include <string>
+#include <vector>
+
+
+// Slots of the DSC command pattern in the order of its conversions (%%UCSLogoPrint %s(%s) [%s])
+const int DSCSLOT_NAME = 0;
+const int DSCSLOT_PARAM = 1;
+const int DSCSLOT_JOBID = 2;
+const int DSCSLOTCOUNT = 3;
+
+
+class CUlpDSCTemplate
+{
+
+private:
+    // A literal part of m_Literals (slot = -1) or the value of a slot
+    typedef struct Segment
+    {
+        int slot;
+        size_t offset;
+        size_t length;
+    } Segment;
+
+    std::string m_Literals;
+    std::vector<Segment> m_Segments;
+    bool m_bCompiled;
+
+    void AddLiteral(const char* text, size_t length);
+
+public:
+
+    CUlpDSCTemplate();
+
+    // Parses a C-style pattern: %% and one %s or %d per slot are supported (%d takes the slot's text as well).
+    // Returns false for any other conversion, then the pattern has to be used with printf.
+    bool Compile(const char* pattern);
+
+    // Parses a text with named placeholders $(name), names[i] being the name of slot i (at most DSCSLOTCOUNT).
+    // Everything else (including unknown placeholders) is literal.
+    bool CompilePlaceholders(const char* text, const char* const names[], int nameCount);
+
+    bool IsCompiled() const { return m_bCompiled; }
+
+    // Returns a copy with slot replaced by the literal value (adjacent literals are merged)
+    CUlpDSCTemplate Bind(int slot, const char* value, size_t valueLength) const;
+
+    // Writes the command and a terminating null to buffer, values[i]/lengths[i] are the text of slot i
+    // (ignored for bound slots). Returns the length written (without the null), 0 if not compiled or buffer is too small.
+    size_t Emit(char* buffer, size_t bufferSize, const char* const values[DSCSLOTCOUNT], const size_t lengths[DSCSLOTCOUNT]) const;
+
+    // Literal text before the first slot (e.g. "%UCSLogoPrint "), empty if not compiled or the pattern starts with a slot
+    std::string LiteralPrefix() const;
+
+    // Length Emit would write (without the terminating null)
+    size_t EmitLength(const char* const values[DSCSLOTCOUNT], const size_t lengths[DSCSLOTCOUNT]) const;
+
+    // Writes value as decimal and a terminating null to buffer (printf "%ld" without the parsing),
+    // returns the number of digits (and sign) written, 0 if buffer is too small
+    static size_t FormatDecimal(char* buffer, size_t bufferSize, long value);
+
+};
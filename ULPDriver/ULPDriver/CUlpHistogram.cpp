@@ -0,0 +1,68 @@
+#include <Windows.h>
+#include <bit>
+#include "CUlpHistogram.h"
+
+
+
+    CUlpHistogram::CUlpHistogram()
+    {
+        ZeroMemory(m_Buckets, sizeof(m_Buckets));
+        m_Count = 0;
+        m_Min = 0;
+        m_Max = 0;
+        m_Total = 0;
+    }
+
+    int CUlpHistogram::GetBucketIndex(unsigned __int64 value)
+    {
+        if (value < HISTOGRAMSUBBUCKETS) return (int)value;
+
+        int msb = (int)std::bit_width(value) - 1;
+        if (msb >= HISTOGRAMMAXBITS) return HISTOGRAMBUCKETCOUNT - 1;
+
+        int shift = msb - HISTOGRAMSUBBITS;
+        int subBucket = (int)((value >> shift) & (HISTOGRAMSUBBUCKETS - 1));
+        return (shift + 1) * HISTOGRAMSUBBUCKETS + subBucket;
+    }
+
+    unsigned __int64 CUlpHistogram::GetBucketUpperBound(int index)
+    {
+        if (index < HISTOGRAMSUBBUCKETS) return (unsigned __int64)index;
+
+        int shift = index / HISTOGRAMSUBBUCKETS - 1;
+        unsigned __int64 subBucket = (unsigned __int64)(index % HISTOGRAMSUBBUCKETS);
+        unsigned __int64 lowerBound = (HISTOGRAMSUBBUCKETS + subBucket) << shift;
+        return lowerBound + (1ULL << shift) - 1;
+    }
+
+    void CUlpHistogram::Record(unsigned __int64 value)
+    {
+        m_Buckets[GetBucketIndex(value)]++;
+        if (m_Count == 0 || value < m_Min) m_Min = value;
+        if (value > m_Max) m_Max = value;
+        m_Count++;
+        m_Total += value;
+    }
+
+    unsigned __int64 CUlpHistogram::GetPercentile(double percent)
+    {
+        if (m_Count == 0) return 0;
+
+        unsigned __int64 rank = (unsigned __int64)(percent / 100.0 * (double)m_Count + 0.5);
+        if (rank < 1) rank = 1;
+        if (rank > m_Count) rank = m_Count;
+
+        unsigned __int64 seen = 0;
+        for (int i = 0; i < HISTOGRAMBUCKETCOUNT; i++)
+        {
+            seen += m_Buckets[i];
+            if (seen >= rank)
+            {
+                unsigned __int64 value = GetBucketUpperBound(i);
+                if (value < m_Min) value = m_Min;
+                if (value > m_Max) value = m_Max;
+                return value;
+            }
+        }
+        return m_Max;
+    }
@@ -0,0 +1,49 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpHistogram.h
+//
+//  PURPOSE:   Header for a compact log-linear latency histogram
+//
+
+#pragma once
+#include <windows.h>
+
+
+// Values below 2^HISTOGRAMSUBBITS are counted exactly, larger values in HISTOGRAMSUBBUCKETS buckets
+// per power of two (relative error below 1/HISTOGRAMSUBBUCKETS)
+const int HISTOGRAMSUBBITS = 3;
+const int HISTOGRAMSUBBUCKETS = 1 << HISTOGRAMSUBBITS;
+const int HISTOGRAMMAXBITS = 40;    // values (in microseconds) up to about 12 days
+const int HISTOGRAMBUCKETCOUNT = (HISTOGRAMMAXBITS - HISTOGRAMSUBBITS + 1) * HISTOGRAMSUBBUCKETS;
+
+
+class CUlpHistogram
+{
+
+private:
+    DWORD m_Buckets[HISTOGRAMBUCKETCOUNT];
+    unsigned __int64 m_Count;
+    unsigned __int64 m_Min;
+    unsigned __int64 m_Max;
+    unsigned __int64 m_Total;
+
+    static int GetBucketIndex(unsigned __int64 value);
+
+    // Highest value counted in bucket index
+    static unsigned __int64 GetBucketUpperBound(int index);
+
+public:
+
+    CUlpHistogram();
+
+    void Record(unsigned __int64 value);
+
+    // Value below or at which percent of the recorded values are (clamped to the recorded min/max)
+    unsigned __int64 GetPercentile(double percent);
+
+    unsigned __int64 Count() { return m_Count; }
+    unsigned __int64 Min() { return m_Count > 0 ? m_Min : 0; }
+    unsigned __int64 Max() { return m_Max; }
+    unsigned __int64 Total() { return m_Total; }
+
+};
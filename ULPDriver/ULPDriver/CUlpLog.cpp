@@ -2,10 +2,132 @@
 #include <Windows.h>
 #include <ctime>
 #include <cstdarg>
+#include <set>
+#include <sstream>
 #include "CUlpLog.h"
 #include "ulpHelper.h"
 
 
+namespace
+{
+    // Ids of all CUlpLog-instances alive in this process
+    std::mutex g_LiveLogIdsMutex;
+    std::set<unsigned long long> g_LiveLogIds;
+    unsigned long long g_NextLogId = 1;
+}
+
+thread_local std::vector<std::unique_ptr<CUlpLog::ThreadContext>> CUlpLog::t_ThreadContexts;
+
+
+    unsigned long long CUlpLog::RegisterLogId()
+    {
+        std::lock_guard<std::mutex> lock(g_LiveLogIdsMutex);
+        unsigned long long logId = g_NextLogId++;
+        g_LiveLogIds.insert(logId);
+        return logId;
+    }
+
+    void CUlpLog::UnregisterLogId(unsigned long long logId)
+    {
+        std::lock_guard<std::mutex> lock(g_LiveLogIdsMutex);
+        g_LiveLogIds.erase(logId);
+    }
+
+    namespace
+    {
+        // Names used in registry values and the sampling summary, index is LogCategory
+        const TCHAR* SAMPLINGCATEGORYNAMES[LOGCATEGORYCOUNT] = { _T("WritePrinter"), _T("PipeWrite"), _T("Page") };
+        const char* SAMPLINGCATEGORYNAMESANSI[LOGCATEGORYCOUNT] = { "WritePrinter", "PipeWrite", "Page" };
+        const DWORD SAMPLINGFIRSTDEFAULT[LOGCATEGORYCOUNT] = { 10, 10, 20 };
+        const DWORD SAMPLINGEVERYDEFAULT[LOGCATEGORYCOUNT] = { 1000, 1000, 100 };
+    }
+
+    void CUlpLog::InitSampling()
+    {
+        for (int i = 0; i < LOGCATEGORYCOUNT; i++)
+        {
+            TCHAR valueName[100];
+            _stprintf_s(valueName, _countof(valueName), _T("LogSample%sFirst"), SAMPLINGCATEGORYNAMES[i]);
+            m_SamplingPolicy[i].first = m_Config->GetInt(HKEY_LOCAL_MACHINE, valueName, SAMPLINGFIRSTDEFAULT[i]);
+            _stprintf_s(valueName, _countof(valueName), _T("LogSample%sEvery"), SAMPLINGCATEGORYNAMES[i]);
+            m_SamplingPolicy[i].every = m_Config->GetInt(HKEY_LOCAL_MACHINE, valueName, SAMPLINGEVERYDEFAULT[i]);
+            m_SampledCount[i] = 0;
+            m_SampledLogged[i] = 0;
+        }
+    }
+
+    bool CUlpLog::IsSampled(LogCategory category)
+    {
+        if (!m_bLogInitialized || category < 0 || category >= LOGCATEGORYCOUNT) return false;
+
+        const SamplingPolicy& policy = m_SamplingPolicy[category];
+        unsigned __int64 count = ++m_SampledCount[category];
+        if (!m_bSampling || count <= policy.first)
+        {
+            m_SampledLogged[category]++;
+            return true;
+        }
+        if (policy.every == 0 || (count - policy.first) % policy.every != 0)
+        {
+            return false;
+        }
+
+        // The messages since the last logged one have been suppressed
+        unsigned __int64 suppressed = (unsigned __int64)policy.every - 1;
+        m_SampledLogged[category]++;
+        if (suppressed > 0)
+        {
+            char text[150];
+            sprintf_s(text, sizeof(text), "... %llu '%s' messages suppressed (logging every %lu. message after the first %lu)",
+                      suppressed, SAMPLINGCATEGORYNAMESANSI[category], policy.every, policy.first);
+            LogLine(text);
+        }
+        return true;
+    }
+
+    void CUlpLog::LogSamplingSummary()
+    {
+        for (int i = 0; i < LOGCATEGORYCOUNT; i++)
+        {
+            unsigned __int64 count = m_SampledCount[i];
+            if (count == 0) continue;
+            char text[150];
+            sprintf_s(text, sizeof(text), "Sampled '%s' messages: %llu counted, %llu logged, %llu suppressed",
+                      SAMPLINGCATEGORYNAMESANSI[i], count, (unsigned __int64)m_SampledLogged[i], count - m_SampledLogged[i]);
+            LogLine(text);
+        }
+    }
+
+    CUlpLog::ThreadContext* CUlpLog::GetThreadContext()
+    {
+        for (auto& context : t_ThreadContexts)
+        {
+            if (context->logId == m_LogId) return context.get();
+        }
+
+        // First use of this instance by the calling thread -> drop contexts of deleted instances and create a new one
+        {
+            std::lock_guard<std::mutex> lock(g_LiveLogIdsMutex);
+            std::erase_if(t_ThreadContexts, [](const std::unique_ptr<ThreadContext>& context) {
+                return g_LiveLogIds.find(context->logId) == g_LiveLogIds.end();
+            });
+        }
+
+        std::unique_ptr<ThreadContext> context = std::make_unique<ThreadContext>();
+        context->logId = m_LogId;
+        context->indentLevel = 0;
+        SetThreadTag(context.get());
+        ZeroMemory(context->indent, sizeof(context->indent));
+        context->indent[0] = context->tag[0];
+        context->indent[1] = context->tag[1];
+        context->indent[2] = ' ';
+        context->indent[3] = ' ';
+        context->sections.reserve(MAXSECTIONS);
+        t_ThreadContexts.push_back(std::move(context));
+        return t_ThreadContexts.back().get();
+    }
+
+
 
     void CUlpLog::LogCurrentTime()
     {
@@ -74,7 +196,6 @@
         // EnterCriticalSection(&m_CS_Log);//
         try 
         {
-            SetIndentPrefix(0);
             WriteToStream(text, true, true, false);
         } catch (...) {}
         ul.unlock();
@@ -86,7 +207,6 @@
         std::unique_lock<std::mutex> ul(mutex_);
         try 
         {
-            SetIndentPrefix(0);
             WriteToStream(text, false, true, false);
         } catch (...) {}
         ul.unlock();
@@ -98,7 +218,6 @@
         std::unique_lock<std::mutex> ul(mutex_);
         try 
         {
-            SetIndentPrefix(0);
             WriteToStream(text, true, true, true);
         } catch (...) {}
         ul.unlock();
@@ -110,7 +229,6 @@
         std::unique_lock<std::mutex> ul(mutex_);
         try 
         {
-            SetIndentPrefix(0);
             WriteToStream(text, true, "!!! ", NULL, false, false);
             m_Log << ": ";
             WriteToStream((char *)e.what(), true, "! ! ", NULL, true, true);
@@ -195,6 +313,11 @@
     }
 
     int CUlpLog::EnterSection(const char* text)
+    {
+        return EnterSection(text, true);
+    }
+
+    int CUlpLog::EnterSection(const char* text, bool bLogText)
     {
         int iLevel = GetIndentLevel();
         if (!m_bLogInitialized) return iLevel;
@@ -203,13 +326,18 @@
         {
             char* indent = GetIndent();
             if (text == NULL || strnlen_s(text, 100) > 90) text = "???";
-            m_Log << indent << "Enter Section '" << text << "' (";
-            LogCurrentTime();
-            m_Log << ")\n";
-            m_Log.flush();
+            if (bLogText)
+            {
+                m_Log << indent << "Enter Section '" << text << "' (";
+                LogCurrentTime();
+                m_Log << ")\n";
+                m_Log.flush();
+            }
             SectionData* sd = GetSectionData(iLevel);
             sd->startTime = clock();
+            sd->startUs = CUlpTrace::NowMicroseconds();
             sd->text = text;
+            sd->bLogText = bLogText;
             SetIndentLevel(iLevel + 1);
             MakeIndent();
         } catch (...) {}
@@ -230,24 +358,41 @@
             SectionData* sd = GetSectionData(iLevel);
             if (sd != NULL && sd->text != NULL)
             {
-                m_Log << indent << "Exit Section '" << sd->text << "' (";
+                if (sd->bLogText)
+                {
+                    m_Log << indent << "Exit Section '" << sd->text << "' (";
+
+                    double CLOCKS_PER_mSEC = (CLOCKS_PER_SEC / 1000);
+                    if (sd->startTime != 0)
+                    {
+                        int ticks = (int)((clock() - sd->startTime) / CLOCKS_PER_mSEC);
+                        m_Log << ticks << "ms)\n";
+                    }
+                    else 
+                    {
+                        m_Log << "???)\n";
+                    }
+                    m_Log.flush();
+                }
 
-                double CLOCKS_PER_mSEC = (CLOCKS_PER_SEC / 1000);
-                if (sd->startTime != 0)
+                long long durationUs = CUlpTrace::NowMicroseconds() - sd->startUs;
+                auto histogram = m_SectionHistograms.find(std::string_view(sd->text));
+                if (histogram == m_SectionHistograms.end())
                 {
-                    int ticks = (int)((clock() - sd->startTime) / CLOCKS_PER_mSEC);
-                    m_Log << ticks << "ms)\n";
+                    histogram = m_SectionHistograms.emplace(sd->text, CUlpHistogram()).first;
                 }
-                else 
+                histogram->second.Record(durationUs > 0 ? (unsigned __int64)durationUs : 0);
+
+                if (m_Trace != NULL)
                 {
-                    m_Log << "???)\n";
+                    m_Trace->Complete(sd->text, "section", sd->startUs, durationUs, -1);
                 }
             }
             else
             {
                 m_Log << indent << "Exit Section '???'\n";
+                m_Log.flush();
             }
-            m_Log.flush();
         } catch (...) {}
         ul.unlock();
     }
@@ -294,13 +439,91 @@
         ul.unlock();
     }
 
-    //Currently not used, but may be useful in future
-    //void LogRegisterMessageloopThread()
-    //{
-    //    m_MsgloopThreadId = GetCurrentThreadId();
-    //}
+    void CUlpLog::LogLatencySummary(const char* csvFileName, const char* jobId)
+    {
+        if (!m_bLogInitialized) return;
+        std::unique_lock<std::mutex> ul(mutex_);
+        try
+        {
+            char* indent = GetIndent();
+            char line[300];
+            m_Log << indent << "Latency summary (microseconds):\n";
+            sprintf_s(line, sizeof(line), "%s  %-40s %8s %10s %10s %10s %10s %10s %12s\n", indent,
+                      "Section", "Count", "Min", "P50", "P90", "P99", "Max", "Total");
+            m_Log << line;
+
+            std::ostringstream csv;
+            for (auto& entry : m_SectionHistograms)
+            {
+                CUlpHistogram& h = entry.second;
+                unsigned __int64 p50 = h.GetPercentile(50.0);
+                unsigned __int64 p90 = h.GetPercentile(90.0);
+                unsigned __int64 p99 = h.GetPercentile(99.0);
+
+                sprintf_s(line, sizeof(line), "%s  %-40.40s %8llu %10llu %10llu %10llu %10llu %10llu %12llu\n", indent,
+                          entry.first.c_str(), h.Count(), h.Min(), p50, p90, p99, h.Max(), h.Total());
+                m_Log << line;
+
+                csv << (jobId != NULL ? jobId : "") << ",\"" << entry.first << "\"," << h.Count() << "," << h.Min() << ","
+                    << p50 << "," << p90 << "," << p99 << "," << h.Max() << "," << h.Total() << "\n";
+            }
+            m_Log.flush();
+
+            if (csvFileName != NULL && csvFileName[0] != '\0')
+            {
+                // Jobs of the same process append one block at a time
+                static std::mutex csvMutex;
+                std::lock_guard<std::mutex> csvLock(csvMutex);
+
+                DWORD ftyp = GetFileAttributesA(csvFileName);
+                bool isNewFile = (ftyp == INVALID_FILE_ATTRIBUTES);
+                std::ofstream csvFile(csvFileName, std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+                if (csvFile.is_open())
+                {
+                    if (isNewFile)
+                    {
+                        csvFile << "JobId,Section,Count,MinUs,P50Us,P90Us,P99Us,MaxUs,TotalUs\n";
+                    }
+                    csvFile << csv.str();
+                    csvFile.close();
+                }
+                else
+                {
+                    m_Log << indent << "!!! Could not open latency csv file '" << csvFileName << "'\n";
+                }
+            }
+        }
+        catch (...) {}
+        ul.unlock();
+    }
+
+    void CUlpLog::DumpFlightRecorder(const char* reason)
+    {
+        if (!m_bLogInitialized || !m_LogRing) return;
+        std::unique_lock<std::mutex> ul(mutex_);
+        try
+        {
+            // Checked again: another thread may have dumped meanwhile
+            if (m_LogRing)
+            {
+                m_Log.flush();
+                m_LogFile = std::make_unique<CUlpLogFileBuf>(m_LogFileName, m_MaxFileBytes, m_PreallocateBytes);
+
+                m_Log.rdbuf(m_LogFile.get());
+                m_Log << "!!! Flight recorder dumped: " << (reason != NULL ? reason : "???") << " (";
+                LogCurrentTime();
+                m_Log << ")\n";
+                if (m_LogRing->HasWrapped())
+                {
+                    m_Log << "!!! ... older records have been dropped from the ring (see LogRingKB)\n";
+                }
+                m_LogRing->WriteTo(m_LogFile.get());
+                m_LogRing.reset();
 
-    //void LogRegisterConnectThread()
-    //{
-    //    m_ConnectThreadId = GetCurrentThreadId();
-    //}
+                m_Log << "!!! End of flight recorder, logging continues directly to the file\n";
+                m_Log.flush();
+            }
+        }
+        catch (...) {}
+        ul.unlock();
+    }
@@ -14,10 +14,18 @@
 #include <mutex>
 #include <thread>
 #include <format>
-#include <memory>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <string>
 
 #include "ulpHelper.h"
 #include "ulpCharBuffer.h"
+#include "CUlpTrace.h"
+#include "CUlpHistogram.h"
+#include "CUlpLogFile.h"
+#include "CUlpLogEngine.h"
+#include "CUlpConfig.h"
 
 using namespace std::literals;
 
@@ -39,9 +47,26 @@ using namespace std::literals;
 #define LPLOGADOBEERROR(text, error) ulplog::LogAdobeError(text, error);
 
 
-const int MAXTHREADCOUNT = 3;
 const int MAXSECTIONS = 20;
 const int INDENTSPACES = 4;
+const int THREADTAGSIZE = 2;
+
+// Categories of repetitive hot-path messages which are logged sampled (see CUlpLog::IsSampled)
+enum LogCategory
+{
+    LOGCAT_WRITEPRINTER = 0,    // per buffer received by WritePrinter
+    LOGCAT_PIPEWRITE,           // per write to the spooler pipe
+    LOGCAT_PAGE,                // per page (sections and marks of page level injection points)
+    LOGCATEGORYCOUNT
+};
+
+// Settings of a log which can be tuned per printer (see OEMDEV) on top of the config
+typedef struct LogSettings
+{
+    DWORD mode;         // LOGMODE_*
+    DWORD ringKB;       // size of the flight-recorder ring
+    bool bSampling;     // false: hot-path messages are not sampled but all logged
+} LogSettings;
 
 class CUlpLog
 {
@@ -55,18 +80,73 @@ private:
     typedef struct SectionData
     {
         clock_t startTime;
+        long long startUs;
         const char* text;
+        bool bLogText;
     } SectionData;
 
-    SectionData sections[MAXTHREADCOUNT + 1][MAXSECTIONS * INDENTSPACES + 11];
-    int indentLevel[MAXTHREADCOUNT + 1] = { 0, 0, 0, 0 };
-    char m_Indent[MAXTHREADCOUNT + 1][1000];
+    // Logging state of one thread: indent level, open sections and the thread tag prepended to the indent.
+    // Held in thread_local storage and created lazily when a thread logs to this instance for the first time.
+    typedef struct ThreadContext
+    {
+        unsigned long long logId;
+        int indentLevel;
+        char tag[THREADTAGSIZE];
+        char indent[THREADTAGSIZE + 2 + MAXSECTIONS * INDENTSPACES + 1];
+        std::vector<SectionData> sections;
+    } ThreadContext;
+
+    // Contexts of the calling thread, one per CUlpLog-instance the thread has logged to
+    static thread_local std::vector<std::unique_ptr<ThreadContext>> t_ThreadContexts;
+
+    // Returns the calling thread's context for this instance (creates it on first use)
+    ThreadContext* GetThreadContext();
+
+    // Process-wide unique id of this instance (used to find the thread's context)
+    unsigned long long m_LogId;
+
+    // Number of threads other than the main thread which have logged so far (used for thread tags)
+    std::atomic<int> m_OtherThreadCount;
+
+    // Size-capped file the log is written to and the stream writing into it
+    std::unique_ptr<CUlpLogFileBuf> m_LogFile;  // To be freed
+    std::ostream m_Log{ nullptr };
+
+    // Flight recorder (LogMode LOGMODE_FLIGHTRECORDER): the log is kept in this ring until a failure is reported
+    // by DumpFlightRecorder, only then m_LogFile is created with the name and sizes kept here
+    std::unique_ptr<CUlpLogRingBuf> m_LogRing;  // To be freed
+    TCHAR m_LogFileName[MAX_PATH + 1];
+    unsigned __int64 m_MaxFileBytes;
+    unsigned __int64 m_PreallocateBytes;
+
+    // Shared log (LogMode LOGMODE_SHARED): the job's lines are tagged and written by the process-wide engine
+    std::unique_ptr<CUlpLogEngineBuf> m_LogShared;  // To be freed
+
+    // Optional trace sink sections are written to (not owned)
+    CUlpTrace* m_Trace;
+
+    // Latency histograms (in microseconds) per section name, accumulated in ExitSection
+    std::map<std::string, CUlpHistogram, std::less<>> m_SectionHistograms;
 
-    std::ofstream m_Log;  // To be freed
+    // Sampling of a message category: the first 'first' messages are logged, then every 'every'-th (0 = none)
+    typedef struct SamplingPolicy
+    {
+        DWORD first;
+        DWORD every;
+    } SamplingPolicy;
+
+    bool m_bSampling;
+    SamplingPolicy m_SamplingPolicy[LOGCATEGORYCOUNT];
+    std::atomic<unsigned __int64> m_SampledCount[LOGCATEGORYCOUNT];
+    std::atomic<unsigned __int64> m_SampledLogged[LOGCATEGORYCOUNT];
+
+    // Reads the sampling policies (HKLM-LogoPrint2-Keys LogSample<Category>First and LogSample<Category>Every)
+    void InitSampling();
+
+    // Settings snapshot of the job
+    std::shared_ptr<const CUlpConfig> m_Config;
 
     DWORD m_MainThreadId;
-    DWORD m_MsgloopThreadId;    //Currently not used
-    DWORD m_ConnectThreadId;    //Currently not used
 
 
 public:
@@ -74,8 +154,15 @@ public:
     char* INSERTTIME;
 
     int EnterSection(const char* text);
+    // Enters a section; if bLogText is false, the section is only measured (histogram, trace) but not written to the log
+    int EnterSection(const char* text, bool bLogText);
     void ExitSection(int level);
 
+    // Counts a message of category and returns whether it is to be logged according to the category's sampling policy.
+    // When a message is logged after others have been suppressed, the number of suppressed messages is logged first.
+    // Errors and state transitions must not be sampled.
+    bool IsSampled(LogCategory category);
+
     void LogLineParts(char* text, ...);
 
     void LogFlush();
@@ -92,32 +179,94 @@ public:
     void LogVarL(const char* name, signed __int64 value);
     void LogVarUL(const char* name, unsigned __int64 value);
 
-        CUlpLog(TCHAR* fileNamePart)
+    // Sets the trace sink sections are written to as complete events (NULL to stop tracing)
+    void SetTrace(CUlpTrace* trace) { m_Trace = trace; }
+
+    // Logs one summary block with the latency histograms of all sections exited so far
+    // and appends them to csvFileName (if not NULL or empty) tagged with jobId
+    void LogLatencySummary(const char* csvFileName, const char* jobId);
+
+    // Logs per sampled category how many messages have been counted and logged
+    void LogSamplingSummary();
+
+    // Log settings as configured in HKLM-LogoPrint2-Key (LogMode, LogRingKB)
+    static LogSettings GetConfigSettings(const CUlpConfig* config)
+    {
+        LogSettings settings;
+        settings.mode = config->GetInt(HKEY_LOCAL_MACHINE, _T("LogMode"), LOGMODE_FILE);
+        settings.ringKB = config->GetInt(HKEY_LOCAL_MACHINE, _T("LogRingKB"), LOGRINGKB_DEFAULT);
+        settings.bSampling = true;
+        return settings;
+    }
+
+    // True, if the log is still kept in memory only (flight recorder not dumped yet)
+    bool IsFlightRecorderPending() { return m_LogRing != nullptr; }
+
+    // Flight recorder: writes reason and the records kept in the ring to the log file and
+    // logs directly to the file from now on. Does nothing in LOGMODE_FILE, LOGMODE_SHARED or if already dumped.
+    void DumpFlightRecorder(const char* reason);
+
+        CUlpLog(TCHAR* fileNamePart, std::shared_ptr<const CUlpConfig> config, const LogSettings& settings)
         {
+            m_Config = config;
+            m_bSampling = settings.bSampling;
             m_MainThreadId = 0;
-            m_MsgloopThreadId = 0;    //Currently not used
-            m_ConnectThreadId = 0;    //Currently not used
+            m_LogId = RegisterLogId();
+            m_OtherThreadCount = 0;
+            m_Trace = NULL;
+            m_MaxFileBytes = 0;
+            m_PreallocateBytes = 0;
+            ZeroMemory(m_LogFileName, sizeof(m_LogFileName));
 
             try
             {
                 m_MainThreadId = GetCurrentThreadId();
+                InitSampling();
                 auto strTemp = "###TIME###";
                 INSERTTIME = new char[strlen(strTemp) + 1];
                 strcpy_s(INSERTTIME, strlen(strTemp) + 1, strTemp);
                 //INSERTTIME = "###TIME###";
                 InitializeCriticalSection(&m_CS_Log);
 
-                ZeroMemory(&sections, sizeof(sections));
+                TCHAR logFolder[MAX_PATH + 1];
+                ZeroMemory(logFolder, sizeof(logFolder));
 
-                ZeroMemory(m_Indent, sizeof(m_Indent));
-                for (int i = 0; i <= MAXTHREADCOUNT; i++) InitIndent(i);
+                GetTempFilename(m_LogFileName, _countof(m_LogFileName), logFolder, _countof(logFolder), fileNamePart, _T("txt"));
 
-                TCHAR logFileName[MAX_PATH + 1];
-                ZeroMemory(logFileName, sizeof(logFileName));
+                DWORD maxFileKB = m_Config->GetInt(HKEY_LOCAL_MACHINE, _T("LogFileMaxKB"), LOGFILEMAXKB_DEFAULT);
+                DWORD preallocateKB = m_Config->GetInt(HKEY_LOCAL_MACHINE, _T("LogFilePreallocateKB"), LOGFILEPREALLOCATEKB_DEFAULT);
+                m_MaxFileBytes = maxFileKB * 1024ULL;
+                m_PreallocateBytes = preallocateKB * 1024ULL;
 
-                GetTempFilename(logFileName, _countof(logFileName), fileNamePart, _T("txt"));
-                m_Log.open(logFileName, std::ios_base::out | std::ios_base::trunc);
-                m_Log.flush();
+                std::shared_ptr<CUlpLogEngine> logEngine;
+                if (settings.mode == LOGMODE_SHARED)
+                {
+                    logEngine = CUlpLogEngine::Get(m_Config.get(), logFolder, fileNamePart);
+                }
+
+                if (settings.mode == LOGMODE_FLIGHTRECORDER)
+                {
+                    m_LogRing = std::make_unique<CUlpLogRingBuf>(settings.ringKB * 1024ULL);
+                    m_Log.rdbuf(m_LogRing.get());
+                }
+                else if (logEngine)
+                {
+                    m_LogShared = std::make_unique<CUlpLogEngineBuf>(logEngine, m_LogId);
+                    m_Log.rdbuf(m_LogShared.get());
+                }
+                else
+                {
+                    // Also if the shared engine could not be started
+                    m_LogFile = std::make_unique<CUlpLogFileBuf>(m_LogFileName, m_MaxFileBytes, m_PreallocateBytes);
+                    m_Log.rdbuf(m_LogFile.get());
+                }
+
+                // Keep the log folder within its byte budget and drop old logs (in the background)
+                TCHAR prunePattern[MAX_PATH + 1];
+                _stprintf_s(prunePattern, _countof(prunePattern), _T("%s*"), fileNamePart);
+                DWORD maxFolderMB = m_Config->GetInt(HKEY_LOCAL_MACHINE, _T("LogFolderMaxMB"), LOGFOLDERMAXMB_DEFAULT);
+                DWORD maxAgeDays = m_Config->GetInt(HKEY_LOCAL_MACHINE, _T("LogMaxAgeDays"), LOGMAXAGEDAYS_DEFAULT);
+                CUlpLogFileBuf::PruneFolderAsync(logFolder, prunePattern, maxFolderMB * 1024ULL * 1024ULL, maxAgeDays);
 
                 m_bLogInitialized = true;
             }
@@ -130,176 +279,141 @@ public:
             {
                 m_bLogInitialized = false;
                 m_Log.flush();
-                m_Log.close();
+                m_Log.rdbuf(nullptr);
+                if (m_LogFile) m_LogFile->Close();
+                // The engine outlives the job, its writer closes (and splits) the file when idle
+                if (m_LogShared) m_LogShared->Close();
+                m_LogShared.reset();
+                // A flight recorder which has not been dumped is dropped with the job
+                m_LogRing.reset();
             }
             catch (...) {}
             DeleteCriticalSection(&m_CS_Log);
+            UnregisterLogId(m_LogId);
         }
 
+        // Hands out a process-wide unique id for a new instance and marks it as alive
+        static unsigned long long RegisterLogId();
 
-        void GetTempFilename(TCHAR buffer[], int bufferLength, const TCHAR* filenamepart, const TCHAR* extension)
+        // Marks the id of a deleted instance as dead, so that threads can drop their contexts for it
+        static void UnregisterLogId(unsigned long long logId);
+
+
+        // Builds a unique log file name in the log folder (LogFolder in HKCU or HKLM, else the temp folder)
+        // and returns the folder in folder
+        void GetTempFilename(TCHAR buffer[], int bufferLength, TCHAR folder[], int folderLength, const TCHAR* filenamepart, const TCHAR* extension)
         {
-            char /* TCHAR */ tempFolder[MAX_PATH + 1];
-            char* /* TCHAR* */ logFolder = NULL;
-        
-            std::unique_ptr<ulpHelper::CharBuffer> cblogFolder = std::make_unique<ulpHelper::CharBuffer>( GetLogFolder(HKEY_CURRENT_USER));
-            //ulpHelper::CharBuffer* cblogFolder = GetLogFolder(HKEY_CURRENT_USER);
-            if (cblogFolder == NULL)
+            const TCHAR* logFolder = GetLogFolder(HKEY_CURRENT_USER);
+            if (logFolder == NULL)
             {
-                cblogFolder = std::make_unique<ulpHelper::CharBuffer>(GetLogFolder(HKEY_LOCAL_MACHINE));
+                logFolder = GetLogFolder(HKEY_LOCAL_MACHINE);
             }
-        
-            if (cblogFolder != NULL)
+
+            if (logFolder != NULL)
             {
-                logFolder = (char*) cblogFolder->Buffer();
+                _tcsncpy_s(folder, folderLength, logFolder, _TRUNCATE);
             }
-        
-        
-            if (logFolder == NULL && GetTempPath(_countof(tempFolder), LPWSTR(tempFolder)) != 0)
+            else if (GetTempPath(folderLength, folder) == 0)
             {
-                logFolder = tempFolder;
+                _tcscpy_s(folder, folderLength, _T("C:\\Temp"));
             }
-        
-            if (logFolder == NULL)
+
+            // GetTempPath returns the folder with a trailing backslash
+            size_t folderNameLength = _tcsnlen(folder, folderLength);
+            if (folderNameLength > 0 && folder[folderNameLength - 1] == _T('\\'))
             {
-                auto strTemp = "C:\\Temp";
-                logFolder = new char[strlen(strTemp) + 1];
-                strcpy_s(logFolder, strlen(strTemp) + 1, strTemp);
-                //logFolder = _T("C:\\Temp");
+                folder[folderNameLength - 1] = _T('\0');
             }
-        
+
             _SYSTEMTIME systemTime;
             GetLocalTime(&systemTime);
-            auto th_id = std::this_thread::get_id();
+            DWORD threadId = GetCurrentThreadId();
             auto randomNumber = rand();
-/*
-            std::string str = std::format("{:p}\\{:p}({})_{:04}{:02}{:02}_{:02}{:02}{:02}_{:03}{}.{:p}", 
-                        logFolder, filenamepart, th_id, 
-                        systemTime.wYear, systemTime.wMonth, systemTime.wDay,
-                        systemTime.wHour, systemTime.wMinute, systemTime.wSecond, systemTime.wMilliseconds,
-                        randomNumber, extension);
 
-            std::copy(str.begin(), str.end(), buffer);
-*/
-            _stprintf_s(buffer, bufferLength, _T("%s\\%s(%d)_%04d%02d%02d_%02d%02d%02d_%03d%d.%s"), logFolder, 
-                        filenamepart, th_id,
+            _stprintf_s(buffer, bufferLength, _T("%s\\%s(%lu)_%04d%02d%02d_%02d%02d%02d_%03d%d.%s"), folder,
+                        filenamepart, threadId,
                         systemTime.wYear, systemTime.wMonth, systemTime.wDay, 
                         systemTime.wHour, systemTime.wMinute, systemTime.wSecond, systemTime.wMilliseconds,
                         randomNumber, extension);
-           
-            //if (cblogFolder != NULL)
-            //{
-            //    cblogFolder->free();
-            //}
         }
 
-        ulpHelper::CharBuffer* GetLogFolder(HKEY hKey)
+        // Returns the log folder configured in hKey, if it is an existing directory (else NULL)
+        const TCHAR* GetLogFolder(HKEY hKey)
         {
-            ulpHelper::CharBuffer* result = NULL;
-            ulpHelper::CharBuffer* logFolderReg = ulpHelper::ReadLogoPrintRegStr(hKey, ulpHelper::REGVALUE_LogFolder);
-            if (logFolderReg != NULL && logFolderReg->Buffer() != NULL)
+            const TCHAR* logFolder = m_Config->LogFolder(hKey);
+            if (logFolder != NULL)
             {
-                DWORD ftyp = GetFileAttributes(logFolderReg->Buffer());
+                DWORD ftyp = GetFileAttributes(logFolder);
                 bool isDirectory = (ftyp != INVALID_FILE_ATTRIBUTES) && ((ftyp & FILE_ATTRIBUTE_DIRECTORY) != 0);
                 if (isDirectory)
                 {
-                    result = logFolderReg;
+                    return logFolder;
                 }
             }
-            if (result == NULL && logFolderReg != NULL)
-            {
-                logFolderReg->free();
-            }
-            return result;
+            return NULL;
         }
 
 
 
-        void InitIndent(int i)
-        {
-            m_Indent[i][0] = ' ';
-            m_Indent[i][1] = ' ';
-            m_Indent[i][2] = ' ';
-            m_Indent[i][3] = ' ';
-            m_Indent[i][4] = '\0';
-        }
-
         void MakeIndent()
         {
             int i;
-            char* indent = GetIndent();
-            int iLevel = GetIndentLevel();
+            ThreadContext* context = GetThreadContext();
+            char* indent = context->indent;
+            int iLevel = context->indentLevel;
             int level = (iLevel < MAXSECTIONS ? iLevel : MAXSECTIONS);
-            int length = level * INDENTSPACES + 4;
-            for (i = 4; i < length; i++) indent[i] = ' ';
+            int length = level * INDENTSPACES + THREADTAGSIZE + 2;
+            for (i = THREADTAGSIZE + 2; i < length; i++) indent[i] = ' ';
             indent[i] = '\0';
         }
 
-        int GetThreadIndex()
+        // Fills the thread tag of a new context: blank for the thread which created the log,
+        // 'T1', 'T2', ... for all other threads in the order they log for the first time
+        void SetThreadTag(ThreadContext* context)
         {
-            int index = 0;
-            DWORD pid = GetCurrentThreadId();
-            if (pid == m_MainThreadId)
-            {
-                index = 1;
-            }
-            else if (pid == m_MsgloopThreadId)
+            char* tag = context->tag;
+            if (GetCurrentThreadId() == m_MainThreadId)
             {
-                index = 2;
+                tag[0] = ' ';
+                tag[1] = ' ';
             }
-            else if (pid == m_ConnectThreadId)
+            else
             {
-                index = 3;
+                int ordinal = ++m_OtherThreadCount;
+                tag[0] = 'T';
+                tag[1] = ordinal < 10 ? (char)('0' + ordinal) : (ordinal < 36 ? (char)('A' + ordinal - 10) : '?');
             }
-            return index;
         }
 
         char* GetIndent()
         {
-            int index = GetThreadIndex();
-            SetIndentPrefix(index);
-            return m_Indent[index];
+            ThreadContext* context = GetThreadContext();
+            // Restore the thread tag (LogErrorWarning overwrites it temporarily)
+            context->indent[0] = context->tag[0];
+            context->indent[1] = context->tag[1];
+            return context->indent;
         }
 
         SectionData* GetSectionData(int i)
         {
-            return &sections[GetThreadIndex()][i];
+            std::vector<SectionData>& sections = GetThreadContext()->sections;
+            if (i < 0) i = 0;
+            if ((size_t)i >= sections.size())
+            {
+                sections.resize((size_t)i + 1, SectionData{ 0, 0, NULL, true });
+            }
+            return &sections[i];
         }
 
 
         int GetIndentLevel()
         {
-            return indentLevel[GetThreadIndex()];
+            return GetThreadContext()->indentLevel;
         }
 
         void SetIndentLevel(int level)
         {
-            indentLevel[GetThreadIndex()] = level;
-        }
-
-        void SetIndentPrefix(int index)
-        {
-            index = index > 0 ? index : GetThreadIndex();
-            char* indent = m_Indent[index];
-            switch (index)
-            {
-            case 0: // unknown ThreadId
-                indent[0] = '?';
-                indent[1] = '?';
-                break;
-            case 1: // plugin thread
-                indent[0] = ' ';
-                indent[1] = ' ';
-                break;
-            case 2: // message thread
-                indent[0] = 'm';
-                indent[1] = 'T';
-                break;
-            case 3: // connect thread
-                indent[0] = 'c';
-                indent[1] = 'T';
-                break;
-            }
+            GetThreadContext()->indentLevel = level;
         }
 
         void WriteToStream(const char* cptr, bool prependIndent, const char* prefixPos0, const char* prefix)
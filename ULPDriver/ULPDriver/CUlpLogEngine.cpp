@@ -0,0 +1,354 @@
+#include <Windows.h>
+#include <tchar.h>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include "CUlpLogEngine.h"
+
+
+namespace
+{
+    typedef std::basic_string<TCHAR> tstring;
+
+    // Engine of the process while its writer runs (removed by the writer when it stops, never joined)
+    std::mutex g_LogEngineMutex;
+    std::shared_ptr<CUlpLogEngine> g_LogEngine;
+
+    const size_t LOGSPLITBUFFERSIZE = 64 * 1024;
+
+    bool WriteAll(HANDLE file, const char* data, size_t count)
+    {
+        while (count > 0)
+        {
+            DWORD bytesWritten = 0;
+            if (!WriteFile(file, data, (DWORD)min(count, (size_t)LOGSPLITBUFFERSIZE), &bytesWritten, NULL) || bytesWritten == 0)
+            {
+                return false;
+            }
+            data += bytesWritten;
+            count -= bytesWritten;
+        }
+        return true;
+    }
+}
+
+
+    CUlpLogEngine::CUlpLogEngine(const TCHAR* fileName, unsigned __int64 maxFileBytes, unsigned __int64 preallocateBytes, bool bSplitPerJob)
+    {
+        m_Users = 0;
+        m_LastUseTicks = GetTickCount64();
+        m_bStopped = false;
+        m_bSplitPerJob = bSplitPerJob;
+        ZeroMemory(m_FileName, sizeof(m_FileName));
+        _tcsncpy_s(m_FileName, _countof(m_FileName), fileName, _TRUNCATE);
+
+        m_LogFile = std::make_unique<CUlpLogFileBuf>(m_FileName, maxFileBytes, preallocateBytes);
+        m_Queued.reserve(LOGFILEBUFFERSIZE * 8);
+    }
+
+    std::shared_ptr<CUlpLogEngine> CUlpLogEngine::Get(const CUlpConfig* config, const TCHAR* folder, const TCHAR* fileNamePart)
+    {
+        std::lock_guard<std::mutex> lock(g_LogEngineMutex);
+        std::shared_ptr<CUlpLogEngine> engine = g_LogEngine;
+        if (!engine)
+        {
+            // One file per process and start of the engine
+            _SYSTEMTIME systemTime;
+            GetLocalTime(&systemTime);
+            TCHAR fileName[MAX_PATH + 1];
+            _stprintf_s(fileName, _countof(fileName), _T("%s\\%s(%lu)_%04d%02d%02d_%02d%02d%02d_%03d.txt"), folder,
+                        fileNamePart, GetCurrentProcessId(),
+                        systemTime.wYear, systemTime.wMonth, systemTime.wDay,
+                        systemTime.wHour, systemTime.wMinute, systemTime.wSecond, systemTime.wMilliseconds);
+
+            DWORD maxFileKB = config->GetInt(HKEY_LOCAL_MACHINE, _T("LogFileMaxKB"), LOGFILEMAXKB_DEFAULT);
+            DWORD preallocateKB = config->GetInt(HKEY_LOCAL_MACHINE, _T("LogFilePreallocateKB"), LOGFILEPREALLOCATEKB_DEFAULT);
+            bool bSplitPerJob = config->GetInt(HKEY_LOCAL_MACHINE, _T("LogSplitPerJob"), 0) != 0;
+
+            engine = std::make_shared<CUlpLogEngine>(fileName, maxFileKB * 1024ULL, preallocateKB * 1024ULL, bSplitPerJob);
+
+            HMODULE module = NULL;
+            if (!GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCTSTR)&CUlpLogEngine::WriterThread, &module))
+            {
+                return NULL;
+            }
+            std::shared_ptr<CUlpLogEngine>* threadEngine = new std::shared_ptr<CUlpLogEngine>(engine);
+            HANDLE thread = CreateThread(NULL, 0, &CUlpLogEngine::WriterThread, threadEngine, 0, NULL);
+            if (thread == NULL)
+            {
+                delete threadEngine;
+                FreeLibrary(module);
+                return NULL;
+            }
+            CloseHandle(thread);
+            g_LogEngine = engine;
+        }
+
+        std::lock_guard<std::mutex> engineLock(engine->m_Mutex);
+        engine->m_Users++;
+        engine->m_LastUseTicks = GetTickCount64();
+        return engine;
+    }
+
+    void CUlpLogEngine::Release()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_Users > 0) m_Users--;
+        m_LastUseTicks = GetTickCount64();
+    }
+
+    void CUlpLogEngine::Submit(const char* bytes, size_t count)
+    {
+        if (bytes == NULL || count == 0) return;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            // The disk is slower than the jobs: wait instead of growing
+            m_Changed.wait(lock, [this, count] { return m_bStopped || m_Queued.empty() || m_Queued.size() + count <= LOGENGINEQUEUEMAXBYTES; });
+            if (m_bStopped) return;
+            m_Queued.insert(m_Queued.end(), bytes, bytes + count);
+        }
+        m_Changed.notify_all();
+    }
+
+    DWORD WINAPI CUlpLogEngine::WriterThread(LPVOID threadEngine)
+    {
+        std::shared_ptr<CUlpLogEngine>* engine = (std::shared_ptr<CUlpLogEngine>*)threadEngine;
+        try
+        {
+            (*engine)->WriterLoop();
+        }
+        catch (...)
+        {
+            // Jobs must not wait for a writer which is gone
+            try
+            {
+                (*engine)->Stop(true);
+            }
+            catch (...) {}
+        }
+
+        // Usually the last reference: the engine is freed here and not on a job's thread
+        delete engine;
+
+        HMODULE module = NULL;
+        GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                          (LPCTSTR)&CUlpLogEngine::WriterThread, &module);
+        FreeLibraryAndExitThread(module, 0);
+        return 0;
+    }
+
+    void CUlpLogEngine::WriterLoop()
+    {
+        std::vector<char> writing;
+        writing.reserve(LOGFILEBUFFERSIZE * 8);
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                if (!m_Changed.wait_for(lock, std::chrono::seconds(LOGENGINEIDLESEC), [this] { return !m_Queued.empty(); }))
+                {
+                    lock.unlock();
+                    if (Stop(false)) break;
+                    continue;
+                }
+                writing.swap(m_Queued);
+            }
+            m_Changed.notify_all();
+
+            // Everything queued meanwhile is written at once, one flush per batch for all jobs
+            m_LogFile->sputn(writing.data(), (std::streamsize)writing.size());
+            m_LogFile->pubsync();
+            writing.clear();
+        }
+
+        // Idle: the next job starts a new engine and file. A rotated generation (<fileName>.1) is not split
+        m_LogFile->Close();
+        if (m_bSplitPerJob)
+        {
+            SplitByJob(m_FileName);
+        }
+    }
+
+    bool CUlpLogEngine::Stop(bool bForce)
+    {
+        // Same order as Get: no job can get the engine while it is being removed
+        {
+            std::lock_guard<std::mutex> engineLock(g_LogEngineMutex);
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (!bForce && (m_Users > 0 || !m_Queued.empty() || GetTickCount64() - m_LastUseTicks < LOGENGINEIDLESEC * 1000ULL))
+            {
+                return false;
+            }
+            m_bStopped = true;
+            if (g_LogEngine.get() == this) g_LogEngine.reset();
+        }
+        m_Changed.notify_all();
+        return true;
+    }
+
+    DWORD CUlpLogEngine::SplitByJob(const TCHAR* fileName)
+    {
+        typedef struct JobFile
+        {
+            HANDLE file;
+            std::string pending;
+        } JobFile;
+
+        HANDLE input = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (input == INVALID_HANDLE_VALUE) return 0;
+
+        // <fileName without extension>_<log id>.txt
+        tstring baseName(fileName);
+        size_t extension = baseName.rfind(_T('.'));
+        if (extension != tstring::npos && baseName.find(_T('\\'), extension) == tstring::npos) baseName.resize(extension);
+
+        std::map<std::string, JobFile> jobFiles;
+        std::vector<char> buffer(LOGSPLITBUFFERSIZE);
+        std::string line;
+        DWORD fileCount = 0;
+
+        // Appends a line (without its tag) to the file of its job, opened when the job's first line is found
+        auto addLine = [&](const std::string& taggedLine)
+        {
+            if (taggedLine.size() < 4 || taggedLine[0] != '[') return;   // not written by a job's log
+            size_t tagEnd = taggedLine.find("] ");
+            if (tagEnd == std::string::npos || tagEnd > LOGTAGSIZE) return;
+
+            std::string logId = taggedLine.substr(1, tagEnd - 1);
+            JobFile& jobFile = jobFiles[logId];
+            if (jobFile.file == NULL)
+            {
+                tstring jobFileName = baseName + _T("_") + tstring(logId.begin(), logId.end()) + _T(".txt");
+                jobFile.file = CreateFile(jobFileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+                if (jobFile.file != INVALID_HANDLE_VALUE) fileCount++;
+            }
+            jobFile.pending.append(taggedLine, tagEnd + 2, std::string::npos);
+            if (jobFile.pending.size() >= LOGSPLITBUFFERSIZE && jobFile.file != INVALID_HANDLE_VALUE)
+            {
+                WriteAll(jobFile.file, jobFile.pending.data(), jobFile.pending.size());
+                jobFile.pending.clear();
+            }
+        };
+
+        DWORD bytesRead = 0;
+        while (ReadFile(input, buffer.data(), (DWORD)buffer.size(), &bytesRead, NULL) && bytesRead > 0)
+        {
+            const char* pos = buffer.data();
+            const char* end = pos + bytesRead;
+            while (pos < end)
+            {
+                const char* lineEnd = (const char*)memchr(pos, '\n', end - pos);
+                if (lineEnd == NULL)
+                {
+                    line.append(pos, end - pos);
+                    break;
+                }
+                line.append(pos, lineEnd + 1 - pos);
+                addLine(line);
+                line.clear();
+                pos = lineEnd + 1;
+            }
+        }
+        if (!line.empty()) addLine(line);
+        CloseHandle(input);
+
+        for (auto& entry : jobFiles)
+        {
+            if (entry.second.file == INVALID_HANDLE_VALUE) continue;
+            WriteAll(entry.second.file, entry.second.pending.data(), entry.second.pending.size());
+            CloseHandle(entry.second.file);
+        }
+        return fileCount;
+    }
+
+
+
+    CUlpLogEngineBuf::CUlpLogEngineBuf(std::shared_ptr<CUlpLogEngine> engine, unsigned long long logId)
+        : m_Engine(engine)
+    {
+        int tagLength = sprintf_s(m_Tag, sizeof(m_Tag), "[%llu] ", logId);
+        m_TagLength = tagLength > 0 ? (size_t)tagLength : 0;
+        m_bLineStart = true;
+        m_Record.reserve(LOGFILEBUFFERSIZE + 64 * m_TagLength);
+        setp(m_Buffer, m_Buffer + sizeof(m_Buffer));
+    }
+
+    CUlpLogEngineBuf::~CUlpLogEngineBuf(void)
+    {
+        try
+        {
+            if (m_Engine) Close();
+        }
+        catch (...) {}
+    }
+
+    // Tags and submits the complete lines of m_Buffer (all of it if bAll), an incomplete last line is kept for the
+    // next call. A line filling the whole buffer is moved to m_Record and submitted (tagged once) when it ends.
+    void CUlpLogEngineBuf::SubmitLines(bool bAll)
+    {
+        char* end = pptr();
+        char* submitEnd = end;
+        if (!bAll)
+        {
+            while (submitEnd > m_Buffer && submitEnd[-1] != '\n') submitEnd--;
+            if (submitEnd == m_Buffer && end == epptr()) submitEnd = end;  // one line longer than the buffer
+        }
+
+        const char* pos = m_Buffer;
+        while (pos < submitEnd)
+        {
+            const char* lineEnd = (const char*)memchr(pos, '\n', submitEnd - pos);
+            lineEnd = lineEnd != NULL ? lineEnd + 1 : submitEnd;
+            if (m_bLineStart) m_Record.insert(m_Record.end(), m_Tag, m_Tag + m_TagLength);
+            m_Record.insert(m_Record.end(), pos, lineEnd);
+            m_bLineStart = lineEnd[-1] == '\n';
+            pos = lineEnd;
+        }
+
+        // An endless line is broken instead of growing without limit
+        if (!m_bLineStart && (bAll || m_Record.size() >= LOGENGINEQUEUEMAXBYTES / 2))
+        {
+            m_Record.push_back('\n');
+            m_bLineStart = true;
+        }
+
+        if (m_bLineStart)
+        {
+            if (!m_Record.empty() && m_Engine)
+            {
+                m_Engine->Submit(m_Record.data(), m_Record.size());
+            }
+            m_Record.clear();
+        }
+
+        size_t remaining = end - submitEnd;
+        memmove(m_Buffer, submitEnd, remaining);
+        setp(m_Buffer, m_Buffer + sizeof(m_Buffer));
+        pbump((int)remaining);
+    }
+
+    CUlpLogEngineBuf::int_type CUlpLogEngineBuf::overflow(int_type c)
+    {
+        SubmitLines(false);
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int CUlpLogEngineBuf::sync()
+    {
+        SubmitLines(false);
+        return 0;
+    }
+
+    void CUlpLogEngineBuf::Close()
+    {
+        SubmitLines(true);
+        if (m_Engine) m_Engine->Release();
+        m_Engine.reset();
+    }
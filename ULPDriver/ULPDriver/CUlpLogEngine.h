@@ -0,0 +1,103 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpLogEngine.h
+//
+//  PURPOSE:   Header for the process-wide log engine (HKLM-LogoPrint2-Key LogMode = LOGMODE_SHARED): the logs of all
+//             jobs of the process go to one file, tagged per job and written by a single thread
+//
+
+#pragma once
+#include <windows.h>
+#include <tchar.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include "CUlpLogFile.h"
+#include "CUlpConfig.h"
+
+
+const DWORD LOGENGINEQUEUEMAXBYTES = 4 * 1024 * 1024;  // records queued at most, jobs wait for the writer beyond
+const DWORD LOGTAGSIZE = 24;                            // "[<log id>] " prepended to every line of a job
+const DWORD LOGENGINEIDLESEC = 600;                     // the engine stops (and unpins the DLL) when no job used it for this long
+
+
+class CUlpLogEngine
+{
+
+private:
+    TCHAR m_FileName[MAX_PATH + 1];
+
+    // Only used by the writer thread
+    std::unique_ptr<CUlpLogFileBuf> m_LogFile;  // To be freed
+
+    // Shared with the writer thread, guarded by m_Mutex
+    std::mutex m_Mutex;
+    std::condition_variable m_Changed;
+    std::vector<char> m_Queued;     // records of all jobs in the order they have been submitted
+    DWORD m_Users;                  // jobs' logs holding the engine
+    ULONGLONG m_LastUseTicks;       // a job's log got or released the engine
+    bool m_bStopped;                // the writer does not take records any more
+
+    bool m_bSplitPerJob;            // see HKLM-LogoPrint2-Key LogSplitPerJob
+
+    // The writer thread holds the engine and pins the DLL (released by FreeLibraryAndExitThread when it stops)
+    static DWORD WINAPI WriterThread(LPVOID threadEngine);
+    void WriterLoop();
+
+    // Removes the engine from the process (if no job used it for LOGENGINEIDLESEC unless bForce),
+    // returns true if the writer is to stop
+    bool Stop(bool bForce);
+
+public:
+
+    CUlpLogEngine(const TCHAR* fileName, unsigned __int64 maxFileBytes, unsigned __int64 preallocateBytes, bool bSplitPerJob);
+
+    // Returns the engine of the process for a job's log, creates it (its file in folder and its writer thread) if there is
+    // none running. The engine outlives the jobs: the writer closes and splits the file when idle. NULL if it cannot be started
+    static std::shared_ptr<CUlpLogEngine> Get(const CUlpConfig* config, const TCHAR* folder, const TCHAR* fileNamePart);
+
+    // A job's log does not submit records any more
+    void Release();
+
+    // Queues complete records (lines starting with their job's tag), waits only if the queue is full
+    void Submit(const char* bytes, size_t count);
+
+    // Writes the lines of fileName into one file per tag (<fileName>_<log id>.txt), returns the number of files
+    static DWORD SplitByJob(const TCHAR* fileName);
+
+};
+
+
+// Stream buffer of one job's log: complete lines are tagged and submitted to the engine,
+// so that lines of different jobs are never mixed (a line longer than the buffer is collected until it ends)
+class CUlpLogEngineBuf : public std::streambuf
+{
+
+private:
+    std::shared_ptr<CUlpLogEngine> m_Engine;
+    char m_Tag[LOGTAGSIZE];
+    size_t m_TagLength;
+
+    char m_Buffer[LOGFILEBUFFERSIZE];
+    std::vector<char> m_Record;     // tagged lines handed to the engine at once
+    bool m_bLineStart;              // the next byte starts a line (and gets the tag)
+
+    void SubmitLines(bool bAll);
+
+protected:
+
+    int_type overflow(int_type c) override;
+    int sync() override;
+
+public:
+
+    CUlpLogEngineBuf(std::shared_ptr<CUlpLogEngine> engine, unsigned long long logId);
+    ~CUlpLogEngineBuf(void);
+
+    // Submits what is left (an incomplete last line is terminated) and releases the engine
+    void Close();
+
+};
@@ -0,0 +1,339 @@
+#include <Windows.h>
+#include <tchar.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include "CUlpLogFile.h"
+
+
+namespace
+{
+    typedef std::basic_string<TCHAR> tstring;
+
+    ULONGLONG FileTimeToULL(const FILETIME& fileTime)
+    {
+        return ((ULONGLONG)fileTime.dwHighDateTime << 32) | fileTime.dwLowDateTime;
+    }
+
+    void PruneFolder(tstring folder, tstring pattern, unsigned __int64 maxFolderBytes, DWORD maxAgeDays)
+    {
+        typedef struct LogFileInfo
+        {
+            ULONGLONG lastWriteTime;
+            unsigned __int64 size;
+            tstring name;
+        } LogFileInfo;
+
+        try
+        {
+            std::vector<LogFileInfo> files;
+            unsigned __int64 totalBytes = 0;
+
+            WIN32_FIND_DATA findData;
+            HANDLE hFind = FindFirstFileEx((folder + _T("\\") + pattern).c_str(), FindExInfoBasic, &findData,
+                                           FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+            if (hFind == INVALID_HANDLE_VALUE) return;
+            do
+            {
+                if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+                {
+                    unsigned __int64 size = ((unsigned __int64)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+                    files.push_back(LogFileInfo{ FileTimeToULL(findData.ftLastWriteTime), size, findData.cFileName });
+                    totalBytes += size;
+                }
+            } while (FindNextFile(hFind, &findData));
+            FindClose(hFind);
+
+            std::sort(files.begin(), files.end(), [](const LogFileInfo& a, const LogFileInfo& b) {
+                return a.lastWriteTime < b.lastWriteTime;
+            });
+
+            FILETIME now;
+            GetSystemTimeAsFileTime(&now);
+            ULONGLONG nowTime = FileTimeToULL(now);
+            const ULONGLONG ticksPerDay = 24ULL * 60 * 60 * 10000000;
+
+            // Oldest first: stop as soon as a file is neither too old nor needed to get below the budget
+            for (const LogFileInfo& file : files)
+            {
+                bool isTooOld = maxAgeDays > 0 && nowTime > file.lastWriteTime && (nowTime - file.lastWriteTime) / ticksPerDay >= maxAgeDays;
+                bool isOverBudget = maxFolderBytes > 0 && totalBytes > maxFolderBytes;
+                if (!isTooOld && !isOverBudget) break;
+
+                // Fails for files still opened by a job (they are not shared for deletion)
+                if (DeleteFile((folder + _T("\\") + file.name).c_str()))
+                {
+                    totalBytes -= file.size;
+                }
+            }
+        }
+        catch (...) {}
+    }
+
+    typedef struct PruneRequest
+    {
+        tstring folder;
+        tstring pattern;
+        unsigned __int64 maxFolderBytes;
+        DWORD maxAgeDays;
+    } PruneRequest;
+
+    // At most one pruning thread per process
+    std::atomic<bool> g_bPruneRunning(false);
+
+    DWORD WINAPI PruneFolderThread(LPVOID parameter)
+    {
+        PruneRequest* request = (PruneRequest*)parameter;
+        PruneFolder(request->folder, request->pattern, request->maxFolderBytes, request->maxAgeDays);
+        delete request;
+        g_bPruneRunning = false;
+
+        HMODULE module = NULL;
+        GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                          (LPCTSTR)&PruneFolderThread, &module);
+        FreeLibraryAndExitThread(module, 0);
+        return 0;
+    }
+}
+
+
+    CUlpLogFileBuf::CUlpLogFileBuf(const TCHAR* fileName, unsigned __int64 maxFileBytes, unsigned __int64 preallocateBytes)
+    {
+        m_File = INVALID_HANDLE_VALUE;
+        m_MaxFileBytes = maxFileBytes;
+        m_PreallocateBytes = preallocateBytes;
+        m_FilePos = 0;
+        m_AllocatedBytes = 0;
+        ZeroMemory(m_FileName, sizeof(m_FileName));
+        _tcsncpy_s(m_FileName, _countof(m_FileName), fileName, _TRUNCATE);
+
+        setp(m_Buffer, m_Buffer + sizeof(m_Buffer));
+        OpenFile();
+    }
+
+    CUlpLogFileBuf::~CUlpLogFileBuf(void)
+    {
+        Close();
+    }
+
+    bool CUlpLogFileBuf::OpenFile()
+    {
+        // Not shared for deletion: folder pruning must not delete the file of a running job
+        m_File = CreateFile(m_FileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        m_FilePos = 0;
+        m_AllocatedBytes = 0;
+        return m_File != INVALID_HANDLE_VALUE;
+    }
+
+    void CUlpLogFileBuf::CloseFile()
+    {
+        if (m_File != INVALID_HANDLE_VALUE)
+        {
+            // The part of the preallocated extent beyond the end of file is released by the file system on close
+            CloseHandle(m_File);
+            m_File = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    // Reserves disk space ahead of the end of file (without moving the end of file), so that
+    // sequential writes do not grow the file's allocation on every write
+    void CUlpLogFileBuf::Preallocate(unsigned __int64 bytesNeeded)
+    {
+        if (bytesNeeded <= m_AllocatedBytes || m_PreallocateBytes == 0) return;
+
+        unsigned __int64 newSize = m_AllocatedBytes + max(m_PreallocateBytes, bytesNeeded - m_AllocatedBytes);
+        if (m_MaxFileBytes > 0 && newSize > m_MaxFileBytes)
+        {
+            newSize = max(m_MaxFileBytes, bytesNeeded);
+        }
+
+        FILE_ALLOCATION_INFO allocationInfo;
+        allocationInfo.AllocationSize.QuadPart = (LONGLONG)newSize;
+        if (SetFileInformationByHandle(m_File, FileAllocationInfo, &allocationInfo, sizeof(allocationInfo)))
+        {
+            m_AllocatedBytes = newSize;
+        }
+        else
+        {
+            // Don't try again for this file
+            m_PreallocateBytes = 0;
+        }
+    }
+
+    // Keeps the current file as <filename>.1 (replacing an older one) and starts a new file
+    void CUlpLogFileBuf::Rotate()
+    {
+        CloseFile();
+
+        TCHAR rotatedFileName[MAX_PATH + 10];
+        _stprintf_s(rotatedFileName, _countof(rotatedFileName), _T("%s.1"), m_FileName);
+        MoveFileEx(m_FileName, rotatedFileName, MOVEFILE_REPLACE_EXISTING);
+
+        OpenFile();
+    }
+
+    bool CUlpLogFileBuf::WriteBuffer()
+    {
+        DWORD bytesToWrite = (DWORD)(pptr() - pbase());
+        setp(m_Buffer, m_Buffer + sizeof(m_Buffer));
+        if (bytesToWrite == 0 || m_File == INVALID_HANDLE_VALUE) return true;
+
+        if (m_MaxFileBytes > 0 && m_FilePos > 0 && m_FilePos + bytesToWrite > m_MaxFileBytes)
+        {
+            Rotate();
+            if (m_File == INVALID_HANDLE_VALUE) return true;
+        }
+
+        Preallocate(m_FilePos + bytesToWrite);
+
+        const char* buffer = m_Buffer;
+        while (bytesToWrite > 0)
+        {
+            DWORD bytesWritten = 0;
+            if (!WriteFile(m_File, buffer, bytesToWrite, &bytesWritten, NULL) || bytesWritten == 0)
+            {
+                return false;
+            }
+            buffer += bytesWritten;
+            bytesToWrite -= bytesWritten;
+            m_FilePos += bytesWritten;
+        }
+        return true;
+    }
+
+    CUlpLogFileBuf::int_type CUlpLogFileBuf::overflow(int_type c)
+    {
+        if (!WriteBuffer()) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int CUlpLogFileBuf::sync()
+    {
+        return WriteBuffer() ? 0 : -1;
+    }
+
+    void CUlpLogFileBuf::Close()
+    {
+        WriteBuffer();
+        CloseFile();
+    }
+
+    void CUlpLogFileBuf::PruneFolderAsync(const TCHAR* folder, const TCHAR* pattern, unsigned __int64 maxFolderBytes, DWORD maxAgeDays)
+    {
+        static std::mutex pruneMutex;
+        static ULONGLONG lastPruneTicks = 0;
+
+        if (folder == NULL || pattern == NULL || (maxFolderBytes == 0 && maxAgeDays == 0)) return;
+
+        std::lock_guard<std::mutex> lock(pruneMutex);
+        ULONGLONG nowTicks = GetTickCount64();
+        if (lastPruneTicks != 0 && nowTicks - lastPruneTicks < LOGPRUNEINTERVALSEC * 1000ULL) return;
+        if (g_bPruneRunning) return;
+
+        // The pruning thread pins the DLL (released by FreeLibraryAndExitThread when it is done),
+        // nothing waits for it when the DLL is unloaded
+        HMODULE module = NULL;
+        if (!GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCTSTR)&PruneFolderThread, &module))
+        {
+            return;
+        }
+
+        PruneRequest* request = NULL;
+        try
+        {
+            request = new PruneRequest{ tstring(folder), tstring(pattern), maxFolderBytes, maxAgeDays };
+        }
+        catch (...) {}
+        HANDLE thread = request != NULL ? CreateThread(NULL, 0, &PruneFolderThread, request, 0, NULL) : NULL;
+        if (thread == NULL)
+        {
+            delete request;
+            FreeLibrary(module);
+            return;
+        }
+        CloseHandle(thread);
+        lastPruneTicks = nowTicks;
+        g_bPruneRunning = true;
+    }
+
+
+
+    CUlpLogRingBuf::CUlpLogRingBuf(size_t ringBytes)
+    {
+        m_Ring.resize(ringBytes > 0 ? ringBytes : 1);
+        m_Next = 0;
+        m_bWrapped = false;
+        setp(m_Buffer, m_Buffer + sizeof(m_Buffer));
+    }
+
+    void CUlpLogRingBuf::Append(const char* bytes, size_t count)
+    {
+        size_t ringSize = m_Ring.size();
+        if (count >= ringSize)
+        {
+            // Only the last ringSize bytes survive
+            memcpy(m_Ring.data(), bytes + (count - ringSize), ringSize);
+            m_Next = 0;
+            m_bWrapped = true;
+            return;
+        }
+
+        size_t firstPart = min(count, ringSize - m_Next);
+        memcpy(m_Ring.data() + m_Next, bytes, firstPart);
+        if (firstPart < count)
+        {
+            memcpy(m_Ring.data(), bytes + firstPart, count - firstPart);
+        }
+        if (m_Next + count >= ringSize)
+        {
+            m_bWrapped = true;
+        }
+        m_Next = (m_Next + count) % ringSize;
+    }
+
+    void CUlpLogRingBuf::MoveBufferToRing()
+    {
+        size_t count = (size_t)(pptr() - pbase());
+        if (count > 0)
+        {
+            Append(m_Buffer, count);
+        }
+        setp(m_Buffer, m_Buffer + sizeof(m_Buffer));
+    }
+
+    CUlpLogRingBuf::int_type CUlpLogRingBuf::overflow(int_type c)
+    {
+        MoveBufferToRing();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int CUlpLogRingBuf::sync()
+    {
+        MoveBufferToRing();
+        return 0;
+    }
+
+    void CUlpLogRingBuf::WriteTo(std::streambuf* target)
+    {
+        MoveBufferToRing();
+        if (target == NULL) return;
+        if (m_bWrapped)
+        {
+            target->sputn(m_Ring.data() + m_Next, (std::streamsize)(m_Ring.size() - m_Next));
+        }
+        target->sputn(m_Ring.data(), (std::streamsize)m_Next);
+        target->pubsync();
+    }
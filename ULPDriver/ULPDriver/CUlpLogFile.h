@@ -0,0 +1,105 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpLogFile.h
+//
+//  PURPOSE:   Header for a size-capped log file sink (preallocated extent, sequential writes,
+//             rotation), the background pruning of the log folder and an in-memory
+//             flight-recorder sink
+//
+
+#pragma once
+#include <windows.h>
+#include <tchar.h>
+#include <streambuf>
+#include <vector>
+
+
+const DWORD LOGFILEBUFFERSIZE = 8192;              // bytes buffered before they are written to the file
+const DWORD LOGFILEMAXKB_DEFAULT = 16384;          // default per-file budget (a rotated generation is kept additionally)
+const DWORD LOGFILEPREALLOCATEKB_DEFAULT = 1024;   // default size of the extent preallocated at once
+const DWORD LOGFOLDERMAXMB_DEFAULT = 1024;         // default budget for all log files in the log folder
+const DWORD LOGMAXAGEDAYS_DEFAULT = 14;            // default age after which log files are deleted
+const DWORD LOGPRUNEINTERVALSEC = 600;             // the log folder is pruned at most once in this interval per process
+const DWORD LOGRINGKB_DEFAULT = 1024;              // default size of the flight-recorder ring per job
+const DWORD LOGRINGBUFFERSIZE = 1024;              // bytes buffered before they are copied into the ring
+
+// Where CUlpLog writes to (see HKLM-LogoPrint2-Key LogMode)
+const DWORD LOGMODE_FILE = 0;                      // log file per job
+const DWORD LOGMODE_FLIGHTRECORDER = 1;            // in-memory ring per job, written to a log file only on failure
+const DWORD LOGMODE_SHARED = 2;                    // one log file per process for all jobs, lines tagged per job (see CUlpLogEngine)
+
+
+class CUlpLogFileBuf : public std::streambuf
+{
+
+private:
+    TCHAR m_FileName[MAX_PATH + 1];
+    HANDLE m_File;  // To be freed
+
+    char m_Buffer[LOGFILEBUFFERSIZE];
+
+    unsigned __int64 m_MaxFileBytes;
+    unsigned __int64 m_PreallocateBytes;
+    unsigned __int64 m_FilePos;         // bytes written to the current file
+    unsigned __int64 m_AllocatedBytes;  // size of the preallocated extent of the current file
+
+    bool OpenFile();
+    void CloseFile();
+    void Preallocate(unsigned __int64 bytesNeeded);
+    void Rotate();
+    bool WriteBuffer();
+
+protected:
+
+    int_type overflow(int_type c) override;
+    int sync() override;
+
+public:
+
+    // maxFileBytes = 0 means unlimited
+    CUlpLogFileBuf(const TCHAR* fileName, unsigned __int64 maxFileBytes, unsigned __int64 preallocateBytes);
+    ~CUlpLogFileBuf(void);
+
+    bool IsOpen() { return m_File != INVALID_HANDLE_VALUE; }
+
+    // Writes buffered bytes, truncates the preallocated but unused extent and closes the file
+    void Close();
+
+    // Deletes files matching pattern in folder which are older than maxAgeDays and - oldest first -
+    // as many files as needed to keep the folder below maxFolderBytes (0 = no limit).
+    // Runs on a detached thread pinning the DLL (not waited for on unload), at most once per LOGPRUNEINTERVALSEC per process.
+    // Files still opened by a job are skipped.
+    static void PruneFolderAsync(const TCHAR* folder, const TCHAR* pattern, unsigned __int64 maxFolderBytes, DWORD maxAgeDays);
+
+};
+
+
+// Keeps the last bytes written in a fixed-size in-memory ring (nothing is written to disk)
+class CUlpLogRingBuf : public std::streambuf
+{
+
+private:
+    std::vector<char> m_Ring;
+    size_t m_Next;      // position in m_Ring the next byte is written to
+    bool m_bWrapped;    // true, if older bytes have been overwritten
+
+    char m_Buffer[LOGRINGBUFFERSIZE];
+
+    void Append(const char* bytes, size_t count);
+    void MoveBufferToRing();
+
+protected:
+
+    int_type overflow(int_type c) override;
+    int sync() override;
+
+public:
+
+    CUlpLogRingBuf(size_t ringBytes);
+
+    bool HasWrapped() { return m_bWrapped; }
+
+    // Writes the content of the ring (oldest byte first) to target
+    void WriteTo(std::streambuf* target);
+
+};
@@ -0,0 +1,197 @@
+#include <Windows.h>
+#include <cstdio>
+#include "CUlpPageFingerprint.h"
+
+
+const unsigned __int64 FNV64OFFSETBASIS = 14695981039346656037ULL;
+const unsigned __int64 FNV64PRIME = 1099511628211ULL;
+
+const char BEGINPAGESETUPCOMMENT[] = "%%BeginPageSetup";
+const char PAGETRAILERCOMMENT[] = "%%PageTrailer";
+const char BEGINDOCUMENTCOMMENT[] = "%%BeginDocument";
+const char ENDDOCUMENTCOMMENT[] = "%%EndDocument";
+
+
+    CUlpPageFingerprint::CUlpPageFingerprint(const std::string& markPrefix)
+        : m_MarkPrefix(markPrefix)
+    {
+        m_bActive = false;
+        m_Hash = FNV64OFFSETBASIS;
+        m_Bytes = 0;
+        m_bLineStart = true;
+        m_bAfterCR = false;
+        m_LineKind = LINE_UNDECIDED;
+        m_DocumentDepth = 0;
+        ZeroMemory(m_Text, sizeof(m_Text));
+        m_TextLength = 0;
+    }
+
+    void CUlpPageFingerprint::HashBytes(const char* bytes, size_t count)
+    {
+        unsigned __int64 hash = m_Hash;
+        for (size_t i = 0; i < count; i++)
+        {
+            hash = (hash ^ (unsigned char)bytes[i]) * FNV64PRIME;
+        }
+        m_Hash = hash;
+        m_Bytes += count;
+    }
+
+    // Adds bytes of the current line to the result, hashes them if they belong to the page
+    void CUlpPageFingerprint::AddBytes(const char* data, size_t length)
+    {
+        if (length == 0) return;
+        if (m_bActive && m_LineKind != LINE_MARK) HashBytes(data, length);
+
+        if (!m_Segments.empty() && !m_Segments.back().bPageHash &&
+            m_Segments.back().data + m_Segments.back().length == data)
+        {
+            m_Segments.back().length += (DWORD)length;
+            return;
+        }
+        m_Segments.push_back(PageSegment{ false, data, (DWORD)length });
+    }
+
+    // A constant the held back start of the line is a prefix of (there is one, m_Head only grows while it is)
+    const char* CUlpPageFingerprint::HeadSource()
+    {
+        const char* candidates[] = { BEGINPAGESETUPCOMMENT, PAGETRAILERCOMMENT, BEGINDOCUMENTCOMMENT, ENDDOCUMENTCOMMENT, m_MarkPrefix.c_str() };
+        for (const char* candidate : candidates)
+        {
+            if (strncmp(candidate, m_Head.c_str(), m_Head.size()) == 0) return candidate;
+        }
+        return "";
+    }
+
+    // Sets m_LineKind if m_Head is one of the comments looked for, or can no longer become one
+    bool CUlpPageFingerprint::DecideLine()
+    {
+        typedef struct Candidate
+        {
+            const char* text;
+            LineKind kind;
+        } Candidate;
+        const Candidate candidates[] =
+        {
+            { BEGINPAGESETUPCOMMENT, LINE_BEGINPAGESETUP },
+            { PAGETRAILERCOMMENT, LINE_PAGETRAILER },
+            { BEGINDOCUMENTCOMMENT, LINE_BEGINDOCUMENT },
+            { ENDDOCUMENTCOMMENT, LINE_ENDDOCUMENT },
+            { m_MarkPrefix.c_str(), LINE_MARK }
+        };
+
+        bool bMayBecomeOne = false;
+        for (const Candidate& candidate : candidates)
+        {
+            size_t length = strlen(candidate.text);
+            if (length == 0 || m_Head.size() > length || strncmp(candidate.text, m_Head.c_str(), m_Head.size()) != 0) continue;
+            if (m_Head.size() == length)
+            {
+                m_LineKind = candidate.kind;
+                return true;
+            }
+            bMayBecomeOne = true;
+        }
+        if (bMayBecomeOne) return false;
+        m_LineKind = LINE_OTHER;
+        return true;
+    }
+
+    void CUlpPageFingerprint::EndLine()
+    {
+        m_bLineStart = true;
+        if (m_LineKind == LINE_BEGINPAGESETUP && m_DocumentDepth == 0)
+        {
+            // The page starts behind the line
+            m_bActive = true;
+            m_Hash = FNV64OFFSETBASIS;
+            m_Bytes = 0;
+        }
+        m_LineKind = LINE_UNDECIDED;
+    }
+
+    void CUlpPageFingerprint::Finish()
+    {
+        m_bActive = false;
+        int length = sprintf_s(m_Text, sizeof(m_Text), "%016llx/%llu", m_Hash, m_Bytes);
+        m_TextLength = length > 0 ? (size_t)length : 0;
+        if (m_TextLength > 0) m_Segments.push_back(PageSegment{ true, NULL, 0 });
+    }
+
+    const std::vector<PageSegment>& CUlpPageFingerprint::Append(const char* bytes, DWORD count)
+    {
+        m_Segments.clear();
+        if (bytes == NULL) return m_Segments;
+
+        const char* end = bytes + count;
+        while (bytes < end)
+        {
+            if (m_bAfterCR)
+            {
+                m_bAfterCR = false;
+                if (*bytes == '\n')
+                {
+                    AddBytes(bytes, 1);
+                    bytes++;
+                }
+                EndLine();
+                continue;
+            }
+
+            if (m_bLineStart)
+            {
+                // Collect the start of the line while it may be one of the comments looked for (the byte that
+                // tells it is not stays in bytes)
+                bool bDecided = false;
+                while (!bDecided && bytes < end)
+                {
+                    if (*bytes == '\r' || *bytes == '\n')
+                    {
+                        m_LineKind = LINE_OTHER;
+                        bDecided = true;
+                        break;
+                    }
+                    m_Head.push_back(*bytes);
+                    bDecided = DecideLine();
+                    if (bDecided && m_LineKind == LINE_OTHER) m_Head.pop_back();
+                    else bytes++;
+                }
+                if (!bDecided) break;   // decided by the next buffer
+
+                if (m_LineKind == LINE_PAGETRAILER && m_DocumentDepth == 0 && m_bActive) Finish();
+                else if (m_LineKind == LINE_BEGINDOCUMENT) m_DocumentDepth++;
+                else if (m_LineKind == LINE_ENDDOCUMENT && m_DocumentDepth > 0) m_DocumentDepth--;
+
+                AddBytes(HeadSource(), m_Head.size());
+                m_Head.clear();
+                m_bLineStart = false;
+            }
+
+            // Up to and including the next line end
+            const char* lineEnd = bytes;
+            while (lineEnd < end && *lineEnd != '\n' && *lineEnd != '\r') lineEnd++;
+            if (lineEnd == end)
+            {
+                AddBytes(bytes, lineEnd - bytes);
+                break;
+            }
+            AddBytes(bytes, lineEnd + 1 - bytes);
+            bytes = lineEnd + 1;
+            if (*lineEnd == '\r') m_bAfterCR = true;
+            else EndLine();
+        }
+        return m_Segments;
+    }
+
+    const std::vector<PageSegment>& CUlpPageFingerprint::Flush()
+    {
+        m_Segments.clear();
+        if (!m_Head.empty())
+        {
+            m_LineKind = LINE_OTHER;
+            AddBytes(HeadSource(), m_Head.size());
+            m_Head.clear();
+        }
+        m_bActive = false;
+        return m_Segments;
+    }
@@ -0,0 +1,87 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpPageFingerprint.h
+//
+//  PURPOSE:   Header for the fingerprint of a page's PostScript (the lines after %%BeginPageSetup up to %%PageTrailer,
+//             found in the stream), sent to the spooler so that it can recognize byte-identical pages
+//
+
+#pragma once
+#include <windows.h>
+#include <string>
+#include <vector>
+
+
+const DWORD PAGEFINGERPRINTTEXTSIZE = 40;   // 16 hex digits, '/', byte count and null
+const char* const PAGEHASHCOMMANDNAME = "PageHash";   // proprietary DSC command sent right before the %%PageTrailer line
+
+// What is to be written to the pipe: bytes, or the PageHash command (with CUlpPageFingerprint::Text)
+typedef struct PageSegment
+{
+    bool bPageHash;
+    const char* data;
+    DWORD length;
+} PageSegment;
+
+
+// Scans the stream line by line, partial lines are carried across buffers. Only the start of a line that may be one
+// of the comments looked for is held back until it is known what it is.
+class CUlpPageFingerprint
+{
+
+private:
+    enum LineKind
+    {
+        LINE_UNDECIDED,         // its first bytes are still collected in m_Head
+        LINE_OTHER,
+        LINE_MARK,              // starts with m_MarkPrefix
+        LINE_BEGINPAGESETUP,
+        LINE_PAGETRAILER,
+        LINE_BEGINDOCUMENT,
+        LINE_ENDDOCUMENT
+    };
+
+    // Lines starting with the prefix of the plugin's own marks are not part of the fingerprint:
+    // they contain the page number and would make every page different
+    std::string m_MarkPrefix;
+
+    bool m_bActive;                 // within a page
+    unsigned __int64 m_Hash;        // FNV-1a (64 bit), updated byte by byte
+    unsigned __int64 m_Bytes;       // bytes hashed
+
+    // Position in the current line
+    bool m_bLineStart;
+    bool m_bAfterCR;                // the line ended with CR, a LF following it belongs to the line
+    LineKind m_LineKind;
+    std::string m_Head;
+    int m_DocumentDepth;            // comments of embedded documents are not the job's
+
+    char m_Text[PAGEFINGERPRINTTEXTSIZE];
+    size_t m_TextLength;
+
+    // Result of the current call, points into the caller's bytes, constants or m_MarkPrefix
+    std::vector<PageSegment> m_Segments;
+
+    void HashBytes(const char* bytes, size_t count);
+    void AddBytes(const char* data, size_t length);
+    bool DecideLine();
+    const char* HeadSource();
+    void EndLine();
+    void Finish();
+
+public:
+
+    // markPrefix: text the plugin's marks start with (see CUlpDSCTemplate::LiteralPrefix), may be empty
+    CUlpPageFingerprint(const std::string& markPrefix);
+
+    // Returns what is to be written for the next bytes of the stream (valid until the next call)
+    const std::vector<PageSegment>& Append(const char* bytes, DWORD count);
+
+    // At the end of the job: returns what is still held back
+    const std::vector<PageSegment>& Flush();
+
+    // "<hash in hex>/<bytes hashed>" of the page the last PageHash segment was returned for
+    const char* Text() { return m_Text; }
+    size_t TextLength() { return m_TextLength; }
+
+};
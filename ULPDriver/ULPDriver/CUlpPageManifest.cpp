@@ -0,0 +1,259 @@
+#include <Windows.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "CUlpPageManifest.h"
+
+
+
+    CUlpPageManifest::CUlpPageManifest()
+    {
+        m_bPageOpen = false;
+        m_bTrailer = false;
+        m_Offset = 0;
+        m_bLineStart = true;
+        m_bAfterCR = false;
+        m_bInDSCLine = false;
+        m_LineStart = 0;
+        m_bResourcesContinue = false;
+        m_DocumentDepth = 0;
+        m_SkipBytes = 0;
+        m_SkipLines = 0;
+        m_Line.reserve(DSCLINEMAXSIZE);
+    }
+
+    void CUlpPageManifest::Append(const char* bytes, DWORD count)
+    {
+        if (bytes == NULL) return;
+
+        const char* end = bytes + count;
+        while (bytes < end)
+        {
+            if (m_bAfterCR)
+            {
+                m_bAfterCR = false;
+                if (*bytes == '\n')
+                {
+                    bytes++;
+                    m_Offset++;
+                    continue;
+                }
+            }
+
+            if (m_SkipBytes > 0)
+            {
+                size_t part = (size_t)__min(m_SkipBytes, (unsigned __int64)(end - bytes));
+                bytes += part;
+                m_Offset += part;
+                m_SkipBytes -= part;
+                continue;
+            }
+
+            if (m_bLineStart)
+            {
+                m_bLineStart = false;
+                m_LineStart = m_Offset;
+                if (m_SkipLines > 0)
+                {
+                    m_SkipLines--;
+                }
+                else if (*bytes == '%')
+                {
+                    m_bInDSCLine = true;
+                    m_Line.clear();
+                }
+            }
+
+            // Up to the next line end (most lines are postscript and are not looked at)
+            const char* lineEnd = bytes;
+            while (lineEnd < end && *lineEnd != '\r' && *lineEnd != '\n') lineEnd++;
+            if (m_bInDSCLine && m_Line.size() < DSCLINEMAXSIZE)
+            {
+                m_Line.append(bytes, __min((size_t)(lineEnd - bytes), DSCLINEMAXSIZE - m_Line.size()));
+            }
+            m_Offset += lineEnd - bytes;
+            bytes = lineEnd;
+
+            if (lineEnd < end)
+            {
+                m_bAfterCR = *lineEnd == '\r';
+                bytes++;
+                m_Offset++;
+                if (m_bInDSCLine) ProcessLine();
+                m_bInDSCLine = false;
+                m_bLineStart = true;
+            }
+        }
+    }
+
+    const char* CUlpPageManifest::After(const std::string& line, const char* keyword)
+    {
+        size_t length = strlen(keyword);
+        if (line.compare(0, length, keyword) != 0) return NULL;
+
+        const char* value = line.c_str() + length;
+        while (*value == ' ' || *value == '\t') value++;
+        return value;
+    }
+
+    void CUlpPageManifest::ProcessLine()
+    {
+        const char* value;
+
+        if (m_DocumentDepth > 0)
+        {
+            // Structure comments of embedded documents are not the job's
+            if (After(m_Line, "%%EndDocument") != NULL) m_DocumentDepth--;
+            else if (After(m_Line, "%%BeginDocument") != NULL) m_DocumentDepth++;
+            return;
+        }
+
+        bool bResources = false;
+        if ((value = After(m_Line, "%%+")) != NULL)
+        {
+            if (m_bResourcesContinue)
+            {
+                AddResources(value, 0);
+                bResources = true;
+            }
+        }
+        else if (After(m_Line, "%%BeginDocument") != NULL)
+        {
+            m_DocumentDepth++;
+        }
+        else if ((value = After(m_Line, "%%BeginBinary:")) != NULL)
+        {
+            m_SkipBytes = _strtoui64(value, NULL, 10);
+        }
+        else if ((value = After(m_Line, "%%BeginData:")) != NULL)
+        {
+            // %%BeginData: count [Hex|Binary|ASCII [Bytes|Lines]]
+            char* rest = NULL;
+            unsigned __int64 dataCount = _strtoui64(value, &rest, 10);
+            if (rest != NULL && strstr(rest, "Lines") != NULL) m_SkipLines = dataCount;
+            else m_SkipBytes = dataCount;
+        }
+        else if (m_bTrailer)
+        {
+            // Nothing belongs to a page any more
+        }
+        else if ((value = After(m_Line, "%%Page:")) != NULL)
+        {
+            ClosePage(m_LineStart);
+
+            // %%Page: label ordinal (the label may be a string in parentheses)
+            Page page;
+            page.start = m_LineStart;
+            page.end = 0;
+            const char* labelEnd = value;
+            if (*value == '(')
+            {
+                int depth = 0;
+                do
+                {
+                    if (*labelEnd == '(') depth++;
+                    else if (*labelEnd == ')') depth--;
+                    labelEnd++;
+                } while (*labelEnd != '\0' && depth > 0);
+            }
+            else
+            {
+                while (*labelEnd != '\0' && *labelEnd != ' ' && *labelEnd != '\t') labelEnd++;
+            }
+            page.label.assign(value, labelEnd - value);
+            while (*labelEnd == ' ' || *labelEnd == '\t') labelEnd++;
+            const char* ordinalEnd = labelEnd;
+            while (*ordinalEnd != '\0' && *ordinalEnd != ' ' && *ordinalEnd != '\t') ordinalEnd++;
+            page.ordinal.assign(labelEnd, ordinalEnd - labelEnd);
+            page.orientation = m_Orientation;
+
+            m_Pages.push_back(page);
+            m_bPageOpen = true;
+        }
+        else if ((value = After(m_Line, "%%PageOrientation:")) != NULL)
+        {
+            if (m_bPageOpen) m_Pages.back().orientation = value;
+            else m_Orientation = value;
+        }
+        else if ((value = After(m_Line, "%%Orientation:")) != NULL)
+        {
+            if (!m_bPageOpen && *value != '(') m_Orientation = value;   // not (atend)
+        }
+        else if (m_bPageOpen && ((value = After(m_Line, "%%IncludeResource:")) != NULL || (value = After(m_Line, "%%PageResources:")) != NULL))
+        {
+            AddResources(value, 0);
+            bResources = true;
+        }
+        else if (m_bPageOpen && (value = After(m_Line, "%%BeginResource:")) != NULL)
+        {
+            // %%BeginResource: type name [vmusage]
+            AddResources(value, 2);
+        }
+        else if (After(m_Line, "%%Trailer") != NULL || After(m_Line, "%%EOF") != NULL)
+        {
+            ClosePage(m_LineStart);
+            m_bTrailer = true;
+        }
+        m_bResourcesContinue = bResources;
+    }
+
+    void CUlpPageManifest::ClosePage(unsigned __int64 end)
+    {
+        if (!m_bPageOpen) return;
+        m_Pages.back().end = end;
+        m_bPageOpen = false;
+    }
+
+    void CUlpPageManifest::AddResources(const char* text, int maxTokens)
+    {
+        if (*text == '\0' || *text == '(') return;   // nothing or (atend)
+
+        const char* textEnd = text + strlen(text);
+        if (maxTokens > 0)
+        {
+            textEnd = text;
+            for (int token = 0; token < maxTokens && *textEnd != '\0'; token++)
+            {
+                while (*textEnd == ' ' || *textEnd == '\t') textEnd++;
+                while (*textEnd != '\0' && *textEnd != ' ' && *textEnd != '\t') textEnd++;
+            }
+        }
+        while (textEnd > text && (textEnd[-1] == ' ' || textEnd[-1] == '\t')) textEnd--;
+
+        std::string& resources = m_Pages.back().resources;
+        size_t length = textEnd - text;
+        if (resources.size() + length + 2 > PAGEMANIFESTRESOURCESMAXSIZE) return;
+        if (!resources.empty()) resources.append("; ");
+        resources.append(text, length);
+    }
+
+    std::string CUlpPageManifest::Format()
+    {
+        std::string manifest;
+        char numbers[100];
+        for (size_t i = 0; i < m_Pages.size(); i++)
+        {
+            const Page& page = m_Pages[i];
+            unsigned __int64 end = page.end != 0 ? page.end : m_Offset;
+
+            // %ULPPage: index start end orientation ordinal label
+            sprintf_s(numbers, sizeof(numbers), "%%ULPPage: %llu %llu %llu ", (unsigned __int64)i + 1, page.start, end);
+            manifest.append(numbers);
+            manifest.append(page.orientation.empty() ? "-" : page.orientation);
+            manifest.append(" ");
+            manifest.append(page.ordinal.empty() ? "-" : page.ordinal);
+            manifest.append(" ");
+            manifest.append(page.label);
+            manifest.append("\r\n");
+
+            if (!page.resources.empty())
+            {
+                sprintf_s(numbers, sizeof(numbers), "%%ULPPageResources: %llu ", (unsigned __int64)i + 1);
+                manifest.append(numbers);
+                manifest.append(page.resources);
+                manifest.append("\r\n");
+            }
+        }
+        manifest.append("%ULPEndPageManifest\r\n");
+        return manifest;
+    }
@@ -0,0 +1,73 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpPageManifest.h
+//
+//  PURPOSE:   Header for the page manifest: PScript5's DSC structure comments (%%Page:, %%PageOrientation:,
+//             %%IncludeResource:, %%Trailer, ...) are parsed as the postscript is written to the pipe, byte range, label,
+//             resources and orientation of each page are sent to the spooler at the end of the job
+//
+
+#pragma once
+#include <windows.h>
+#include <string>
+#include <vector>
+
+
+const DWORD DSCLINEMAXSIZE = 255;                   // DSC comments are at most 255 characters, longer ones are truncated
+const DWORD PAGEMANIFESTRESOURCESMAXSIZE = 4096;    // resources recorded per page, further ones are dropped
+const char* const PAGEMANIFESTCOMMANDNAME = "PageManifest";  // proprietary DSC command starting the manifest
+
+
+class CUlpPageManifest
+{
+
+private:
+    typedef struct Page
+    {
+        unsigned __int64 start;     // offset of the %%Page: comment
+        unsigned __int64 end;       // offset of the next %%Page:, %%Trailer or %%EOF (end of stream if none)
+        std::string label;
+        std::string ordinal;
+        std::string orientation;
+        std::string resources;      // of %%IncludeResource:, %%PageResources: and %%BeginResource:, separated by "; "
+    } Page;
+
+    std::vector<Page> m_Pages;
+    bool m_bPageOpen;               // m_Pages.back() has no end yet
+    bool m_bTrailer;                // %%Trailer or %%EOF seen: no more pages
+    std::string m_Orientation;      // %%Orientation: (or %%PageOrientation: in the defaults), for pages without their own
+
+    // Parser state
+    unsigned __int64 m_Offset;      // stream offset of the next byte
+    bool m_bLineStart;
+    bool m_bAfterCR;                // previous line ended with CR, a LF following it belongs to that line end
+    bool m_bInDSCLine;              // current line starts with % and is collected in m_Line (other lines are skipped)
+    std::string m_Line;
+    unsigned __int64 m_LineStart;
+    bool m_bResourcesContinue;      // %%+ continues the resources of the previous comment
+    DWORD m_DocumentDepth;          // within %%BeginDocument (embedded documents have their own pages)
+    unsigned __int64 m_SkipBytes;   // data of %%BeginBinary: or %%BeginData: (not parsed)
+    unsigned __int64 m_SkipLines;
+
+    void ProcessLine();
+    void ClosePage(unsigned __int64 end);
+    void AddResources(const char* text, int maxTokens);
+
+    // Returns the text after keyword if line starts with it, else NULL
+    static const char* After(const std::string& line, const char* keyword);
+
+public:
+
+    CUlpPageManifest();
+
+    // Parses the next bytes of the stream
+    void Append(const char* bytes, DWORD count);
+
+    size_t PageCount() { return m_Pages.size(); }
+    unsigned __int64 StreamBytes() { return m_Offset; }
+
+    // Returns the manifest lines (one %ULPPage: per page and %ULPPageResources: for pages using resources,
+    // %ULPEndPageManifest last), offsets being those of the stream passed to Append
+    std::string Format();
+
+};
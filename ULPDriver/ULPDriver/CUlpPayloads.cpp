@@ -0,0 +1,68 @@
+#include "precomp.h"
+#include <mutex>
+#include <string>
+#include "CUlpPayloads.h"
+#include "ulpInjectionPoints.h"
+#include "ulpCharBuffer.h"
+
+
+namespace
+{
+    std::mutex g_PayloadsMutex;
+    std::shared_ptr<const CUlpPayloads> g_Payloads;
+}
+
+
+    CUlpPayloads::CUlpPayloads(const CUlpConfig* config)
+    {
+        static const char* const placeholderNames[PAYLOADSLOTCOUNT] = { "JobId", "Page", "ParamId" };
+
+        m_Count = 0;
+        m_Rejected = 0;
+        m_Generation = config->Generation();
+        m_Payloads.resize(MAXCOMMAND + 1);
+
+        for (int i = 0; i <= MAXCOMMAND; i++)
+        {
+            const ulpInjectionPoints::InjectionPoint& injectionPoint = ulpInjectionPoints::INJECTIONPOINTS[i];
+            if (injectionPoint.name == NULL) continue;
+
+            std::basic_string<TCHAR> valueName(PAYLOADVALUEPREFIX);
+            valueName.append(injectionPoint.name, injectionPoint.name + injectionPoint.nameLength);
+            const TCHAR* payload = config->GetStr(HKEY_LOCAL_MACHINE, valueName.c_str());
+            if (payload == NULL || payload[0] == _T('\0')) continue;
+
+            // UniLogoPrint does not support replacement of postscript created by the core driver
+            if (!injectionPoint.bIsInject)
+            {
+                m_Rejected++;
+                continue;
+            }
+
+            ulpHelper::CharBuffer buffer(payload, (DWORD)_tcslen(payload) + 1);
+            std::string text(buffer.GetBufferAnsi());
+            if (text.back() != '\n') text.append("\r\n");
+
+            if (m_Payloads[i].CompilePlaceholders(text.c_str(), placeholderNames, PAYLOADSLOTCOUNT))
+            {
+                m_Count++;
+            }
+        }
+    }
+
+    std::shared_ptr<const CUlpPayloads> CUlpPayloads::Get(const std::shared_ptr<const CUlpConfig>& config)
+    {
+        std::lock_guard<std::mutex> lock(g_PayloadsMutex);
+        if (g_Payloads && g_Payloads->m_Generation == config->Generation())
+        {
+            return g_Payloads;
+        }
+
+        // A job still holding an older snapshot gets its own payloads, the cache keeps the newest ones
+        std::shared_ptr<const CUlpPayloads> payloads(new CUlpPayloads(config.get()));
+        if (!g_Payloads || g_Payloads->m_Generation < config->Generation())
+        {
+            g_Payloads = payloads;
+        }
+        return payloads;
+    }
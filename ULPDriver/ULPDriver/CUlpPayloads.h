@@ -0,0 +1,56 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpPayloads.h
+//
+//  PURPOSE:   Header for the PostScript payloads administrators configure per injection point
+//             (HKLM Payload_PSINJECT_*), compiled once per config snapshot and shared by all jobs
+//
+
+#pragma once
+#include <windows.h>
+#include <tchar.h>
+#include <memory>
+#include <vector>
+#include "CUlpConfig.h"
+#include "CUlpDSCTemplate.h"
+
+
+// Placeholders of a payload: $(JobId), $(Page), $(ParamId)
+const int PAYLOADSLOT_JOBID = 0;
+const int PAYLOADSLOT_PAGE = 1;
+const int PAYLOADSLOT_PARAMID = 2;
+const int PAYLOADSLOTCOUNT = 3;
+
+// Value name of a payload is this prefix followed by the name of the injection point, e.g. Payload_PSINJECT_BEGINPAGESETUP
+// (REG_SZ or REG_MULTI_SZ, a line break is appended if missing)
+const LPCTSTR PAYLOADVALUEPREFIX = _T("Payload_");
+
+
+class CUlpPayloads
+{
+
+private:
+    // Indexed by PSINJECT_*, not compiled where no payload is configured
+    std::vector<CUlpDSCTemplate> m_Payloads;
+    DWORD m_Count;
+    DWORD m_Rejected;
+    DWORD m_Generation;
+
+    CUlpPayloads(const CUlpConfig* config);
+
+public:
+
+    // Returns the payloads of config (compiled once for each config generation)
+    static std::shared_ptr<const CUlpPayloads> Get(const std::shared_ptr<const CUlpConfig>& config);
+
+    // Payload of injection point dwIndex, NULL if none is configured
+    const CUlpDSCTemplate* Find(DWORD dwIndex) const
+    {
+        return dwIndex < m_Payloads.size() && m_Payloads[dwIndex].IsCompiled() ? &m_Payloads[dwIndex] : NULL;
+    }
+
+    // Number of payloads configured (and ignored, because PScript5's postscript would have been replaced)
+    DWORD Count() const { return m_Count; }
+    DWORD Rejected() const { return m_Rejected; }
+
+};
@@ -0,0 +1,266 @@
+#include <Windows.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include "CUlpPrologDedup.h"
+
+// SHA-256 (BCryptCreateHash, BCryptHashData, BCryptFinishHash)
+#pragma comment(lib, "bcrypt.lib")
+
+
+const char BEGINPROLOGCOMMENT[] = "%%BeginProlog";
+const char ENDPROLOGCOMMENT[] = "%%EndProlog";
+const size_t BEGINPROLOGCOMMENTLENGTH = sizeof(BEGINPROLOGCOMMENT) - 1;
+const size_t ENDPROLOGCOMMENTLENGTH = sizeof(ENDPROLOGCOMMENT) - 1;
+
+
+    CUlpPrologDedup::CUlpPrologDedup(const std::string& knownHashes, DWORD maxBytes, const std::string& markPrefix)
+        : m_MarkPrefix(markPrefix)
+    {
+        m_MaxBytes = maxBytes;
+        m_State = STATE_BEFORE;
+        m_bLineStart = true;
+        m_Matched = 0;
+        m_LineKind = LINE_UNDECIDED;
+        m_bAfterCR = false;
+        m_bKnown = false;
+        m_bAbandoned = false;
+        ZeroMemory(m_HashHex, sizeof(m_HashHex));
+
+        size_t pos = 0;
+        while (pos < knownHashes.size())
+        {
+            size_t end = knownHashes.find_first_of(", ", pos);
+            if (end == std::string::npos) end = knownHashes.size();
+            std::string hash = knownHashes.substr(pos, end - pos);
+            pos = end + 1;
+            if (hash.size() != PROLOGHASHHEXSIZE - 1) continue;
+
+            std::transform(hash.begin(), hash.end(), hash.begin(), [](unsigned char c) { return (char)tolower(c); });
+            m_KnownHashes.push_back(hash);
+        }
+    }
+
+    void CUlpPrologDedup::AddBytes(const char* data, size_t length)
+    {
+        if (length == 0) return;
+        if (!m_Segments.empty() && m_Segments.back().kind == PROLOGSEGMENT_BYTES &&
+            m_Segments.back().data + m_Segments.back().length == data)
+        {
+            m_Segments.back().length += (DWORD)length;
+            return;
+        }
+        m_Segments.push_back(PrologSegment{ PROLOGSEGMENT_BYTES, data, (DWORD)length });
+    }
+
+    const std::vector<PrologSegment>& CUlpPrologDedup::Append(const char* bytes, DWORD count)
+    {
+        m_Segments.clear();
+        if (bytes == NULL) return m_Segments;
+
+        const char* end = bytes + count;
+        while (bytes < end)
+        {
+            if (m_State == STATE_DONE)
+            {
+                AddBytes(bytes, end - bytes);
+                break;
+            }
+            bytes = m_State == STATE_BEFORE ? ScanBefore(bytes, end) : Collect(bytes, end);
+        }
+        return m_Segments;
+    }
+
+    // Passes bytes up to the end of the current line, holds back what may be the start of %%BeginProlog
+    const char* CUlpPrologDedup::ScanBefore(const char* bytes, const char* end)
+    {
+        if (m_bLineStart)
+        {
+            while (bytes < end && m_Matched < BEGINPROLOGCOMMENTLENGTH && *bytes == BEGINPROLOGCOMMENT[m_Matched])
+            {
+                m_Matched++;
+                bytes++;
+            }
+            if (m_Matched == BEGINPROLOGCOMMENTLENGTH)
+            {
+                // From here on the prolog is held back
+                m_State = STATE_COLLECTING;
+                m_LineKind = LINE_PROLOG;
+                m_Prolog.assign(BEGINPROLOGCOMMENT, BEGINPROLOGCOMMENTLENGTH);
+                m_Matched = 0;
+                return bytes;
+            }
+            if (bytes == end) return bytes;     // decided by the next buffer
+
+            // Not the prolog: the bytes held back are those of the comment
+            AddBytes(BEGINPROLOGCOMMENT, m_Matched);
+            m_Matched = 0;
+            m_bLineStart = false;
+        }
+
+        const char* lineEnd = bytes;
+        while (lineEnd < end && *lineEnd != '\r' && *lineEnd != '\n') lineEnd++;
+        if (lineEnd < end)
+        {
+            lineEnd++;
+            m_bLineStart = true;
+        }
+        AddBytes(bytes, lineEnd - bytes);
+        return lineEnd;
+    }
+
+    // Holds back the bytes of the prolog line by line (marks go to m_Marks) up to the end of %%EndProlog
+    const char* CUlpPrologDedup::Collect(const char* bytes, const char* end)
+    {
+        if (m_bAfterCR)
+        {
+            m_bAfterCR = false;
+            if (*bytes == '\n')
+            {
+                LineDestination().push_back('\n');
+                bytes++;
+            }
+            if (m_LineKind == LINE_END)
+            {
+                FinishProlog();
+                return bytes;
+            }
+            m_LineKind = LINE_UNDECIDED;
+            return bytes;
+        }
+
+        if (m_LineKind == LINE_UNDECIDED)
+        {
+            // The first bytes of the line tell whether it is %%EndProlog (decided by its line end), a mark or part of the prolog
+            while (bytes < end)
+            {
+                if (*bytes == '\r' || *bytes == '\n')
+                {
+                    m_LineKind = m_Head == ENDPROLOGCOMMENT ? LINE_END
+                               : (!m_MarkPrefix.empty() && m_Head == m_MarkPrefix ? LINE_MARK : LINE_PROLOG);
+                    break;
+                }
+                m_Head.push_back(*bytes++);
+
+                bool bMayBeEnd = m_Head.size() <= ENDPROLOGCOMMENTLENGTH && m_Head.compare(0, m_Head.size(), ENDPROLOGCOMMENT, m_Head.size()) == 0;
+                bool bMayBeMark = !m_MarkPrefix.empty() && m_Head.size() <= m_MarkPrefix.size() && m_MarkPrefix.compare(0, m_Head.size(), m_Head) == 0;
+                if (bMayBeMark && m_Head.size() == m_MarkPrefix.size()) m_LineKind = LINE_MARK;
+                else if (!bMayBeEnd && !bMayBeMark) m_LineKind = LINE_PROLOG;
+                if (m_LineKind != LINE_UNDECIDED) break;
+            }
+            if (m_LineKind == LINE_UNDECIDED) return bytes;     // decided by the next buffer
+
+            LineDestination().append(m_Head);
+            m_Head.clear();
+        }
+
+        // Rest of the line, including its end
+        const char* lineEnd = bytes;
+        while (lineEnd < end && *lineEnd != '\r' && *lineEnd != '\n') lineEnd++;
+        bool bLineEnds = lineEnd < end;
+        if (bLineEnds) lineEnd++;
+        LineDestination().append(bytes, lineEnd - bytes);
+
+        if (m_Prolog.size() > m_MaxBytes)
+        {
+            Abandon();
+            return lineEnd;
+        }
+
+        if (bLineEnds)
+        {
+            if (lineEnd[-1] == '\r')
+            {
+                m_bAfterCR = true;      // the kind of the line is kept for a LF following
+            }
+            else if (m_LineKind == LINE_END)
+            {
+                FinishProlog();
+            }
+            else
+            {
+                m_LineKind = LINE_UNDECIDED;
+            }
+        }
+        return lineEnd;
+    }
+
+    bool CUlpPrologDedup::Hash()
+    {
+        static const char hexDigits[] = "0123456789abcdef";
+
+        BCRYPT_HASH_HANDLE hashHandle = NULL;
+        UCHAR hash[PROLOGHASHSIZE];
+        bool bHashed = BCRYPT_SUCCESS(BCryptCreateHash(BCRYPT_SHA256_ALG_HANDLE, &hashHandle, NULL, 0, NULL, 0, 0));
+        if (bHashed)
+        {
+            bHashed = BCRYPT_SUCCESS(BCryptHashData(hashHandle, (PUCHAR)m_Prolog.data(), (ULONG)m_Prolog.size(), 0)) &&
+                      BCRYPT_SUCCESS(BCryptFinishHash(hashHandle, hash, sizeof(hash), 0));
+            BCryptDestroyHash(hashHandle);
+        }
+        if (!bHashed) return false;
+
+        for (DWORD i = 0; i < PROLOGHASHSIZE; i++)
+        {
+            m_HashHex[2 * i] = hexDigits[hash[i] >> 4];
+            m_HashHex[2 * i + 1] = hexDigits[hash[i] & 0x0F];
+        }
+        m_HashHex[PROLOGHASHHEXSIZE - 1] = '\0';
+        return true;
+    }
+
+    void CUlpPrologDedup::FinishProlog()
+    {
+        if (!Hash())
+        {
+            Abandon();
+            return;
+        }
+        m_State = STATE_DONE;
+        m_bKnown = std::find(m_KnownHashes.begin(), m_KnownHashes.end(), std::string(m_HashHex)) != m_KnownHashes.end();
+
+        if (m_bKnown)
+        {
+            m_Segments.push_back(PrologSegment{ PROLOGSEGMENT_REF, NULL, 0 });
+        }
+        else
+        {
+            AddBytes(m_Prolog.data(), m_Prolog.size());
+            m_Segments.push_back(PrologSegment{ PROLOGSEGMENT_HASH, NULL, 0 });
+        }
+        AddBytes(m_Marks.data(), m_Marks.size());
+    }
+
+    void CUlpPrologDedup::Abandon()
+    {
+        m_State = STATE_DONE;
+        m_bAbandoned = true;
+        AddBytes(m_Prolog.data(), m_Prolog.size());
+        AddBytes(m_Marks.data(), m_Marks.size());
+    }
+
+    const std::vector<PrologSegment>& CUlpPrologDedup::Flush()
+    {
+        m_Segments.clear();
+        if (m_State == STATE_BEFORE)
+        {
+            AddBytes(BEGINPROLOGCOMMENT, m_Matched);
+            m_Matched = 0;
+            m_State = STATE_DONE;
+        }
+        else if (m_State == STATE_COLLECTING)
+        {
+            if (m_LineKind == LINE_END && m_bAfterCR)
+            {
+                // %%EndProlog ended the stream
+                FinishProlog();
+            }
+            else
+            {
+                m_Prolog.append(m_Head);
+                m_Head.clear();
+                Abandon();
+            }
+        }
+        return m_Segments;
+    }
@@ -0,0 +1,113 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpPrologDedup.h
+//
+//  PURPOSE:   Header for the deduplication of the PostScript prolog: the prolog (the lines from %%BeginProlog up to and
+//             including %%EndProlog) is found in the stream, held back and hashed (SHA-256), a prolog the spooler
+//             already holds is replaced by a reference
+//
+
+#pragma once
+#include <windows.h>
+#include <bcrypt.h>
+#include <string>
+#include <vector>
+
+
+const DWORD PROLOGDEDUPMAXKB_DEFAULT = 4096;     // prologs longer than this are streamed as they are (HKLM PrologDedupMaxKB)
+const DWORD PROLOGHASHSIZE = 32;                 // SHA-256
+const DWORD PROLOGHASHHEXSIZE = 2 * PROLOGHASHSIZE + 1;
+
+// Proprietary DSC commands sent instead of (PrologRef) or after (PrologHash) the prolog, parameter is the hash in hex
+const char* const PROLOGREFCOMMANDNAME = "PrologRef";
+const char* const PROLOGHASHCOMMANDNAME = "PrologHash";
+
+// What is to be written to the pipe: bytes, or the PrologRef or PrologHash command (with CUlpPrologDedup::HashHex)
+enum PrologSegmentKind
+{
+    PROLOGSEGMENT_BYTES = 0,
+    PROLOGSEGMENT_REF,
+    PROLOGSEGMENT_HASH
+};
+
+typedef struct PrologSegment
+{
+    PrologSegmentKind kind;
+    const char* data;
+    DWORD length;
+} PrologSegment;
+
+
+// Filters the stream: bytes before and after the prolog pass, the prolog is held back until %%EndProlog.
+// Lines of the plugin's own marks within the prolog (they carry the driver-job-id) are neither hashed nor part of
+// the prolog, they follow it. A prolog the spooler holds becomes [PrologRef, marks], any other [prolog, PrologHash, marks].
+class CUlpPrologDedup
+{
+
+private:
+    enum State
+    {
+        STATE_BEFORE,       // looking for %%BeginProlog at line starts, bytes pass
+        STATE_COLLECTING,   // within the prolog, bytes are held back
+        STATE_DONE          // bytes pass
+    };
+
+    // Kind of the current line within the prolog
+    enum LineKind
+    {
+        LINE_UNDECIDED,     // its first bytes are still collected in m_Head
+        LINE_PROLOG,
+        LINE_MARK,          // starts with m_MarkPrefix
+        LINE_END            // %%EndProlog
+    };
+
+    // Hashes (lower case hex) the spooler declared it holds
+    std::vector<std::string> m_KnownHashes;
+    std::string m_MarkPrefix;
+    DWORD m_MaxBytes;
+
+    State m_State;
+    bool m_bLineStart;          // STATE_BEFORE: the next byte starts a line
+    size_t m_Matched;           // STATE_BEFORE: bytes of %%BeginProlog matched at the line start (held back)
+    LineKind m_LineKind;        // STATE_COLLECTING
+    bool m_bAfterCR;            // STATE_COLLECTING: the line ended with CR, a LF following it belongs to the line
+    std::string m_Head;
+
+    std::string m_Prolog;
+    std::string m_Marks;
+    bool m_bKnown;
+    bool m_bAbandoned;
+    char m_HashHex[PROLOGHASHHEXSIZE];
+
+    // Result of the current call, points into the caller's bytes, constants or m_Prolog and m_Marks
+    std::vector<PrologSegment> m_Segments;
+
+    void AddBytes(const char* data, size_t length);
+    const char* ScanBefore(const char* bytes, const char* end);
+    const char* Collect(const char* bytes, const char* end);
+    std::string& LineDestination() { return m_LineKind == LINE_MARK ? m_Marks : m_Prolog; }
+    bool Hash();
+    void FinishProlog();
+    void Abandon();
+
+public:
+
+    // knownHashes: comma or space separated hex hashes (see CUlpSpoolerPipe::KnownPrologs),
+    // markPrefix: text the plugin's marks start with (see CUlpDSCTemplate::LiteralPrefix), may be empty
+    CUlpPrologDedup(const std::string& knownHashes, DWORD maxBytes, const std::string& markPrefix);
+
+    // Returns what is to be written for the next bytes of the stream (valid until the next call)
+    const std::vector<PrologSegment>& Append(const char* bytes, DWORD count);
+
+    // At the end of the job: returns what is still held back (an unfinished prolog is written as it is)
+    const std::vector<PrologSegment>& Flush();
+
+    // True once the prolog has been passed on (or abandoned): all further bytes pass unchanged
+    bool IsDone() { return m_State == STATE_DONE; }
+
+    bool IsKnown() { return m_bKnown; }
+    bool IsAbandoned() { return m_bAbandoned; }   // too long or no hash: streamed as it is
+    const char* HashHex() { return m_HashHex; }
+    size_t PrologBytes() { return m_Prolog.size(); }
+
+};
@@ -9,25 +9,18 @@
 Spooler Interface
 -------------------------------------------------------*/
 
-void CUlpSpoolerPipe::CreatePipename(DWORD printingApplicationsProcessId)
+void CUlpSpoolerPipe::CreatePipename(long lDriverJobId)
 {
     time_t timestamp; 
     time(&timestamp);
         
-    m_PipeName = new ulpHelper::CharBuffer(100);
-    DWORD dwProcessId;
-    if (printingApplicationsProcessId != 0)
-    {
-        dwProcessId = printingApplicationsProcessId;
-    }
-    else
-    {
-        dwProcessId = GetProcessIdOfThread(GetCurrentThread());
-    }
+    m_PipeName.Reset(100);
 
-    _stprintf_s(m_PipeName->Buffer(), m_PipeName->Size(), _T("%s_%ld_%lld"), PipeNamePrefix, dwProcessId, timestamp);
+    // The driver-job-id is unique within this process, the process id among the processes alive:
+    // jobs starting in the same second get different pipes (the timestamp is kept for reading logs)
+    _stprintf_s(m_PipeName.Buffer(), m_PipeName.Size(), _T("%s_%lu_%ld_%lld"), PipeNamePrefix, GetCurrentProcessId(), lDriverJobId, timestamp);
 
-    _Log->LogVar("PipeName", m_PipeName->GetBufferAnsi());
+    _Log->LogVar("PipeName", m_PipeName.GetBufferAnsi());
 }
 
 // Initialization of the spooler process 
@@ -36,13 +29,16 @@ void CUlpSpoolerPipe::InitAndStartSpooler(long _lDriverJobId)
     int level = _Log->EnterSection("InitSpooler");
     try 
     {
-        m_SpoolerExeFullname = ulpHelper::ReadLogoPrintRegStrLog(HKEY_LOCAL_MACHINE, _T("LPSpoolerPath"), _Log);
-        if (m_SpoolerExeFullname == NULL)
+        const TCHAR* spoolerPath = _Config->SpoolerPath();
+        if (spoolerPath == NULL)
         {
+            _Log->LogLineFlush("Could not read mandatory reg-value HKLM\\SOFTWARE\\IPGM\\UniLogoPrint2\\LPSpoolerPath!");
             m_SpoolerIsDisabledDueToAnError = true;
         }
         else
         {
+            m_SpoolerExeFullname.Assign(spoolerPath, MAX_PATH * 4);
+            _Log->LogVar("LPSpoolerPath", m_SpoolerExeFullname.GetBufferAnsi());
             m_ThreadId = GetCurrentThreadId();
         
             ZeroMemory(&m_SpoolerProcessInfo, sizeof(m_SpoolerProcessInfo));
@@ -57,6 +53,11 @@ void CUlpSpoolerPipe::InitAndStartSpooler(long _lDriverJobId)
     }
     _Log->ExitSection(level);
 
+    if (m_SpoolerIsDisabledDueToAnError)
+    {
+        _Log->DumpFlightRecorder("Spooler could not be initialized");
+    }
+
 }
 
 
@@ -117,13 +118,13 @@ void CUlpSpoolerPipe::CleanResources()
         }
 
 
-        if (m_SpoolerExeFullname) 
+        if (!m_SpoolerExeFullname.View().empty()) 
         { 
             _Log->LogLine("Freeing buffers ...");
-            m_PipeName->free();
-            m_PipeName = NULL;
-            m_SpoolerExeFullname->free();
-            m_SpoolerExeFullname = NULL;
+            _Log->LogVarUL("String arena heap allocations", m_Arena.HeapAllocations());
+            m_PipeName.free();
+            m_SpoolerExeFullname.free();
+            m_Arena.Release();
             _Log->LogLine("Buffers freed!");
         }
         else 
@@ -185,7 +186,8 @@ bool CUlpSpoolerPipe::StartProcessAsCurrentUser(ulpHelper::CharBuffer* commandLi
     ZeroMemory(&startupInfo, sizeof(startupInfo));
     startupInfo.cb = sizeof(startupInfo);
     startupInfo.dwFlags = STARTF_USESHOWWINDOW;
-    if (ulpHelper::GetShowConsoleWindows(_Log))
+    _Log->LogVar("ShowConsoleWindows", _Config->ShowConsoleWindows() ? "true" : "false");
+    if (_Config->ShowConsoleWindows())
     {
         startupInfo.wShowWindow = SW_SHOWNORMAL;
     }
@@ -256,11 +258,13 @@ bool CUlpSpoolerPipe::StartSpoolerProcessAsUser(ulpHelper::CharBuffer* cmdLine)
         else
         {
             _Log->LogLastErrorMessage("!!! Spooler process couldn't be started!", true, false);
+            _Log->DumpFlightRecorder("Spooler process couldn't be started");
         }
     }
     catch (const std::exception & e)
     {
         _Log->LogError("Error in CreateProcess", e);
+        _Log->DumpFlightRecorder("Exception in CreateProcess");
     }
     _Log->ExitSection(level);
     return spoolerProcessCreated;
@@ -270,33 +274,33 @@ bool CUlpSpoolerPipe::StartSpoolerProcessAsUser(ulpHelper::CharBuffer* cmdLine)
 void CUlpSpoolerPipe::StartSpooler(long lDriverJobId)
 {
     int levelOuter = _Log->EnterSection("StartSpooler");
-    ulpHelper::CharBuffer* arguments = NULL;
-    ulpHelper::CharBuffer* cmdLine = NULL;
     try
     {
         CreatePipename(lDriverJobId);
 
         DWORD currentProcessId = GetProcessIdOfThread(GetCurrentThread());
-        arguments = new ulpHelper::CharBuffer(0x8000UL);
-        _stprintf_s(arguments->Buffer(), arguments->Size(), _T(" %s %d %d"), m_PipeName->Buffer(), currentProcessId, lDriverJobId); //Leading space is needed to get the first argument !
+        // Sized for the pipe name and two numbers, the command line for what it concatenates (both inline or from m_Arena)
+        ulpHelper::CharBuffer arguments((DWORD)m_PipeName.View().size() + 40, &m_Arena);
+        _stprintf_s(arguments.Buffer(), arguments.Size(), _T(" %s %d %d"), m_PipeName.Buffer(), currentProcessId, lDriverJobId); //Leading space is needed to get the first argument !
 
         CleanSpoolerProcessInfo();
         _Log->LogLine("Start spooler process ...");
-        _Log->LogVar("Application", m_SpoolerExeFullname->GetBufferAnsi());
-        _Log->LogVar("Arguments", arguments->GetBufferAnsi());
+        _Log->LogVar("Application", m_SpoolerExeFullname.GetBufferAnsi());
+        _Log->LogVar("Arguments", arguments.GetBufferAnsi());
 
-        cmdLine = new ulpHelper::CharBuffer(4096);
-        _tcscat_s(cmdLine->Buffer(), cmdLine->Size(), _T("\""));
-        _tcscat_s(cmdLine->Buffer(), cmdLine->Size(), m_SpoolerExeFullname->Buffer());
-        _tcscat_s(cmdLine->Buffer(), cmdLine->Size(), _T("\" "));
-        _tcscat_s(cmdLine->Buffer(), cmdLine->Size(), arguments->Buffer());
-        _Log->LogVar("CmdLine", cmdLine->GetBufferAnsi());
+        ulpHelper::CharBuffer cmdLine((DWORD)(m_SpoolerExeFullname.View().size() + arguments.View().size() + 4), &m_Arena);
+        _tcscat_s(cmdLine.Buffer(), cmdLine.Size(), _T("\""));
+        _tcscat_s(cmdLine.Buffer(), cmdLine.Size(), m_SpoolerExeFullname.Buffer());
+        _tcscat_s(cmdLine.Buffer(), cmdLine.Size(), _T("\" "));
+        _tcscat_s(cmdLine.Buffer(), cmdLine.Size(), arguments.Buffer());
+        _Log->LogVar("CmdLine", cmdLine.GetBufferAnsi());
 
-        StartSpoolerProcessAsUser(cmdLine);
+        StartSpoolerProcessAsUser(&cmdLine);
     }
     catch (const std::exception& e)
     {
         _Log->LogError("Error in StartSpooler", e);
+        _Log->DumpFlightRecorder("Exception in StartSpooler");
     }
     _Log->ExitSection(levelOuter);
 
@@ -312,7 +316,10 @@ void CUlpSpoolerPipe::Connect()
     bool accessDenied = false;
     try 
     {
-        DWORD tryToConnectTimeInSec = ulpHelper::GetIntRegHKCUHKLM(REGVALUE_ConnectTimeout, ConnectTimeoutDefault, const_cast<char*>("ConnectTimeout"), _Log);
+        DWORD tryToConnectTimeInSec = _Config->ConnectTimeout();
+        char timeoutString[100];
+        sprintf_s(timeoutString, sizeof(timeoutString), "%lu sec (%s)", tryToConnectTimeInSec, _Config->ConnectTimeoutSource());
+        _Log->LogVar("ConnectTimeout", timeoutString);
         _Log->LogLineParts(const_cast<char*>("Will try to connect ..."), NULL);
 
         clock_t ticksStart = clock();
@@ -340,6 +347,94 @@ void CUlpSpoolerPipe::Connect()
         _Log->LogError("Error in Connect", e);
     }
     _Log->ExitSection(levelConnect);
+
+    if (!isConnected)
+    {
+        _Log->DumpFlightRecorder("Could not connect to spooler");
+    }
+    else if (m_bDuplex)
+    {
+        ReadHandshake();
+    }
+}
+
+// Waits up to m_HandshakeWaitMs for the line the spooler sends after connecting (spoolers not sending one
+// just cost the wait, all marks are injected then)
+void CUlpSpoolerPipe::ReadHandshake()
+{
+    char line[SPOOLERHANDSHAKEMAXSIZE];
+    DWORD length = 0;
+    bool isComplete = false;
+    ULONGLONG deadline = GetTickCount64() + m_HandshakeWaitMs;
+
+    try
+    {
+        while (!isComplete && length < sizeof(line) - 1)
+        {
+            DWORD available = 0;
+            if (!PeekNamedPipe(m_PipeHandle, NULL, 0, NULL, &available, NULL))
+            {
+                _Log->LogLastErrorMessage("!!! Error peeking spooler handshake", true, false);
+                break;
+            }
+            if (available == 0)
+            {
+                if (GetTickCount64() >= deadline) break;
+                Sleep(5);
+                continue;
+            }
+
+            DWORD bytesRead = 0;
+            DWORD bytesToRead = __min(available, (DWORD)sizeof(line) - 1 - length);
+            if (!ReadFile(m_PipeHandle, line + length, bytesToRead, &bytesRead, NULL) || bytesRead == 0) break;
+            length += bytesRead;
+            isComplete = memchr(line, '\n', length) != NULL;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        _Log->LogError("Error in ReadHandshake", e);
+    }
+
+    line[length] = '\0';
+    char* lineEnd = strpbrk(line, "\r\n");
+    if (lineEnd != NULL) *lineEnd = '\0';
+
+    bool hasMarkers = false;
+    if (isComplete)
+    {
+        // Trailing blank: a keyword at the end of the line (empty section) is found as well
+        std::string handshake = std::string(line) + " ";
+        m_MarkerInterest = HandshakeSection(handshake, SPOOLERHANDSHAKE_MARKERS, &hasMarkers);
+        m_KnownPrologs = HandshakeSection(handshake, SPOOLERHANDSHAKE_PROLOGS, &m_bPrologDedup);
+    }
+
+    if (hasMarkers)
+    {
+        _Log->LogVar("Spooler marker interest", m_MarkerInterest.c_str());
+    }
+    else
+    {
+        _Log->LogLine("No marker interest declared by the spooler -> all marks are injected");
+    }
+    if (m_bPrologDedup)
+    {
+        _Log->LogVar("Spooler known prologs", m_KnownPrologs.c_str());
+    }
+}
+
+std::string CUlpSpoolerPipe::HandshakeSection(const std::string& line, const char* keyword, bool* found)
+{
+    *found = false;
+    size_t keywordLength = strlen(keyword);
+    size_t start = line.compare(0, keywordLength, keyword) == 0 ? 0 : line.find(std::string(" ") + keyword);
+    if (start == std::string::npos) return std::string();
+    if (start > 0) start++;
+
+    *found = true;
+    start += keywordLength;
+    size_t end = line.find(" ULP", start);
+    return line.substr(start, end == std::string::npos ? std::string::npos : end - start);
 }
 
 
@@ -351,8 +446,16 @@ bool CUlpSpoolerPipe::TryConnect(bool *accessDenied)
     {
         DWORD dwFlags = 0; //  FILE_FLAG_OVERLAPPED
         _Log->LogLineParts("Trying to open the pipe (", _Log->INSERTTIME, ") ...", NULL);
-        m_PipeHandle = CreateFile(m_PipeName->Buffer(), GENERIC_WRITE, 0, NULL,
+        m_PipeHandle = CreateFile(m_PipeName.Buffer(), m_bDuplex ? GENERIC_READ | GENERIC_WRITE : GENERIC_WRITE, 0, NULL,
                                     CREATE_ALWAYS, dwFlags, NULL);
+        if (m_PipeHandle == INVALID_HANDLE_VALUE && m_bDuplex && GetLastError() == ERROR_ACCESS_DENIED)
+        {
+            // Spooler created an inbound-only pipe: it cannot send a handshake
+            _Log->LogLine("Pipe cannot be opened for reading -> no spooler handshake");
+            m_bDuplex = false;
+            m_PipeHandle = CreateFile(m_PipeName.Buffer(), GENERIC_WRITE, 0, NULL,
+                                        CREATE_ALWAYS, dwFlags, NULL);
+        }
 
         //could not create handle - server probably not running
         if (m_PipeHandle != INVALID_HANDLE_VALUE)
@@ -14,6 +14,13 @@
 #include <ctime>
 #include "CUlpLog.h"
 #include "ulpHelperUsingLog.h"
+#include "CUlpConfig.h"
+#include <string>
+
+const DWORD SPOOLERHANDSHAKEMAXSIZE = 4096;     // maximum length of the line the spooler sends after connecting
+// Sections of the line the spooler sends after connecting, each one starting with its keyword and ending at the next " ULP"
+const char* const SPOOLERHANDSHAKE_MARKERS = "ULPMARKERS ";  // marks the spooler needs
+const char* const SPOOLERHANDSHAKE_PROLOGS = "ULPPROLOGS ";  // SHA-256 (hex) of the prologs the spooler holds (may be empty)
 
 
 class CUlpSpoolerPipe
@@ -22,13 +29,17 @@ class CUlpSpoolerPipe
 private:
     // Prefix used to build pipename for communication with ULPSPooler 
     const TCHAR* PipeNamePrefix = _T("\\\\.\\pipe\\UniLogoPrintSpooler");
-    const LPCTSTR REGVALUE_ConnectTimeout = _T("ConnectTimeout");
 
-    ulpHelper::CharBuffer* m_PipeName;
+    // Strings of the job too long for a CharBuffer's inline storage (released in CleanResources)
+    ulpHelper::CharArena m_Arena;
+
+    ulpHelper::CharBuffer m_PipeName{ &m_Arena };
 
     CUlpLog* _Log;
 
-    const DWORD ConnectTimeoutDefault = 30; // Default timeout (in seconds) for connecting to LPSpooler
+    // Settings snapshot of the job (not owned)
+    const CUlpConfig* _Config;
+
     const DWORD ConnectTryMaxCount = 2;
 
     DWORD m_ThreadId;
@@ -36,10 +47,21 @@ private:
     //Vars to be released/freed
     PROCESS_INFORMATION m_SpoolerProcessInfo;
 
-    ulpHelper::CharBuffer* m_SpoolerExeFullname;
+    ulpHelper::CharBuffer m_SpoolerExeFullname{ &m_Arena };
 
     HANDLE m_PipeHandle;
 
+    // The pipe is opened for reading as well to receive the spooler's handshake (see HKLM-LogoPrint2-Key MarkerInterestWaitMs)
+    bool m_bDuplex;
+    DWORD m_HandshakeWaitMs;
+
+    // Marks declared by the spooler after connecting (text after SPOOLERHANDSHAKE_MARKERS), empty if none
+    std::string m_MarkerInterest;
+
+    // Prologs held by the spooler (text after SPOOLERHANDSHAKE_PROLOGS), m_bPrologDedup if the section was sent at all
+    std::string m_KnownPrologs;
+    bool m_bPrologDedup;
+
     bool StartProcessAsCurrentUser(ulpHelper::CharBuffer* commandLine);
     //void StartSpoolerProcessAsUser(bool& spoolerProcessCreated, ulpHelper::CharBuffer* cmdLine);
     bool StartSpoolerProcessAsUser(ulpHelper::CharBuffer* cmdLine);
@@ -52,7 +74,14 @@ private:
     void Connect();
     bool TryConnect(bool* accessDenied);
 
-    void CreatePipename(DWORD printingApplicationsProcessId);
+    // Waits up to m_HandshakeWaitMs for the line the spooler sends after connecting
+    void ReadHandshake();
+
+    // Returns the text of the section starting with keyword (see SPOOLERHANDSHAKE_*), *found = false if there is none
+    static std::string HandshakeSection(const std::string& line, const char* keyword, bool* found);
+
+    // Pipe name from process id and driver-job-id (see CUlpCommandHandler::CreateDriverJobId)
+    void CreatePipename(long lDriverJobId);
     void InitAndStartSpooler(long _lDriverJobId);
 
     void CleanSpoolerResources();
@@ -62,9 +91,13 @@ private:
 
 public:  
     
-    CUlpSpoolerPipe(long _lDriverJobId, CUlpLog* log)
+    CUlpSpoolerPipe(long _lDriverJobId, CUlpLog* log, const CUlpConfig* config)
     {
         _Log = log;
+        _Config = config;
+        m_HandshakeWaitMs = config->GetInt(HKEY_LOCAL_MACHINE, _T("MarkerInterestWaitMs"), 0);
+        m_bPrologDedup = false;
+        m_bDuplex = m_HandshakeWaitMs > 0;
         InitAndStartSpooler(_lDriverJobId);
     }
 
@@ -74,4 +107,12 @@ public:
     }
 
     DWORD WriteToSpoolerPipe(const char* buffer, DWORD bytesToWrite, DWORD* _dwWritePipeLastError);
+
+    // Injection points the spooler declared it needs marks for (comma or space separated names or numbers),
+    // empty if the spooler did not declare any (all marks are needed)
+    const std::string& MarkerInterest() const { return m_MarkerInterest; }
+
+    // True if the spooler takes prolog references, KnownPrologs() are the hashes (comma or space separated) it holds
+    bool SupportsPrologDedup() const { return m_bPrologDedup; }
+    const std::string& KnownPrologs() const { return m_KnownPrologs; }
 };
\ No newline at end of file
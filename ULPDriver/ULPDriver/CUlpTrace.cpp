@@ -0,0 +1,86 @@
+#include <Windows.h>
+#include "CUlpTrace.h"
+
+
+
+    CUlpTrace::CUlpTrace(const char* fileName)
+    {
+        m_bFirstEvent = true;
+        m_ProcessId = GetCurrentProcessId();
+        try
+        {
+            m_Trace.open(fileName, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+            if (m_Trace.is_open())
+            {
+                m_Trace << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+            }
+        }
+        catch (...) {}
+    }
+
+    CUlpTrace::~CUlpTrace(void)
+    {
+        try
+        {
+            if (m_Trace.is_open())
+            {
+                m_Trace << "\n]}\n";
+                m_Trace.flush();
+                m_Trace.close();
+            }
+        }
+        catch (...) {}
+    }
+
+    long long CUlpTrace::NowMicroseconds()
+    {
+        static LARGE_INTEGER frequency = []() {
+            LARGE_INTEGER f;
+            QueryPerformanceFrequency(&f);
+            return f;
+        }();
+
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        return (counter.QuadPart / frequency.QuadPart) * 1000000LL
+             + (counter.QuadPart % frequency.QuadPart) * 1000000LL / frequency.QuadPart;
+    }
+
+    void CUlpTrace::WriteEscaped(const char* text)
+    {
+        if (text == NULL) text = "???";
+        for (const char* c = text; *c != '\0'; c++)
+        {
+            if (*c == '"' || *c == '\\')
+            {
+                m_Trace << '\\' << *c;
+            }
+            else if ((unsigned char)*c >= 0x20)
+            {
+                m_Trace << *c;
+            }
+        }
+    }
+
+    void CUlpTrace::Complete(const char* name, const char* category, long long startUs, long long durationUs, long long bytes)
+    {
+        if (!m_Trace.is_open()) return;
+        std::unique_lock<std::mutex> ul(mutex_);
+        try
+        {
+            m_Trace << (m_bFirstEvent ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+            m_bFirstEvent = false;
+            WriteEscaped(name);
+            m_Trace << "\",\"cat\":\"";
+            WriteEscaped(category);
+            m_Trace << "\",\"ph\":\"X\",\"ts\":" << startUs << ",\"dur\":" << (durationUs > 0 ? durationUs : 0)
+                    << ",\"pid\":" << m_ProcessId << ",\"tid\":" << GetCurrentThreadId();
+            if (bytes >= 0)
+            {
+                m_Trace << ",\"args\":{\"bytes\":" << bytes << "}";
+            }
+            m_Trace << "}";
+        }
+        catch (...) {}
+        ul.unlock();
+    }
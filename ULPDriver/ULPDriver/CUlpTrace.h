@@ -0,0 +1,76 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      CUlpTrace.h
+//
+//  PURPOSE:   Header for an optional trace sink writing spans as Chrome trace-event JSON
+//             (can be opened in chrome://tracing or ui.perfetto.dev)
+//
+
+#pragma once
+#include <windows.h>
+#include <fstream>
+#include <mutex>
+
+
+class CUlpTrace
+{
+
+private:
+    std::mutex mutex_;
+    std::ofstream m_Trace;  // To be freed
+
+    bool m_bFirstEvent;
+    DWORD m_ProcessId;
+
+    void WriteEscaped(const char* text);
+
+public:
+
+    CUlpTrace(const char* fileName);
+    ~CUlpTrace(void);
+
+    bool IsOpen() { return m_Trace.is_open(); }
+
+    // Current time in microseconds (QueryPerformanceCounter based)
+    static long long NowMicroseconds();
+
+    // Writes a complete event ("ph":"X") for the calling thread.
+    // bytes is written as argument of the event, if it is not negative.
+    void Complete(const char* name, const char* category, long long startUs, long long durationUs, long long bytes);
+
+};
+
+
+// Writes a complete event for its own lifetime to trace (if trace is not NULL)
+class CUlpTraceSpan
+{
+
+private:
+    CUlpTrace* _Trace;
+    const char* _Name;
+    const char* _Category;
+    long long _Bytes;
+    long long _StartUs;
+
+public:
+
+    CUlpTraceSpan(CUlpTrace* trace, const char* name, const char* category, long long bytes)
+    {
+        _Trace = trace;
+        _Name = name;
+        _Category = category;
+        _Bytes = bytes;
+        _StartUs = trace != NULL ? CUlpTrace::NowMicroseconds() : 0;
+    }
+
+    ~CUlpTraceSpan(void)
+    {
+        if (_Trace != NULL)
+        {
+            _Trace->Complete(_Name, _Category, _StartUs, CUlpTrace::NowMicroseconds() - _StartUs, _Bytes);
+        }
+    }
+
+    CUlpTraceSpan(const CUlpTraceSpan&) = delete;
+    CUlpTraceSpan& operator=(const CUlpTraceSpan&) = delete;
+};
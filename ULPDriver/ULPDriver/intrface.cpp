@@ -265,7 +265,6 @@ HRESULT __stdcall IULPDriverPS::EnablePDEV(
 {
     VERBOSE(DLLTEXT("IULPDriverPS::EnablePDEV() entry.\r\n"));
 
-    UNREFERENCED_PARAMETER(pdevobj);
     UNREFERENCED_PARAMETER(pPrinterName);
     UNREFERENCED_PARAMETER(cPatterns);
     UNREFERENCED_PARAMETER(phsurfPatterns);
@@ -276,7 +275,9 @@ HRESULT __stdcall IULPDriverPS::EnablePDEV(
     UNREFERENCED_PARAMETER(pded);
     //UNREFERENCED_PARAMETER(pDevOem);
 
-    POEMPDEV pOemPDEV = new COemPDEV(pPrinterName);
+    // The private DEVMODE carries the per-printer tuning
+    PCOEMDEV pOemDevmode = pdevobj != NULL ? static_cast<PCOEMDEV>(pdevobj->pOEMDM) : NULL;
+    POEMPDEV pOemPDEV = new COemPDEV(pPrinterName, pOemDevmode);
 
     if (NULL == pOemPDEV)
     {
@@ -353,7 +354,15 @@ HRESULT __stdcall IULPDriverPS::Command(
         POEMPDEV pOemDev = (POEMPDEV)pdevobj->pdevOEM;
         if (pOemDev != NULL) {
             PULPCOMMANDHANDLER pUlpCommandHandler = pOemDev->GetCommandHandler();
-            hResult = pUlpCommandHandler->ULPCommandInject(pdevobj, dwIndex, pData, cbSize, m_pOEMHelp, pdwResult);
+            try
+            {
+                hResult = pUlpCommandHandler->ULPCommandInject(pdevobj, dwIndex, pData, cbSize, m_pOEMHelp, pdwResult);
+            }
+            catch (const std::exception& e)
+            {
+                pUlpCommandHandler->OnUnhandledException("ULPCommandInject", e);
+                hResult = E_FAIL;
+            }
         }
     }
     return hResult;
@@ -377,7 +386,15 @@ HRESULT __stdcall IULPDriverPS::WritePrinter(PDEVOBJ    pdevobj,
             POEMPDEV pOemDev = (POEMPDEV)pdevobj->pdevOEM;
             if (pOemDev != NULL) {
                 PULPCOMMANDHANDLER pUlpCommandHandler = pOemDev->GetCommandHandler();
-                hResult = pUlpCommandHandler->ULPWritePrinter(pdevobj, pBuf, cbBuffer, pcbWritten);
+                try
+                {
+                    hResult = pUlpCommandHandler->ULPWritePrinter(pdevobj, pBuf, cbBuffer, pcbWritten);
+                }
+                catch (const std::exception& e)
+                {
+                    pUlpCommandHandler->OnUnhandledException("ULPWritePrinter", e);
+                    hResult = E_FAIL;
+                }
             }
         }
     }
@@ -1,56 +1,174 @@
+#include <new>
 #include "ulpCharBuffer.h"
 
 namespace ulpHelper
 {
 
+    CharArena::CharArena()
+    {
+        m_Current = m_Inline;
+        m_Used = 0;
+        m_Capacity = sizeof(m_Inline);
+        m_Blocks = NULL;
+        m_HeapAllocations = 0;
+    }
+
+    CharArena::~CharArena()
+    {
+        Release();
+    }
+
+    void* CharArena::Allocate(size_t bytes)
+    {
+        bytes = (bytes + 7) & ~(size_t)7;
+        if (m_Used + bytes > m_Capacity)
+        {
+            // The block header is followed by the memory served, taken from the heap once per block
+            size_t headerSize = (sizeof(Block) + 7) & ~(size_t)7;
+            size_t capacity = bytes > CHARARENABLOCKSIZE ? bytes : CHARARENABLOCKSIZE;
+            Block* block = reinterpret_cast<Block*>(new BYTE[headerSize + capacity]);
+            block->next = m_Blocks;
+            m_Blocks = block;
+            m_HeapAllocations++;
+
+            m_Current = reinterpret_cast<BYTE*>(block) + headerSize;
+            m_Used = 0;
+            m_Capacity = capacity;
+        }
+        void* result = m_Current + m_Used;
+        m_Used += bytes;
+        ZeroMemory(result, bytes);
+        return result;
+    }
+
+    void CharArena::Release()
+    {
+        while (m_Blocks != NULL)
+        {
+            Block* next = m_Blocks->next;
+            delete[] reinterpret_cast<BYTE*>(m_Blocks);
+            m_Blocks = next;
+        }
+        m_Current = m_Inline;
+        m_Used = 0;
+        m_Capacity = sizeof(m_Inline);
+    }
+
+
     void CharBuffer::SetBuffer(size_t textLength)
     {
+        free();
         m_Size = textLength;
-        m_Buffer = new TCHAR[textLength + 1];
         m_bufferSize = (textLength + 1) * sizeof(*m_Buffer);
-        ZeroMemory(m_Buffer, m_bufferSize);
-        m_bufferAnsi = NULL;
-        m_bufferUnicode = NULL;
+        if (textLength < CHARBUFFERINLINECHARS)
+        {
+            m_Buffer = m_Inline;
+            m_bufferConverted = m_InlineConverted;
+            ZeroMemory(m_Buffer, m_bufferSize);
+        }
+        else
+        {
+            // Text and its conversion share one allocation, the conversion starts aligned for its char type
+            size_t textBytes = (m_bufferSize + sizeof(CONVERTEDCHAR) - 1) / sizeof(CONVERTEDCHAR) * sizeof(CONVERTEDCHAR);
+            size_t storageSize = textBytes + (textLength + 1) * sizeof(CONVERTEDCHAR);
+            BYTE* storage;
+            if (m_Arena != NULL)
+            {
+                storage = static_cast<BYTE*>(m_Arena->Allocate(storageSize));
+            }
+            else
+            {
+                m_HeapStorage = new BYTE[storageSize];
+                storage = m_HeapStorage;
+                ZeroMemory(storage, storageSize);
+            }
+            m_Buffer = reinterpret_cast<TCHAR*>(storage);
+            m_bufferConverted = reinterpret_cast<CONVERTEDCHAR*>(storage + textBytes);
+        }
+        m_bIsConverted = false;
+    }
+
+    void CharBuffer::Convert()
+    {
+        if (!m_bIsConverted)
+        {
+            size_t charsConverted;
+#ifdef UNICODE
+            wcstombs_s(&charsConverted, m_bufferConverted, m_Size + 1, m_Buffer, _TRUNCATE);
+#else
+            mbstowcs_s(&charsConverted, m_bufferConverted, m_Size + 1, m_Buffer, _TRUNCATE);
+#endif // !UNICODE
+            m_bIsConverted = true;
+        }
     }
 
     TCHAR* CharBuffer::Buffer() { return m_Buffer; }
     size_t CharBuffer::Size() { return m_Size; }    // text-length = character count in Buffer without terminating null char
 
-    CharBuffer::CharBuffer(DWORD textLength)
+    CharBuffer::CharBuffer(CharArena* arena)
+    {
+        m_Arena = arena;
+        m_HeapStorage = NULL;
+        SetBuffer(0);
+    }
+
+    CharBuffer::CharBuffer(DWORD textLength, CharArena* arena)
+    {
+        m_Arena = arena;
+        m_HeapStorage = NULL;
+        SetBuffer(textLength);
+    }
+
+    CharBuffer::CharBuffer(const TCHAR* text, DWORD maxsize, CharArena* arena)
+    {
+        m_Arena = arena;
+        m_HeapStorage = NULL;
+        SetBuffer(0);
+        Assign(text, maxsize);
+    }
+
+    void CharBuffer::Reset(DWORD textLength)
     {
         SetBuffer(textLength);
     }
 
-    CharBuffer::CharBuffer(const TCHAR* text, DWORD maxsize)
+    void CharBuffer::Assign(const TCHAR* text, DWORD maxsize)
     {
-        size_t textLength = _tcsnlen(text, maxsize);
+        size_t textLength = text != NULL ? _tcsnlen(text, maxsize) : maxsize;
         if (textLength < maxsize)
         {
             SetBuffer(textLength);
-            _tcscpy_s(m_Buffer, m_bufferSize, text);
+            _tcscpy_s(m_Buffer, m_Size + 1, text);
         }
         else
         {
             SetBuffer(0);
         }
-        m_bufferAnsi = NULL;
-        m_bufferUnicode = NULL;
+    }
+
+    std::basic_string_view<TCHAR> CharBuffer::View() const
+    {
+        return std::basic_string_view<TCHAR>(m_Buffer, _tcsnlen(m_Buffer, m_Size));
+    }
+
+    std::string_view CharBuffer::ViewAnsi()
+    {
+        CHAR* buffer = GetBufferAnsi();
+        return std::string_view(buffer, strnlen(buffer, m_Size));
+    }
+
+    std::wstring_view CharBuffer::ViewUnicode()
+    {
+        WCHAR* buffer = GetBufferUnicode();
+        return std::wstring_view(buffer, wcsnlen(buffer, m_Size));
     }
 
     CHAR* CharBuffer::GetBufferAnsi()
     {
 
 #ifdef UNICODE
-        if (m_bufferAnsi == NULL)
-        {
-            m_bufferAnsi = new CHAR[m_Size + 1];
-            size_t m_bufferAnsiSize = (m_Size + 1) * sizeof(*m_bufferAnsi);
-            ZeroMemory(m_bufferAnsi, m_bufferAnsiSize);
-
-            size_t charsConverted;
-            wcstombs_s(&charsConverted, m_bufferAnsi, m_bufferAnsiSize, m_Buffer, m_bufferSize);
-        }
-        return m_bufferAnsi;
+        Convert();
+        return m_bufferConverted;
 #else
         return m_Buffer;
 
@@ -64,18 +182,8 @@ namespace ulpHelper
 #ifdef UNICODE
         return m_Buffer;
 #else
-        if (m_bufferUnicode == NULL)
-        {
-            m_bufferUnicode = new WCHAR[m_Size + 1];
-            size_t bufferSizeInBytes = (m_Size + 1) * sizeof(*m_bufferUnicode);
-            size_t bufferSizeInWords = bufferSizeInBytes / 2;
-            ZeroMemory(m_bufferUnicode, bufferSizeInBytes);
-
-            size_t charsConverted;
-
-            mbstowcs_s(&charsConverted, m_bufferUnicode, bufferSizeInWords, m_Buffer, m_bufferSize);
-        }
-        return m_bufferUnicode;
+        Convert();
+        return m_bufferConverted;
 #endif // !UNICODE
     }
 
@@ -85,23 +193,21 @@ namespace ulpHelper
         free();
     }
 
+    // Frees heap storage, the buffer is empty afterwards (arena storage is released with the arena)
     void CharBuffer::free()
     {
-        if (m_Buffer) 
-        {
-            delete[] m_Buffer;
-            m_Buffer = NULL;
-        }
-        if (m_bufferAnsi)
-        {
-            delete[] m_bufferAnsi;
-            m_bufferAnsi = NULL;
-        }
-        if (m_bufferUnicode)
+        if (m_HeapStorage)
         {
-            delete[] m_bufferUnicode;
-            m_bufferUnicode = NULL;
+            delete[] m_HeapStorage;
+            m_HeapStorage = NULL;
         }
+        m_Size = 0;
+        m_bufferSize = sizeof(*m_Buffer);
+        m_Buffer = m_Inline;
+        m_bufferConverted = m_InlineConverted;
+        m_Inline[0] = 0;
+        m_InlineConverted[0] = 0;
+        m_bIsConverted = false;
     }
 
 }
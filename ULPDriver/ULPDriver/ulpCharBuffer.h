@@ -1,24 +1,84 @@
 #include <Windows.h>
 #include <tchar.h>
-#include <tchar.h>
 #include <string>
+#include <string_view>
 
 #ifndef CHARBUFFER_H
 #define CHARBUFFER_H
 
 namespace ulpHelper
 {
+
+    // Bytes a CharArena serves before it takes memory from the heap, and size of the blocks it takes then
+    const size_t CHARARENAINLINESIZE = 4096;
+    const size_t CHARARENABLOCKSIZE = 16384;
+
+    // Characters (including the terminating null) a CharBuffer holds without an arena or the heap
+    const size_t CHARBUFFERINLINECHARS = 128;
+
+
+    // Bump allocator for the strings of a job, everything allocated is released at once by Release() or the destructor
+    class CharArena
+    {
+
+    private:
+        typedef struct Block
+        {
+            Block* next;
+        } Block;
+
+        alignas(8) BYTE m_Inline[CHARARENAINLINESIZE];
+        BYTE* m_Current;
+        size_t m_Used;
+        size_t m_Capacity;
+        Block* m_Blocks;
+        DWORD m_HeapAllocations;
+
+    public:
+
+        CharArena();
+        ~CharArena();
+        CharArena(const CharArena&) = delete;
+        CharArena& operator=(const CharArena&) = delete;
+
+        // Returns bytes of zeroed memory aligned to 8 (throws std::bad_alloc like new)
+        void* Allocate(size_t bytes);
+
+        // Frees all blocks taken from the heap, memory allocated before must not be used anymore
+        void Release();
+
+        // Number of blocks taken from the heap since construction
+        DWORD HeapAllocations() const { return m_HeapAllocations; }
+
+    };
+
+
     class CharBuffer
     {
 
     private:
+        // Width Buffer() is converted to by GetBufferAnsi / GetBufferUnicode
+#ifdef UNICODE
+        typedef CHAR CONVERTEDCHAR;
+#else
+        typedef WCHAR CONVERTEDCHAR;
+#endif
+
         TCHAR* m_Buffer;
-        CHAR* m_bufferAnsi;
-        WCHAR* m_bufferUnicode;
+        CONVERTEDCHAR* m_bufferConverted;   // allocated together with m_Buffer, filled on first use
+        bool m_bIsConverted;
         rsize_t m_bufferSize;
         size_t  m_Size;
 
+        // Arena long texts are allocated from (not owned), heap if NULL
+        CharArena* m_Arena;
+        BYTE* m_HeapStorage;
+
+        TCHAR m_Inline[CHARBUFFERINLINECHARS];
+        CONVERTEDCHAR m_InlineConverted[CHARBUFFERINLINECHARS];
+
         void SetBuffer(size_t textLength);
+        void Convert();
 
 
     public:
@@ -26,8 +86,22 @@ namespace ulpHelper
         TCHAR* Buffer();
         size_t Size();    // text-length = character count in Buffer without terminating null char
 
-        CharBuffer(DWORD textLength);
-        CharBuffer(const TCHAR* text, DWORD maxsize);
+        // Empty buffer, use Reset or Assign to fill it
+        CharBuffer(CharArena* arena = NULL);
+        CharBuffer(DWORD textLength, CharArena* arena = NULL);
+        CharBuffer(const TCHAR* text, DWORD maxsize, CharArena* arena = NULL);
+        CharBuffer(const CharBuffer&) = delete;
+        CharBuffer& operator=(const CharBuffer&) = delete;
+
+        // Replaces the content by textLength null chars (resp. a copy of text, empty if text is not null-terminated within maxsize)
+        void Reset(DWORD textLength);
+        void Assign(const TCHAR* text, DWORD maxsize);
+
+        // Text up to the terminating null char. The conversions are made once: writing to Buffer() after
+        // calling them requires Reset or Assign
+        std::basic_string_view<TCHAR> View() const;
+        std::string_view ViewAnsi();
+        std::wstring_view ViewUnicode();
 
         CHAR* GetBufferAnsi();
         WCHAR* GetBufferUnicode();
@@ -39,4 +113,4 @@ namespace ulpHelper
 }
 
 
-#endif
\ No newline at end of file
+#endif
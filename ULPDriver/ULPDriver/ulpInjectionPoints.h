@@ -0,0 +1,85 @@
+//  Copyright  UniCredit S.p.A.
+//
+//  FILE:      ulpInjectionPoints.h
+//
+//  PURPOSE:   Read-only table describing the PScript5 injection points (PSINJECT_* of PRINTOEM.H)
+//             shared by all command handlers
+//
+#pragma once
+
+#include <windows.h>
+#include <array>
+
+const int MAXCOMMAND = 201;
+
+
+namespace ulpInjectionPoints
+{
+
+    typedef struct InjectionPoint
+    {
+        // Name used in the proprietary DSC comment marking the injection point, NULL for unknown indices
+        const char* name;
+        size_t nameLength;
+
+        // false: PScript5 would replace its own postscript with the plugin's one, which is not supported
+        bool bIsInject;
+
+        // Page level injection points are logged for sampled pages only
+        bool bIsPageLevel;
+    } InjectionPoint;
+
+
+#define ULP_INJECTIONPOINT(id, isInject) \
+        points[id] = InjectionPoint{ #id, sizeof(#id) - 1, isInject, id >= PSINJECT_PAGENUMBER }
+
+    constexpr std::array<InjectionPoint, MAXCOMMAND + 1> MakeInjectionPoints()
+    {
+        std::array<InjectionPoint, MAXCOMMAND + 1> points{};
+        ULP_INJECTIONPOINT(PSINJECT_BEGINSTREAM, true);
+        ULP_INJECTIONPOINT(PSINJECT_PSADOBE, true);
+        ULP_INJECTIONPOINT(PSINJECT_PAGESATEND, false);
+        ULP_INJECTIONPOINT(PSINJECT_PAGES, false);
+        ULP_INJECTIONPOINT(PSINJECT_DOCNEEDEDRES, true);
+        ULP_INJECTIONPOINT(PSINJECT_DOCSUPPLIEDRES, true);
+        ULP_INJECTIONPOINT(PSINJECT_PAGEORDER, false);
+        ULP_INJECTIONPOINT(PSINJECT_ORIENTATION, false);
+        ULP_INJECTIONPOINT(PSINJECT_BOUNDINGBOX, false);
+        ULP_INJECTIONPOINT(PSINJECT_DOCUMENTPROCESSCOLORS, false);
+        ULP_INJECTIONPOINT(PSINJECT_COMMENTS, true);
+        ULP_INJECTIONPOINT(PSINJECT_BEGINDEFAULTS, true);
+        ULP_INJECTIONPOINT(PSINJECT_ENDDEFAULTS, true);
+        ULP_INJECTIONPOINT(PSINJECT_BEGINPROLOG, true);
+        ULP_INJECTIONPOINT(PSINJECT_ENDPROLOG, true);
+        ULP_INJECTIONPOINT(PSINJECT_BEGINSETUP, true);
+        ULP_INJECTIONPOINT(PSINJECT_ENDSETUP, true);
+        ULP_INJECTIONPOINT(PSINJECT_TRAILER, true);
+        ULP_INJECTIONPOINT(PSINJECT_EOF, true);
+        ULP_INJECTIONPOINT(PSINJECT_ENDSTREAM, true);
+        ULP_INJECTIONPOINT(PSINJECT_DOCUMENTPROCESSCOLORSATEND, false);
+        ULP_INJECTIONPOINT(PSINJECT_PAGENUMBER, false);
+        ULP_INJECTIONPOINT(PSINJECT_BEGINPAGESETUP, true);
+        ULP_INJECTIONPOINT(PSINJECT_ENDPAGESETUP, true);
+        ULP_INJECTIONPOINT(PSINJECT_PAGETRAILER, true);
+        ULP_INJECTIONPOINT(PSINJECT_PLATECOLOR, false);
+        ULP_INJECTIONPOINT(PSINJECT_SHOWPAGE, false);
+        ULP_INJECTIONPOINT(PSINJECT_PAGEBBOX, false);
+        ULP_INJECTIONPOINT(PSINJECT_ENDPAGECOMMENTS, true);
+        ULP_INJECTIONPOINT(PSINJECT_VMSAVE, true);
+        ULP_INJECTIONPOINT(PSINJECT_VMRESTORE, true);
+        return points;
+    }
+
+#undef ULP_INJECTIONPOINT
+
+    inline constexpr std::array<InjectionPoint, MAXCOMMAND + 1> INJECTIONPOINTS = MakeInjectionPoints();
+
+    static_assert(INJECTIONPOINTS[0].name == nullptr, "index 0 must stay unused (returned for out-of-range indices)");
+
+    // Descriptor of dwIndex (the unused entry 0 for indices out of range)
+    inline const InjectionPoint& Get(DWORD dwIndex)
+    {
+        return INJECTIONPOINTS[dwIndex <= (DWORD)MAXCOMMAND ? dwIndex : 0];
+    }
+
+}
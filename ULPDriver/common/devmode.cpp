@@ -13,7 +13,7 @@
 //
 //  COMMENT:   No (substantial) modification by UniLogoPrint 2,
 //             but removed ui related code (no property pages supported) 
-//             and some fields in OEMDEV
+//             and some fields in OEMDEV, added per-printer tuning fields (OEM_VERSION 2)
 //
 
 // This file is wrapped in fdevmode.cpp in other parts of the watermark sample.
@@ -51,10 +51,12 @@ HRESULT hrOEMDevMode(DWORD dwMode, POEMDMPARAM pOemDMParam)
             pOEMDevOut->dmOEMExtra.dwSize = sizeof(OEMDEV);
             pOEMDevOut->dmOEMExtra.dwSignature = OEM_SIGNATURE;
             pOEMDevOut->dmOEMExtra.dwVersion = OEM_VERSION;
+            SetOEMDevmodeDefaults(pOEMDevOut);
             break;
 
         case OEMDM_CONVERT:
             ConvertOEMDevmode(pOEMDevIn, pOEMDevOut);
+            MakeOEMDevmodeValid(pOEMDevOut);
             break;
 
         case OEMDM_MERGE:
@@ -98,6 +100,7 @@ BOOL ConvertOEMDevmode(PCOEMDEV pOEMDevIn, POEMDEV pOEMDevOut)
 
         // Set the devmode defaults so that anything the isn't copied over will
         // be set to the default value.
+        SetOEMDevmodeDefaults(pOEMDevOut);
 
         // Copy the old structure in to the new using which ever size is the smaller.
         // Devmode maybe from newer Devmode (not likely since there is only one), or
@@ -107,7 +110,8 @@ BOOL ConvertOEMDevmode(PCOEMDEV pOEMDevIn, POEMDEV pOEMDevOut)
         // DESIGN ASSUMPTION: the private DEVMODE structure only gets added to;
         // the fields that are in the DEVMODE never change only new fields get added to the end.
 
-        memcpy(pOEMDevOut, pOEMDevIn, __min(pOEMDevOut->dmOEMExtra.dwSize, pOEMDevIn->dmOEMExtra.dwSize));
+        // A version 1 DEVMODE holds the header only -> the tuning fields keep their defaults.
+        memcpy(pOEMDevOut, pOEMDevIn, __min(sizeof(OEMDEV), pOEMDevIn->dmOEMExtra.dwSize));
 
         // Re-fill in the size and version fields to indicated 
         // that the DEVMODE is the current private DEVMODE version.
@@ -122,6 +126,7 @@ BOOL ConvertOEMDevmode(PCOEMDEV pOEMDevIn, POEMDEV pOEMDevOut)
         pOEMDevOut->dmOEMExtra.dwSize       = sizeof(OEMDEV);
         pOEMDevOut->dmOEMExtra.dwSignature  = OEM_SIGNATURE;
         pOEMDevOut->dmOEMExtra.dwVersion    = OEM_VERSION;
+        SetOEMDevmodeDefaults(pOEMDevOut);
     }
 
     return SUCCEEDED(hCopy);
@@ -142,10 +147,51 @@ BOOL MakeOEMDevmodeValid(POEMDEV pOEMDevmode)
     pOEMDevmode->dmOEMExtra.dwSignature  = OEM_SIGNATURE;
     pOEMDevmode->dmOEMExtra.dwVersion    = OEM_VERSION;
 
-    //There is nothing to make valid. 
+    // Tuning fields out of range are reset to 'not set', sizes are clamped.
+    if (pOEMDevmode->dwTransportMode > OEMTRANSPORT_MAX)
+    {
+        pOEMDevmode->dwTransportMode = 0;
+    }
+    if (pOEMDevmode->dwWriteCoalesceBytes > OEMWRITECOALESCE_MAX)
+    {
+        pOEMDevmode->dwWriteCoalesceBytes = OEMWRITECOALESCE_MAX;
+    }
+    if (pOEMDevmode->dwRingKB != 0)
+    {
+        pOEMDevmode->dwRingKB = __max(OEMRINGKB_MIN, __min(OEMRINGKB_MAX, pOEMDevmode->dwRingKB));
+    }
+    if (pOEMDevmode->dwQueueDepth > OEMQUEUEDEPTH_MAX)
+    {
+        pOEMDevmode->dwQueueDepth = OEMQUEUEDEPTH_MAX;
+    }
+    if (pOEMDevmode->dwCompressionLevel > OEMCOMPRESSION_MAX)
+    {
+        pOEMDevmode->dwCompressionLevel = 0;
+    }
+    if (pOEMDevmode->dwLogLevel > OEMLOGLEVEL_MAX)
+    {
+        pOEMDevmode->dwLogLevel = 0;
+    }
 
     return TRUE;
 }
 
 
+void SetOEMDevmodeDefaults(POEMDEV pOEMDevmode)
+{
+    if (NULL == pOEMDevmode)
+    {
+        return;
+    }
+
+    // All tuning fields 'not set': the registry settings apply
+    pOEMDevmode->dwTransportMode        = 0;
+    pOEMDevmode->dwWriteCoalesceBytes   = 0;
+    pOEMDevmode->dwRingKB               = 0;
+    pOEMDevmode->dwQueueDepth           = 0;
+    pOEMDevmode->dwCompressionLevel     = 0;
+    pOEMDevmode->dwLogLevel             = 0;
+}
+
+
 
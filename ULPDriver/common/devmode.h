@@ -14,7 +14,7 @@
 //
 //  COMMENT:   No (substantial) modification by UniLogoPrint 2,
 //             but removed ui related code (no property pages supported) 
-//             and some fields in OEMDEV
+//             and some fields in OEMDEV, added per-printer tuning fields (OEM_VERSION 2)
 //
 #pragma once 
 
@@ -22,6 +22,34 @@
 //      OEM Devmode Defines
 ////////////////////////////////////////////////////////
 
+// Value 0 of a tuning field means 'not set': the LogoPrint2 registry setting (or its default) applies
+
+// dwTransportMode
+#define OEMTRANSPORT_PIPE               1       // postscript is streamed to LPSpooler via named pipe
+#define OEMTRANSPORT_MAX                OEMTRANSPORT_PIPE
+
+// dwWriteCoalesceBytes
+#define OEMWRITECOALESCE_MAX            (1024 * 1024)
+
+// dwRingKB
+#define OEMRINGKB_MIN                   16
+#define OEMRINGKB_MAX                   (64 * 1024)
+
+// dwQueueDepth
+#define OEMQUEUEDEPTH_MAX               256
+
+// dwCompressionLevel
+#define OEMCOMPRESSION_OFF              1
+#define OEMCOMPRESSION_FAST             2
+#define OEMCOMPRESSION_BEST             3
+#define OEMCOMPRESSION_MAX              OEMCOMPRESSION_BEST
+
+// dwLogLevel
+#define OEMLOGLEVEL_SAMPLED             1       // hot-path messages are sampled (see LogSample<Category>First/Every)
+#define OEMLOGLEVEL_VERBOSE             2       // every message is logged
+#define OEMLOGLEVEL_FLIGHTRECORDER      3       // sampled, kept in memory and written only on failure
+#define OEMLOGLEVEL_MAX                 OEMLOGLEVEL_FLIGHTRECORDER
+
 
 
 ////////////////////////////////////////////////////////
@@ -31,8 +59,19 @@
 typedef struct tagOEMDEV
 {
     OEM_DMEXTRAHEADER   dmOEMExtra;
+
+    // OEM_VERSION 2: per-printer tuning (0 = not set)
+    DWORD               dwTransportMode;        // OEMTRANSPORT_*
+    DWORD               dwWriteCoalesceBytes;   // postscript collected before it is written to the pipe
+    DWORD               dwRingKB;               // size of the flight-recorder ring
+    DWORD               dwQueueDepth;           // buffers queued by asynchronous writers
+    DWORD               dwCompressionLevel;     // OEMCOMPRESSION_*
+    DWORD               dwLogLevel;             // OEMLOGLEVEL_*
 } OEMDEV;
 
+// Size of OEMDEV of OEM_VERSION 1 (header only)
+#define OEMDEV_SIZE_V1  sizeof(OEM_DMEXTRAHEADER)
+
 typedef OEMDEV *POEMDEV;
 
 typedef const OEMDEV *PCOEMDEV;
@@ -46,4 +85,5 @@ typedef const OEMDEV *PCOEMDEV;
 HRESULT hrOEMDevMode(DWORD dwMode, POEMDMPARAM pOemDMParam);
 BOOL ConvertOEMDevmode(PCOEMDEV pOEMDevIn, POEMDEV pOEMDevOut);
 BOOL MakeOEMDevmodeValid(POEMDEV pOEMDevmode);
+void SetOEMDevmodeDefaults(POEMDEV pOEMDevmode);
 
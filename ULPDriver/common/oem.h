@@ -25,5 +25,5 @@
 ////////////////////////////////////////////////////////
 
 #define OEM_SIGNATURE   'ULP2'
-#define OEM_VERSION     0x00000001L
+#define OEM_VERSION     0x00000002L     // 2: per-printer tuning fields in OEMDEV
 